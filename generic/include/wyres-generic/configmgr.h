@@ -19,11 +19,34 @@
 extern "C" {
 #endif
 
+/*
+ * Config store in a byte addressable PROM (hal_bsp_nvm*). By default values are rewritten in place; with CFG_LOG_STORE
+ * they are instead appended to a log over 2 banks (compacted when full), to spread the wear of frequently written keys.
+ * Each key's index entry and value are crc checked at boot, and a key that fails is dropped on its own (it gets its
+ * default value when next used) rather than the whole config being reset. Small values are cached in RAM
+ * (CFG_CACHE_ENTRIES) to avoid repeated PROM reads.
+ */
 // Use this macro to define unique config key within your 'bloc'
 #define CFGKEY(__m, __k) (((__m & 0xff) << 8) | (__k & 0xff))
 typedef void (*CFG_CBFN_t)(void* ctx, uint16_t key);
+// Change listeners are called once per set or commit : key is the first changed key they listen to, and ctx points to
+// a CFG_CHANGES_t of all the keys changed (which can include keys they don't listen to). A deferred listener gets the
+// keys queued for it since its last call.
+typedef struct {
+    const uint16_t* keys;
+    uint8_t nkeys;
+} CFG_CHANGES_t;
 
 bool CFMgr_registerCB(CFG_CBFN_t cb);
+/*
+ * Register a listener only told of changes to the keys of the given module (the key MSB). Registering the same cb
+ * again (with the same deferred flag) adds another module to it.
+ * If deferred, the cb is called from the default event queue rather than in the context of the set/commit (several
+ * changes of a key before it runs are only told once).
+ */
+bool CFMgr_registerModuleCB(CFG_CBFN_t cb, uint8_t module, bool deferred);
+// Register a listener only told of changes to keys between keyMin and keyMax (inclusive)
+bool CFMgr_registerKeyRangeCB(CFG_CBFN_t cb, uint16_t keyMin, uint16_t keyMax, bool deferred);
 bool CFMgr_addElementDef(uint16_t key, uint8_t len, void* initdata);
 /*
  * Get a config key value into *data, creating the entry if it does not exist using the *data value and the given length
@@ -33,10 +56,63 @@ bool CFMgr_getOrAddElement(uint16_t key, void* data, uint8_t len);
  * Helper getOrAdd calls for specific int types that check range
  */
 bool CFMgr_getOrAddElementCheckRangeUINT32(uint16_t key, uint32_t* data, uint32_t min, uint32_t max);
+bool CFMgr_getOrAddElementCheckRangeUINT16(uint16_t key, uint16_t* data, uint16_t min, uint16_t max);
 bool CFMgr_getOrAddElementCheckRangeUINT8(uint16_t key, uint8_t* data, uint8_t min, uint8_t max);
 bool CFMgr_getOrAddElementCheckRangeINT32(uint16_t key, int32_t* data, int32_t min, int32_t max);
+bool CFMgr_getOrAddElementCheckRangeINT16(uint16_t key, int16_t* data, int16_t min, int16_t max);
 bool CFMgr_getOrAddElementCheckRangeINT8(uint16_t key, int8_t* data, int8_t min, int8_t max);
 
+/*
+ * Config schema : a module declares its keys in a table, each with a RAM variable (its 'mirror') and a default (and
+ * a range for ints). CFMgr_registerSchema() (from the module's init) loads them all in one go, writing any missing or
+ * bad ones with their default. The mirrors then always hold the current values.
+ * eg
+ *  static const CFG_SCHEMA_t _schema[] = {
+ *      CFG_SCHEMA_INT(MY_KEY_PERIOD, UINT32, _ctx.period, 10, 3600, 60),
+ *      CFG_SCHEMA_BLOB(MY_KEY_EUI, _ctx.eui, NULL),     // NULL : default is the content of _ctx.eui at registration
+ *  };
+ *  CFMgr_registerSchema(_schema, CFG_SCHEMA_SZ(_schema));
+ */
+typedef enum { CFG_TYPE_BLOB, CFG_TYPE_UINT8, CFG_TYPE_INT8, CFG_TYPE_UINT16, CFG_TYPE_INT16, CFG_TYPE_UINT32, CFG_TYPE_INT32 } CFG_TYPE_t;
+#define CFG_TYPESZ_UINT8 1
+#define CFG_TYPESZ_INT8 1
+#define CFG_TYPESZ_UINT16 2
+#define CFG_TYPESZ_INT16 2
+#define CFG_TYPESZ_UINT32 4
+#define CFG_TYPESZ_INT32 4
+typedef struct {
+    uint16_t key;
+    uint8_t type;           // CFG_TYPE_t
+    uint8_t len;
+    void* mirror;
+    int64_t min;            // range of int values
+    int64_t max;
+    int64_t def;            // default of int values
+    const void* defData;    // default of blob values (NULL to use the mirror's content)
+} CFG_SCHEMA_t;
+// (the mirror variable must have the size of the type : it won't compile otherwise)
+#define CFG_SCHEMA_INT(__key, __type, __var, __min, __max, __def) \
+    { (__key), CFG_TYPE_##__type, sizeof(__var) + 0*sizeof(char[(sizeof(__var)==CFG_TYPESZ_##__type)?1:-1]), \
+        &(__var), (__min), (__max), (__def), NULL }
+#define CFG_SCHEMA_BLOB(__key, __var, __def) \
+    { (__key), CFG_TYPE_BLOB, sizeof(__var), &(__var), 0, 0, 0, (__def) }
+#define CFG_SCHEMA_SZ(__s) (sizeof(__s)/sizeof(__s[0]))
+// false (not registered) if a key is already declared or the defaults could not be written
+bool CFMgr_registerSchema(const CFG_SCHEMA_t* schema, uint8_t nb);
+// Typed access to declared int keys : get reads the mirror, set checks the range. false if not declared with the type
+bool CFMgr_getSchemaUINT32(uint16_t key, uint32_t* v);
+bool CFMgr_setSchemaUINT32(uint16_t key, uint32_t v);
+bool CFMgr_getSchemaINT32(uint16_t key, int32_t* v);
+bool CFMgr_setSchemaINT32(uint16_t key, int32_t v);
+bool CFMgr_getSchemaUINT16(uint16_t key, uint16_t* v);
+bool CFMgr_setSchemaUINT16(uint16_t key, uint16_t v);
+bool CFMgr_getSchemaINT16(uint16_t key, int16_t* v);
+bool CFMgr_setSchemaINT16(uint16_t key, int16_t v);
+bool CFMgr_getSchemaUINT8(uint16_t key, uint8_t* v);
+bool CFMgr_setSchemaUINT8(uint16_t key, uint8_t v);
+bool CFMgr_getSchemaINT8(uint16_t key, int8_t* v);
+bool CFMgr_setSchemaINT8(uint16_t key, int8_t v);
+
 /* 
  * get an element value, returning its length, into a buffer of size maxlen
  * returns -1 if key not found
@@ -46,6 +122,59 @@ uint8_t CFMgr_getElementLen(uint16_t key);
 bool CFMgr_setElement(uint16_t key, void* data, uint8_t len);
 bool CFMgr_resetElement(uint16_t key);
 void CFMgr_iterateKeys(int keymodule, CFG_CBFN_t cb, void* cbctx);
+/*
+ * Delete a key, or change the length of its value (keeping the start of the value, new bytes are 0).
+ * Listeners are told as for a set. Not allowed during a transaction.
+ * The PROM space freed is reclaimed by compaction : a bit at each boot, when a new key needs the space, or by calling
+ * CFMgr_compact() (at most maxWrites bytes written each time, returns true once all space is reclaimed).
+ */
+bool CFMgr_deleteElement(uint16_t key);
+bool CFMgr_resizeElement(uint16_t key, uint8_t newlen);
+bool CFMgr_compact(uint16_t maxWrites);
+
+/*
+ * Transactions : between txnBegin and txnCommit, setElement/resetElement calls are staged in RAM (and getElement
+ * returns the staged values). txnCommit writes them all in one go, such that after a power fail either all or none
+ * of them are applied. Listeners are only told after the commit. txnAbort drops the staged changes.
+ * A transaction belongs to the task that began it, which must commit or abort it : any other task accessing the config
+ * meanwhile waits until then (so a txnBegin from another task waits, rather than failing). If the staging space is
+ * exceeded, the set fails and so will the commit.
+ */
+bool CFMgr_txnBegin(void);
+bool CFMgr_txnCommit(void);
+void CFMgr_txnAbort(void);
+// Listener called once with the set of keys changed by each commit (or a single key for a set outside a transaction)
+typedef void (*CFG_CHANGES_CBFN_t)(void* ctx, const uint16_t* keys, uint8_t nkeys);
+bool CFMgr_registerChangesCB(CFG_CHANGES_CBFN_t cb);
+
+/*
+ * Bulk export/import : all keys (or those of one module, -1 for all) as a CBOR map of key -> byte string value.
+ * exportCBOR returns the blob length, or -1 if it does not fit in buf.
+ * importCBOR checks the whole blob before writing, then writes it in 1 transaction (all or nothing) : a blob that
+ * does not fit in one (CFG_TXN_MAX_KEYS/CFG_TXN_BUF_SZ) is refused.
+ * Returns the number of keys written or -1. Not allowed during a transaction.
+ */
+int CFMgr_exportCBOR(int keymodule, uint8_t* buf, uint16_t bufsz);
+int CFMgr_importCBOR(const uint8_t* blob, uint16_t len);
+
+// Get the number of reads served by the RAM value cache (hits) or the PROM (misses) since boot
+void CFMgr_getCacheStats(uint32_t* hits, uint32_t* misses);
+
+// PROM access counts (only if CFG_NVM_STATS is set). writeBytes/valueBytes is the write amplification of the store.
+typedef struct {
+    uint32_t reads;         // read calls
+    uint32_t readBytes;
+    uint32_t writes;        // write calls
+    uint32_t writeBytes;
+    uint32_t unlocks;       // PROM unlock/lock cycles
+    uint32_t valueBytes;    // bytes of the values given to set/add/commit calls
+} CFG_NVM_STATS_t;
+void CFMgr_getNvmStats(CFG_NVM_STATS_t* stats);
+void CFMgr_resetNvmStats(void);
+// Power fail test : reset the device after nbytes more bytes are written to PROM (only if CFG_NVM_STATS is set).
+// -1 to cancel. unittest_cfg_powerfail() (run by CFMgr_init() in UNITTEST builds) uses it to check the recovery from
+// a reset at each byte of some changes.
+void CFMgr_setPowerFailAfter(uint32_t nbytes);
 
 // Define module ids here as unique values 1-255. Module 0 is for basic untilites (who can manage their keys between them..)
 // NEVER REDEFINE A VALUE UNLESS OK TO CLEAR DEVICE CONFIG AFTER UPGRADE
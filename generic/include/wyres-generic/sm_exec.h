@@ -17,6 +17,7 @@
 #include <mcu/mcu.h>
 
 #include "os/os.h"
+#include "wyres-generic/wconsole.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,6 +34,8 @@ typedef enum { SM_ENTER=10000, SM_EXIT, SM_TIMEOUT } SM_EVENT_TYPE_t;
 typedef int8_t SM_STATE_ID_t;
 // Special value to return to stay in same state
 #define SM_STATE_CURRENT (-1)
+// Special value to return when the event is not handled by this state : it is passed to its parent state (if none, it is ignored)
+#define SM_STATE_PARENT (-2)
 
 // Each state's function must return the id of the next state to transition, or the value SM_STATE_CURRENT to stay in the same one
 // Note that the event 'e' is an int as the event list (SM_EVENT_TYEP_t) can be extended for each SM
@@ -43,22 +46,39 @@ typedef struct {
     SM_STATE_ID_t id;         // this is the enum
     const char* name;           // for debug logs
     SM_STATE_FN_t fn;           // the function that deals with events in this state
+    uint8_t parent;             // optional : SM_PARENT(id of the enclosing state), 0 (not set) for a top level state
 } SM_STATE_t;
+// Nested states : the SM is always in one state of the table, but when the state function returns SM_STATE_PARENT for
+// an event, the event is given to its parent (and so on up), so events common to several states are dealt with in
+// one place. On a transition, the states are EXITed from the current one up to (not including) the first parent it
+// shares with the destination, then ENTERed from below that parent down to the destination, outermost first. ENTER
+// and EXIT are never passed up. eg {.id=MS_GETTING_FIX, .name="GettingFix", .fn=State_GettingFix, .parent=SM_PARENT(MS_RUNNING)}
+#define SM_PARENT(__id) ((uint8_t)((__id)+1))
 
 typedef void* SM_ID_t;      // Id is actually pointer to internal struct
 
 /* Caller is responsible for building the array of state fns as a static structure. (MUST BE STATIC FOR LIFETIME OF EXECUTION)
- * The order is not important, only the mapping between the .id and the .fn.
+ * The table must be in id order (entry i has .id=i, the ids being 0 to number of states-1), so states are found by
+ * direct index (checked by sm_init(), which asserts if not). SM_CHECK_TABLE() checks at compile time that the table
+ * has an entry per state.
  * eg:
-SM_STATE_t _mySM[MS_LAST] = {
+SM_STATE_t _mySM[] = {
     {.id=MS_IDLE, .name="Idle", .fn=State_Idle},
     {.id=MS_GETTING_GPS, .name="GettingGPS", .fn=State_GettingGPS},
     {.id=MS_GETTING_BLE, .name="GettingBLE", .fn=State_GettingBLE},    
     {.id=MS_SENDING_DM, .name="SendingDM", .fn=State_SendingDM},    
 };
+SM_CHECK_TABLE(_mySM, MS_LAST);
  * Call sm_init() with with this table, its size, and the initial state, and the ctx arg passed to state functions (can be NULL)
  */
+#define SM_CHECK_TABLE(__t, __nb) typedef char __t##_must_have_an_entry_per_state[((sizeof(__t)/sizeof(__t[0]))==(__nb))?1:-1]
 SM_ID_t sm_init(const char* name, const SM_STATE_t* stateTable, uint8_t sz, SM_STATE_ID_t initialState, void* ctxarg);
+/*
+ * As sm_init(), but the SM is run by the task of the given lane (0 to SM_LANES-1, each lane task having its own
+ * priority, stack and event list). Use a separate lane for SMs with slow state functions, or time critical ones.
+ * If the lane is not configured in this build, lane 0 is used (ie the same as sm_init()).
+ */
+SM_ID_t sm_initLane(const char* name, const SM_STATE_t* stateTable, uint8_t sz, SM_STATE_ID_t initialState, void* ctxarg, uint8_t lane);
 /*
  * To start your state machine do 
 sm_start(id):
@@ -66,15 +86,35 @@ sm_start(id):
  */
 bool sm_start(SM_ID_t id);
 // Send an event to the given state machine. Note that e is an int as the event list can be extended
+// Can be called from any task, callout or interrupt handler. Never blocks or allocates : returns false if the event
+// list is full (SM_MAX_EVENTS), in which case the event is dropped and counted.
 bool sm_sendEvent(SM_ID_t id, int e, void* data);
-// Start a timer for tms milliseconds. This will generate a SM_TIMEOUT event.
-void sm_timer_start(SM_ID_t id, uint32_t tms);
+// Send an event with a copy of len bytes of payload : the state function gets 'data' pointing to the copy (word aligned),
+// valid only during the call, so the sender can reuse its buffer straight away. Payloads up to SM_EVENT_PAYLOAD_SZ are
+// carried in the event itself, bigger ones (up to SM_PAYLOAD_BLOCK_SZ) in a block of the payload pool that is released
+// once the state function returns. Returns false (and counts a drop) if the event list is full, or the payload is too
+// big or the pool empty. Can be called from interrupt handlers.
+bool sm_sendEventData(SM_ID_t id, int e, const void* payload, uint8_t len);
+// Coalesce event e for this SM (call after sm_init(), before sending it) : at most one e is then pending in the event
+// list at a time. Sending e while one is already waiting replaces its data/payload (keeping its place in the list) rather
+// than adding another, so a burst of e (eg a fix or scan update every line) can't fill the list and push out other
+// events. Only for events where the latest value is all that matters. Timer events are never coalesced. Returns false
+// if the SM already has SM_MAX_COALESCE coalesced events.
+bool sm_coalesceEvent(SM_ID_t id, int e);
+// Number of events dropped for this SM (or for all SMs if id is NULL) as the event list was full
+uint32_t sm_getDroppedEvents(SM_ID_t id);
+// Number of timer starts refused for this SM (or for all SMs if id is NULL) as the timer pool was empty
+uint32_t sm_getTimerFails(SM_ID_t id);
+// Start a timer for tms milliseconds. This will generate a SM_TIMEOUT event. Returns false if the timer pool is empty.
+bool sm_timer_start(SM_ID_t id, uint32_t tms);
 // Stop the timer. Note this is automatically done for you when state changes
 void sm_timer_stop(SM_ID_t id);
 // Start timer for tms ms from now that will send event e to SM id when it pops. If there is already a timer for event e, the
 // timeout is reset to tms ms from now. If the current state of the SM changes, these timers ARE NOT STOPPED (to allow cross-state timer)
 // If a timer is already running for this SM with this event, it is reset (stop/start) even if it has already popped but not yet been executed.
-void sm_timer_startE(SM_ID_t id, uint32_t tms, int e);
+// Timers come from a pool shared by all SMs (SM_TIMER_POOL_SZ), so there is no per-SM limit on how many can be running.
+// Returns false (logged, and counted in sm_getTimerFails()) if the pool is empty : no event e will then arrive.
+bool sm_timer_startE(SM_ID_t id, uint32_t tms, int e);
 // Stop the timer that is sending event e
 void sm_timer_stopE(SM_ID_t id, int e);
 
@@ -83,6 +123,45 @@ SM_STATE_ID_t sm_getCurrentState(SM_ID_t id);
 
 /** default log for unhandled event in a state to make debugging easier and centralised */
 void sm_default_event_log(SM_ID_t id, const char* log, int e);
+
+/*
+ * Tracing and profiling (build with SM_TRACE=1, else these do nothing). Every event handled (or dropped as stale) is
+ * recorded in a ring of the last SM_TRACE_SZ records, and histograms are kept of the time spent in each state (dwell)
+ * and of the time between an event being sent and being handled (latency) for each SM/event.
+ * Histogram buckets are in os ticks : 0, <8, <64, <512, <4096, <32768, <262144, more.
+ */
+// Console command to add to the app's wconsole command table, eg {"AT+SMTRACE", "SM trace [states|events|log [n]|dump|clear|on|off]", sm_atcmd_trace}
+ATRESULT sm_atcmd_trace(PRINTLN_t pfn, uint8_t nargs, char* argv[]);
+/*
+ * Copy len bytes of the binary trace blob, starting at offset off, into buf. Returns the number of bytes copied (0 once
+ * past the end), or -1 if tracing is not enabled. Pause the trace (sm_traceEnable(false)) while reading it in pieces.
+ * Blob (little endian) :
+ *  header      : version(1)=1, nb buckets(1), nb SMs(1), nb event stats(1), nb records(2), record size(1), 0(1)
+ *  per SM      : lane(1), nb states with stats(1) (0 if none), current state(1), 0(1), ticks in current state(4),
+ *                then per state (by id) : total dwell ticks(4), dwell histogram(2 per bucket)
+ *  per event   : SM index(1), 0(1), event(2), max latency ticks(4), latency histogram(2 per bucket)
+ *  records     : oldest first, each : ticks(4), SM index(1), from state(1), to state(1) (-1 if no change),
+ *                flags(1) (bit 0 : stale timer event, not run), event(2), ticks in state function(s)(2)
+ */
+int sm_traceDump(uint8_t* buf, uint16_t off, uint16_t len);
+// Pause/restart recording (enabled at boot)
+void sm_traceEnable(bool on);
+// Empty the ring and reset all histograms
+void sm_traceClear(void);
+
+/*
+ * Virtual time (build with SM_SIM=1) : for unit tests or host builds with stand-in os calls. After sm_simStart(), the
+ * lane tasks and the kernel callout are no longer used : the SMs (and their timers) only run inside sm_simRun(), which
+ * executes the pending events then jumps the virtual clock straight to the next timer deadline, so an hour of mostly
+ * idle SM time takes as long as the events in it. Drive the SMs by sending them events between runs. There is no way
+ * back to real time (except for unittest_sm(), which init_sm_exec() runs in UNITTEST builds before any other SM exists
+ * and then resets the SMs).
+ */
+void sm_simStart(void);
+// Run for ms of virtual time (0 : just execute what is pending). Returns the number of events executed.
+uint32_t sm_simRun(uint32_t ms);
+// Current virtual time in ticks (os time if not simulating) : also used for the SM_TRACE timestamps
+os_time_t sm_simTime(void);
 #ifdef __cplusplus
 }
 #endif
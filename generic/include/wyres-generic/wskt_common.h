@@ -24,8 +24,10 @@ extern "C" {
 
 // This is how big your buffer should be at a minimum in the event you use to open a socket
 #define WSKT_BUF_SZ MYNEWT_VAL(WSKT_BUF_SZ)
+// Pending rx lines per socket (by reference sockets only, copy mode ones have just their buffer)
+#define WSKT_RXQ_SZ MYNEWT_VAL(WSKT_RXQ_SZ)
 
-// Callback for flush ioctl result
+// Callback for async socket operation result (eg wskt_closeAfterDrain())
 typedef void (*WSKT_CBFN_t)(int8_t result);
 
 /* api for socket-like devices */
@@ -36,12 +38,44 @@ typedef void (*WSKT_CBFN_t)(int8_t result);
 #define SKT_TIMEOUT   (-4)
 #define SKT_ALREADY   (-5)
 
+// Fragments for wskt_writev() : written in order, without building the whole line first
+typedef enum { WSKT_IOVT_DATA, WSKT_IOVT_STR, WSKT_IOVT_HEX, WSKT_IOVT_INT } WSKT_IOV_TYPE_t;
+typedef struct wskt_iov {
+    uint8_t type;           // WSKT_IOV_TYPE_t
+    uint16_t len;           // DATA : bytes at data, HEX : bytes at data (each written as 2 lowercase hex digits)
+    const void* data;       // STR : null terminated string
+    int32_t val;            // INT : value written in decimal
+} wskt_iov_t;
+#define WSKT_IOV_DATA(p, l) { .type=WSKT_IOVT_DATA, .len=(l), .data=(p) }
+#define WSKT_IOV_STR(s)     { .type=WSKT_IOVT_STR, .data=(s) }
+#define WSKT_IOV_HEX(p, l)  { .type=WSKT_IOVT_HEX, .len=(l), .data=(p) }
+#define WSKT_IOV_INT(v)     { .type=WSKT_IOVT_INT, .val=(v) }
+
+// What to lose when a socket's rx queue is full
+typedef enum { WSKT_RXQ_DROP_NEWEST, WSKT_RXQ_DROP_OLDEST } WSKT_RXQ_POLICY_t;
+
 typedef struct wskt {
     void* dev;          // wskt_device_t* for the driver
     struct os_event* evt;
     struct os_eventq* eq;
+    struct wskt* next;  // next open socket on the same device (list owned by wsktmgr)
+    bool rxRef;         // rx lines given by reference (evt had no buffer at open) rather than copied
+    uint8_t rxqPolicy;  // WSKT_RXQ_POLICY_t
+    uint8_t rxqHead;    // oldest pending line
+    uint8_t rxqNb;
+    const uint8_t* rxq[WSKT_RXQ_SZ];      // pending lines (we hold a ref on each)
+    uint32_t rxDrops;   // lines this socket lost (queue full, or no free line buffer)
+    struct os_event* txDoneEvt;     // posted to txDoneEq once the device tx is drained (one shot)
+    struct os_eventq* txDoneEq;
+    bool closing;       // closeAfterDrain pending
+    bool drained;       // (else closing on timeout)
+    WSKT_CBFN_t closeCb;
+    struct os_callout drainTimer;   // its event does the pending close, on drain or timeout
 } wskt_t;
 
+// Give back a reference to a shared rx line buffer (see wskt_rxTake() / wskt_lineAlloc())
+void wskt_lineRelease(const void* line);
+
 typedef enum { IOCTL_PWRON, IOCTL_PWROFF, IOCTL_RESET, IOCTL_SET_BAUD, IOCTL_FILTERASCII, IOCTL_SETEOL, 
     IOCTL_SELECTUART, IOCTL_FLUSHTXRX, IOCTL_CHECKTX } wskt_ioctl_cmd;
 typedef struct wskt_ioctl {
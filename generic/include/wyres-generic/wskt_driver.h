@@ -18,6 +18,7 @@
 
 #include "os/os_eventq.h"
 #include "wskt_common.h"
+#include "circbuf.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -30,23 +31,51 @@ typedef struct wskt_devicefns {
     int (*ioctl)(wskt_t* s, wskt_ioctl_t* cmd);
     int (*write)(wskt_t* s, uint8_t* data, uint32_t sz);
     int (*close)(wskt_t*s);
+    int (*writev)(wskt_t* s, const wskt_iov_t* iov, uint8_t niov);     // optional
 } wskt_devicefns_t;
 
 
 typedef struct wskt_device {
     wskt_devicefns_t* device_fns;
     void* device_cfg;
+    wskt_t* skts;           // open sockets on this device, linked via wskt_t.next
+    uint8_t nbSkts;
+    bool txBusy;            // data written and not yet out of the hardware
     char dname[MAX_WKST_DNAME_SZ];
 } wskt_device_t;
 
+// Handle returned by wskt_registerDevice, drivers keep it to find their open sockets without a name lookup
+typedef void* WSKT_DEV_t;
+
 #define WSKT_DEVICE_CFG(skt) (((wskt_device_t*)(skt->dev))->device_cfg)
 #define WSKT_DEVICE_FNS(skt) (((wskt_device_t*)(skt->dev))->device_fns)
 
 // DEVICE API
-// To register devices at init
-void wskt_registerDevice(const char* device, wskt_devicefns_t* dfns, void* dcfg);
+// To register devices at init. Returns the device handle
+WSKT_DEV_t wskt_registerDevice(const char* device, wskt_devicefns_t* dfns, void* dcfg);
+// First open socket on the device (NULL if none), walk the rest via skt->next.
+// List changes are done in a critical section, so this is safe to walk from an ISR.
+wskt_t* wskt_getSocketList(WSKT_DEV_t dev);
+// Count of open sockets on the device (O(1))
+uint8_t wskt_getNbOpenSockets(WSKT_DEV_t dev);
 // get open sockets on my device - caller gives an array of pointers of size bsz to copy them into
+// (by name, prefer the handle based calls above in drivers)
 uint8_t wskt_getOpenSockets(const char* device, wskt_t** sbuf, uint8_t bsz);
+// Get a shared rx line buffer of WSKT_BUF_SZ for a line on this device (NULL if pool empty, which counts as a drop on
+// each of the device's sockets). Caller has the first reference. ISR safe.
+uint8_t* wskt_lineAlloc(WSKT_DEV_t dev);
+// Hand a filled line (len includes the null terminator) to each socket open on the device : by reference sockets queue
+// a reference (applying their policy if full), the others get a copy in their buffer unless the previous one is still
+// pending. ISR safe. The caller still has to release its own reference after.
+uint8_t wskt_lineDeliver(WSKT_DEV_t dev, uint8_t* line, uint16_t len);
+// Drivers that can tell when their tx has left the hardware call these for drain notifications :
+// txQueued in the same critical section as the data is added to the tx buffer, txDrained with the tx buffer empty and
+// the last byte sent (ISR, or in a critical section). ISR safe.
+void wskt_txQueued(WSKT_DEV_t dev);
+void wskt_txDrained(WSKT_DEV_t dev);
+// For writev : bytes the fragments will take once encoded, and encode them into a tx buffer (caller checked the space)
+uint32_t wskt_iovSize(const wskt_iov_t* iov, uint8_t niov);
+void wskt_iovPush(const wskt_iov_t* iov, uint8_t niov, circ_bbuf_t* buf);
 
 #ifdef __cplusplus
 }
@@ -27,6 +27,12 @@ extern "C" {
 // open new socket to a device instance. If NULL rturned then the device is not accessible : 
 //  - doesnt exist
 // The evt must have its arg pointing to the correct thing for this device eg a buffer to receive into of at least WSKT_BUF_SZ
+// If the evt arg is NULL then rx lines are not copied : they are queued on the socket (up to WSKT_RXQ_SZ), and the event
+// handler gets each one by reference with wskt_rxTake() (loop till NULL), giving it back with wskt_lineRelease() once done.
+// These lines are shared with other sockets so are read only. They come from a pool of WSKT_LINE_POOL_NB buffers for all
+// the devices : each by reference socket only gets its share of it (the queue is shortened as more are opened), so a
+// consumer that is slow to take its lines has them dropped (see wskt_setRxQPolicy(), wskt_getRxDrops()) rather than
+// holding every buffer. If the pool is still empty when a line arrives, it is lost (and counted) for all of its sockets.
 // add callback fn for skt state changes?
 wskt_t* wskt_open(const char* device, struct os_event* evt, struct os_eventq* eq);
 // configure specific actions on the device. Conflictual commands from multiple sockets are not advised... 
@@ -34,9 +40,25 @@ wskt_t* wskt_open(const char* device, struct os_event* evt, struct os_eventq* eq
 int wskt_ioctl(wskt_t* skt, wskt_ioctl_t* cmd);
 // Send data to the device. This will be interleaved with other open sockets on the same device on a block basis
 int wskt_write(wskt_t* skt, uint8_t* data, uint32_t sz);
+// Send a set of fragments (see wskt_iov_t), as one block. All or nothing like wskt_write (SKT_NOSPACE if it doesn't fit)
+// If the device's driver has no writev, each fragment is sent by its own wskt_write : the block can then be cut where
+// the tx buffer filled up, or interleaved with other writers.
+int wskt_writev(wskt_t* skt, const wskt_iov_t* iov, uint8_t niov);
 // indicate done using this device. Your skt variable will be set to NULL after to avoid any unpleasentness
 // Any remaining data is flushed out before shutting down the device (if this was the last cnx)
 int wskt_close(wskt_t** skt);
+// In the rx event handler of a by reference socket : take the oldest pending line (NULL if none or socket was closed)
+const char* wskt_rxTake(struct os_event* evt);
+// Post evt to eq once everything written so far on the device has left the hardware (straight away if nothing pending).
+// One shot. As the tx buffer is shared, writes on other sockets of the device can delay it.
+int wskt_notifyTxDrained(wskt_t* skt, struct os_event* evt, struct os_eventq* eq);
+// Close once the device tx has drained (or after WSKT_DRAIN_TIMEOUT_MS), then cbfn is called (from the default task, or
+// directly if nothing to wait for) with SKT_NOERR or SKT_TIMEOUT. No more rx is given, and skt is set to NULL at once.
+int wskt_closeAfterDrain(wskt_t** skt, WSKT_CBFN_t cbfn);
+// Choose which line is lost when the rx queue is full (default WSKT_RXQ_DROP_NEWEST)
+void wskt_setRxQPolicy(wskt_t* skt, WSKT_RXQ_POLICY_t p);
+// Count of rx lines lost by this socket
+uint32_t wskt_getRxDrops(wskt_t* skt);
 
 #ifdef __cplusplus
 }
@@ -137,6 +137,8 @@ bool unittest(const char* tn, bool res);
 // add your unittest fns here
 bool unittest_gps();
 bool unittest_cfg();
+bool unittest_cfg_powerfail();
+bool unittest_sm();
 #endif 
 
 #ifdef __cplusplus
@@ -49,6 +49,7 @@ static struct os_task _l96_task_str;
 
 static struct L96DeviceCfg {
     char dname[MAX_WKST_DNAME_SZ];
+    WSKT_DEV_t wdev;
     bool active;
 #if MYNEWT_VAL(USE_BUS_I2C)
     struct bus_i2c_node_cfg i2cCfg;
@@ -74,6 +75,7 @@ static int L96_I2C_open(wskt_t* skt);
 static int L96_I2C_ioctl(wskt_t* skt, wskt_ioctl_t* cmd);
 static int L96_I2C_write(wskt_t* skt, uint8_t* data, uint32_t sz);
 static int L96_I2C_close(wskt_t* skt);
+static int L96_I2C_writev(wskt_t* skt, const wskt_iov_t* iov, uint8_t niov);
 //static int addRxByte(struct L96DeviceCfg* myCfg, uint8_t c);
 static void i2c_rx_cb(struct os_event* e);
 static void i2c_tx_cb(struct os_event* e);
@@ -82,14 +84,13 @@ static wskt_devicefns_t _myDevice = {
     .open = &L96_I2C_open,
     .ioctl = &L96_I2C_ioctl,
     .write = &L96_I2C_write,
-    .close = &L96_I2C_close
+    .close = &L96_I2C_close,
+    .writev = &L96_I2C_writev
 };
 
 
-static uint8_t _rxLineBuffer[L96_LINE_SZ];
 static uint8_t _i2cLineBuffer[L96_LINE_SZ];
 // mutex to protect it (only used in passing)
-static struct os_mutex _lbRXMutex;
 static struct os_mutex _lbI2CMutex;
 static struct os_eventq _l96eventQ;
 
@@ -99,7 +100,6 @@ void L96_I2C_comm_init(void) {
     // TODO should we use mempools to handle per-device structures?
         // Create eventQ
     os_eventq_init(&_l96eventQ);
-    os_mutex_init(&_lbRXMutex);
     os_mutex_init(&_lbI2CMutex);
         // Create the comm handler task
     os_task_init(&_l96_task_str, "l96_task", l96_comm_task, NULL, L96COMM_TASK_PRIO,
@@ -115,6 +115,8 @@ bool L96_I2C_comm_create(char* dname, const char* i2cname, uint8_t i2caddr, int
     }
     struct L96DeviceCfg* myCfg = &_cfgs[_nbL96Cfgs++];
     myCfg->active=false;        // no active sockets yet
+    strncpy(myCfg->dname, dname, MAX_WKST_DNAME_SZ-1);
+    myCfg->dname[MAX_WKST_DNAME_SZ-1] = '\0';
 #if MYNEWT_VAL(USE_BUS_I2C)
     myCfg->i2cCfg.node_cfg.bus_name=i2cname;
     myCfg->i2cCfg.node_cfg.lock_timeout_ms=0;
@@ -147,7 +149,7 @@ bool L96_I2C_comm_create(char* dname, const char* i2cname, uint8_t i2caddr, int
 #endif /* USE_BUS_I2C */
     if (rc==0) {
         // and register ourselves as a 'uart like' comms provider so procesing routines can read the data
-        wskt_registerDevice(dname, &_myDevice, myCfg);
+        myCfg->wdev = wskt_registerDevice(dname, &_myDevice, myCfg);
         return true;
     } else {
         // No L96 found, soz
@@ -200,6 +202,11 @@ static int L96_I2C_ioctl(wskt_t* skt, wskt_ioctl_t* cmd) {
     return SKT_NOERR; 
 }
 static int L96_I2C_write(wskt_t* skt, uint8_t* data, uint32_t sz) {
+    // just a single fragment writev
+    wskt_iov_t iov = WSKT_IOV_DATA(data, sz);
+    return L96_I2C_writev(skt, &iov, 1);
+}
+static int L96_I2C_writev(wskt_t* skt, const wskt_iov_t* iov, uint8_t niov) {
     struct L96DeviceCfg* cfg=((struct L96DeviceCfg*)WSKT_DEVICE_CFG(skt));  
 
     if (!cfg->active) {
@@ -207,18 +214,21 @@ static int L96_I2C_write(wskt_t* skt, uint8_t* data, uint32_t sz) {
         return SKT_NODEV;
     }
     circ_bbuf_t* buf = &cfg->txBuff;
+    uint32_t sz = wskt_iovSize(iov, niov);
+    // protect against other writers / the tx task popping
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
     // check if space in buffer for ALL the data
     if (sz>circ_bbuf_free_space(buf)) {
+        OS_EXIT_CRITICAL(sr);
         log_noout("no space in buffer for line of sz %d...", sz);
         // if not, don't take any
         return SKT_NOSPACE;
     }
-    // Mutex protect
-    // copy it in
-    for(int i=0; i<sz; i++) {
-        circ_bbuf_push(buf, data[i]);
-    }
-    // mutex release
+    // encode it straight in
+    wskt_iovPush(iov, niov, buf);
+    wskt_txQueued(cfg->wdev);
+    OS_EXIT_CRITICAL(sr);
 
     // Tell task to try more tx data if not already on it
     os_eventq_put(&_l96eventQ, &(cfg->txEvt));
@@ -228,7 +238,7 @@ static int L96_I2C_close(wskt_t* skt) {
     struct L96DeviceCfg* cfg=((struct L96DeviceCfg*)WSKT_DEVICE_CFG(skt));  
 
     // Iff last skt then power down
-    if (wskt_getOpenSockets(cfg->dname, NULL, 0)<=1) {
+    if (wskt_getNbOpenSockets(cfg->wdev)<=1) {
         cfg->active=false;
         // clean buffers
         circ_bbuf_init(&cfg->rxBuff, &(cfg->rxBuff_data_space[0]), L96_LINE_SZ+1);
@@ -252,51 +262,30 @@ static int addRxByte(struct L96DeviceCfg* myCfg, uint8_t c) {
     circ_bbuf_push(&(myCfg->rxBuff), c);
     // if full or CR, copy to all sockets (get list from wskt mgr)
     if (c=='\n' || circ_bbuf_free_space(&(myCfg->rxBuff))==0) {
-        // Send event to be processed by task? or just do it here?
-        // copy out line first to local STATIC buffer (stack space!)
-        // MUTEX
-        os_mutex_pend(&_lbRXMutex, OS_TIMEOUT_NEVER);
-        uint8_t lineLen = 0;
-        bool copied = false;
-        while(!copied && lineLen<L96_LINE_SZ) {
-            if (circ_bbuf_pop(&(myCfg->rxBuff), &(_rxLineBuffer[lineLen]))<0) {
-                // done, its empty
-                _rxLineBuffer[lineLen] = '\n';
-                copied = true;
-            } else {
-                // did we just copy a CR?
-                if (_rxLineBuffer[lineLen]=='\n') {
-                    // done, EOL
-                    copied = true;                
-                }
+        // pop line (with its CR) straight into a shared line buffer, and give it to each socket
+        // If nobody listening or no buffer free, the line is just dropped
+        uint8_t* line = NULL;
+        if (wskt_getNbOpenSockets(myCfg->wdev)>0) {
+            line = wskt_lineAlloc(myCfg->wdev);
+        }
+        uint16_t lineLen = 0;
+        uint8_t lc = 0;
+        while(lc!='\n' && circ_bbuf_pop(&(myCfg->rxBuff), &lc)==0) {
+            if (line!=NULL && lineLen<(L96_LINE_SZ-2)) {
+                line[lineLen++] = lc;
             }
-            lineLen++;
         }
-        // Make it a null terminated string
-        _rxLineBuffer[lineLen++] = '\0';
-        os_mutex_release(&_lbRXMutex);
-        log_noout("%s for line for listeners", myCfg->dname);
-        // now send it off
-        wskt_t* os[8];      // no more than 8 open sockets on my device please
-        uint8_t ns = wskt_getOpenSockets(myCfg->dname, &(os[0]), 8);
-        // For each socket
-        for(int i=0;i<ns;i++) {
-            // get event out of socket
-            struct os_event* e = os[i]->evt;
-            if (e!=NULL) {
-                if (e->ev_queued==false) {
-                    // if already on their q then... discard for this guy???
-                } else {
-                    // else copy in line (including the null terminator)
-                    uint8_t* sbuf = (uint8_t*)(e->ev_arg);
-                    memcpy(_rxLineBuffer, sbuf, lineLen);
-                    // and post event to the listener's task
-                    os_eventq_put(os[i]->eq, e);
-                }
-            } else {
-                // ok, this guy doesn't care about RX - thats ok...
+        if (line!=NULL) {
+            if (lineLen==0 || line[lineLen-1]!='\n') {
+                line[lineLen++] = '\n';
             }
-        }        
+            // Make it a null terminated string
+            line[lineLen++] = '\0';
+            log_noout("%s for line for listeners", myCfg->dname);
+            wskt_lineDeliver(myCfg->wdev, line, lineLen);
+            // done with our ref
+            wskt_lineRelease(line);
+        }
     }
 
     // return -1 if no more rx space
@@ -377,5 +366,11 @@ static void i2c_tx_cb(struct os_event* e) {
         // and come back in a few ms to see if anything else to do
         os_callout_reset(&(cfg->txtimer), OS_TICKS_PER_SEC/10);
     }
-    // tx empty, can wait for a write to kick us
+    // tx empty (the I2C writes are synchronous so its all gone), can wait for a write to kick us
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    if (circ_bbuf_data_available(&(cfg->txBuff))==0) {
+        wskt_txDrained(cfg->wdev);
+    }
+    OS_EXIT_CRITICAL(sr);
 }
@@ -20,38 +20,239 @@
 #include "wyres-generic/wutils.h"
 
 #include "wyres-generic/configmgr.h"
+#include "cbor.h"
+#if MYNEWT_VAL(CFG_NVM_STATS)
+#include "hal/hal_system.h"
+#endif
 
-#define MAX_KEYS 200 //MYNEWT_VAL(CFG_MAX_KEYS)
+// Size of the key index table in PROM : this is fixed by the PROM layout, DO NOT CHANGE (or all device configs are lost)
+#define NVM_MAX_KEYS 200
+// Size of the RAM copy of the index : limits the number of keys this build can use
+#define MAX_KEYS MYNEWT_VAL(CFG_MAX_KEYS)
 #define INDEX_SIZE  (5)
 #define NVM_HDR_SIZE (0x10)
-#define MAX_CFG_CBS 10
+#define MAX_CFG_CBS MYNEWT_VAL(CFG_MAX_CBS)
+#define MAX_SCHEMAS MYNEWT_VAL(CFG_MAX_SCHEMAS)
+#define NOTIFY_Q_SZ MYNEWT_VAL(CFG_NOTIFY_QUEUE_SZ)
+// Buffer size used when copying/checking values in PROM
+#define CFG_COPY_CHUNK (16)
+#define TXN_MAX_KEYS MYNEWT_VAL(CFG_TXN_MAX_KEYS)
+#define TXN_BUF_SZ MYNEWT_VAL(CFG_TXN_BUF_SZ)
+#define CACHE_ENTRIES MYNEWT_VAL(CFG_CACHE_ENTRIES)
+#define CACHE_VAL_SZ MYNEWT_VAL(CFG_CACHE_VAL_SZ)
+// Index layout header copies and per slot crc table, at the end of the PROM : see layout description below
+#define IDX_HDR_SIZE (8)
+#define IDX_HDR_MAGIC (0xC5)
+#define IDX_HDR_VERSION (2)
+#define IDX_TAIL_SIZE (2*IDX_HDR_SIZE+NVM_MAX_KEYS)
+// Number of index entries read at once at boot
+#define IDX_LOAD_BURST (8)
+
+#if !MYNEWT_VAL(CFG_LOG_STORE)
+// Transaction journal descriptor in the PROM header RFU bytes : see layout description below
+#define TXN_DESC_OFF (6)
+#define TXN_DESC_SIZE (7)
+#define TXN_MAGIC (0xA5)
+#define TXN_JENTRY_HDR_SIZE (3)
+// journal size for moving a value of len l during compaction (value, new index entry + its crc, old slot len)
+#define IDX_MOVE_JSIZE(l) (4*TXN_JENTRY_HDR_SIZE+(l)+INDEX_SIZE+1)
+#endif
+
+#if MYNEWT_VAL(CFG_LOG_STORE)
+// Log store : see layout description below
+#define LOG_BANK_HDR_SIZE (8)
+#define LOG_REC_HDR_SIZE (6)
+#define LOG_MAGIC_0 (0xCF)       // > NVM_MAX_KEYS so never a valid nbKeys for the index layout
+#define LOG_MAGIC_1 (0x10)
+#define LOG_COMPACT_PC MYNEWT_VAL(CFG_LOG_COMPACT_PC)
+#endif
+
+#if (MAX_KEYS>NVM_MAX_KEYS)
+#error "CFG_MAX_KEYS cannot be greater than the PROM index size (200)"
+#endif
+#if (MAX_CFG_CBS>32)
+#error "CFG_MAX_CBS cannot be greater than 32 (listener bitmaps are 32 bits)"
+#endif
+#if (TXN_MAX_KEYS>255)
+#error "CFG_TXN_MAX_KEYS cannot be greater than 255"
+#endif
+
+// RAM copy of a PROM index entry, kept sorted by key so lookups never touch the PROM
+typedef struct {
+    uint16_t key;
+    uint16_t off;       // offset of value in PROM
+    uint8_t len;
+    uint8_t slot;       // position of this key's entry in the PROM index table (not used for log store)
+} CFG_IDX_t;
+
+// A change listener : told of changes to keys whose module is in its bitmap, or that are in its key range
+typedef struct {
+    CFG_CBFN_t cb;
+    uint32_t modules[8];    // bitmap of the 256 modules
+    uint16_t keyMin;        // key range (empty if keyMin>keyMax)
+    uint16_t keyMax;
+    bool deferred;          // called from the default eventq
+} CFG_LISTENER_t;
 
 struct cfg {
-    uint8_t nbKeys;
+    uint8_t nbKeys;         // number of entries in PROM index table (number of distinct keys for log store)
+    uint8_t nbIdx;          // number of entries in RAM index (==nbKeys unless PROM has more keys than we can handle)
     uint16_t indexStart;
     uint16_t storeStart;
-    uint16_t storeOffset;
+    uint16_t storeOffset;       // next free byte in store (tail of the log for log store)
+    uint16_t storeEnd;          // end of space for the store (index layout)
+    bool idxFull;               // PROM has more keys than the RAM index can hold
+    bool crcs;                  // index entries have crcs (false for an index layout store from an older build)
+    uint8_t bank;               // active bank (0 or 1) for log store, active header copy for index layout
+    uint16_t gen;               // its generation
+#if MYNEWT_VAL(CFG_LOG_STORE)
+    uint16_t seq;               // sequence number of next record appended
+    uint16_t liveBytes;         // space the latest records of all the keys would take once compacted
+    struct os_event compactEv;
+#endif
+    struct os_mutex lock;       // all PROM and index accesses, as the background compaction runs in another task
     uint8_t nCBs;
-    CFG_CBFN_t cbList[MAX_CFG_CBS];
-    // use table in PROM directly to avoid using up the RAM
-//    struct {
-//        uint16_t key;
-//        uint8_t len;
-//        uint16_t off;
-//    } indexTable[MAX_KEYS];
+    CFG_LISTENER_t cbList[MAX_CFG_CBS];
+    uint8_t nChangesCBs;
+    CFG_CHANGES_CBFN_t changesCBList[MAX_CFG_CBS];
+    uint8_t nSchemas;
+    struct {
+        const CFG_SCHEMA_t* s;
+        uint8_t n;
+    } schemas[MAX_SCHEMAS];
+    CFG_IDX_t index[MAX_KEYS];
 } _cfg;     // all inited to 0 by definition (bss)
 
+// A value change staged in a transaction
+typedef struct {
+    uint16_t key;
+    uint16_t boff;      // offset of value in txn buffer
+    uint8_t len;
+    uint16_t noff;      // where it got written in PROM (log store)
+} CFG_TXN_KEY_t;
+
+#if CACHE_ENTRIES>0
+// Cache of recently read (small) values
+static struct {
+    uint16_t tick;          // incremented at each access, for LRU
+    uint32_t hits;
+    uint32_t misses;
+    struct {
+        uint16_t key;       // CFG_KEY_ILLEGAL if entry not used
+        uint16_t used;      // tick of last access
+        uint8_t len;
+        uint8_t data[CACHE_VAL_SZ];
+    } e[CACHE_ENTRIES];
+} _cache;
+#endif
+
+// Keys changed, waiting to be told to the deferred listeners (bitmap) that want them
+static struct {
+    struct os_event ev;
+    uint8_t n;
+    struct {
+        uint16_t key;
+        uint32_t cbs;
+    } q[NOTIFY_Q_SZ];
+} _notify;
+
+#if MYNEWT_VAL(CFG_NVM_STATS)
+static CFG_NVM_STATS_t _nvmStats;
+static int32_t _nvmFailAfter = -1;      // bytes that can be written before a reset, -1 for never
+#define NVM_STAT_ADD(__f, __n) (_nvmStats.__f += (__n))
+#else
+#define NVM_STAT_ADD(__f, __n)
+#endif
+
+static struct {
+    bool active;
+    bool failed;        // staging space exceeded : commit will fail
+    struct os_task* owner;      // task that began it : the only one that stages in it and sees its values
+    uint8_t nKeys;
+    uint16_t bufUsed;
+    CFG_TXN_KEY_t keys[TXN_MAX_KEYS];
+    uint8_t buf[TXN_BUF_SZ];
+} _txn;
+
 static void cfgLockR();
 static void cfgUnlockR();
 static void cfgLockW();
 static void cfgUnlockW();
+static uint8_t nvmRead8(uint16_t off);
+static uint16_t nvmRead16(uint16_t off);
+static bool nvmRead(uint16_t off, uint8_t len, uint8_t* buf);
+static bool nvmWrite8(uint16_t off, uint8_t v);
+static bool nvmWrite16(uint16_t off, uint16_t v);
+static bool nvmWrite(uint16_t off, uint8_t len, uint8_t* buf);
 
-static int createKey(uint16_t k, uint8_t l, uint8_t* d);
-static int findKeyIdx(uint16_t k);
+static CFG_IDX_t* createKey(uint16_t k, uint8_t l, uint8_t* d);
+static CFG_IDX_t* findKeyIdx(uint16_t k);
+static int findKeyPos(uint16_t k);
+static CFG_IDX_t* addKeyIdx(uint16_t k, uint8_t l, uint16_t off, uint8_t slot);
+static void removeKeyIdx(CFG_IDX_t* ke);
+static bool deleteKey(CFG_IDX_t* ke);
+static bool resizeKey(CFG_IDX_t* ke, uint8_t l);
+static bool compactStore(uint16_t maxWrites);
+static bool writeValue(CFG_IDX_t* ke, uint8_t* d);
+static bool idxLoad();
+static void idxLoadEntry(int slot, uint8_t* ie, uint8_t crc);
+static bool idxReadHdr(uint8_t c, uint16_t* gen, uint8_t* nbKeys);
+static bool idxEntryCrc(uint8_t* ie, uint8_t* crc);
+static uint16_t idxHdrOff(uint8_t c);
+static uint16_t idxCrcOff(int slot);
+static CFG_TXN_KEY_t* txnFind(uint16_t k);
+static bool txnMine();
+static bool txnRunning();
+static bool txnStage(uint16_t k, uint8_t l, uint8_t* d);
+static void txnReset();
+static bool txnApply();
+static uint8_t crc8(uint8_t crc, uint8_t* d, int l);
+static bool readValue(CFG_IDX_t* ke, uint8_t* d, uint8_t len);
+static void cacheUpdate(uint16_t k, uint8_t l, uint8_t* d);
+static void cacheInvalidate(uint16_t k);
+#if MYNEWT_VAL(CFG_LOG_STORE)
+static void logInit();
+static int logAppend(uint16_t k, uint8_t l, uint8_t* d, CFG_IDX_t* src);
+static bool logSameValue(CFG_IDX_t* ke, uint8_t* d);
+static bool logCompact();
+static void logCompactEv(struct os_event* ev);
+#else
+// A journal entry (index layout)
+typedef struct {
+    uint16_t off;       // where it goes
+    uint8_t len;
+    uint8_t* d;         // data, or NULL to copy from PROM at from (0s if from is 0, never a value's offset)
+    uint16_t from;
+    int16_t crcSlot;    // index slot whose crc must be updated once this is written, or -1
+} CFG_JENTRY_t;
+static bool idxJournalCommit(CFG_JENTRY_t* je, int n, uint16_t jOff, uint8_t nbKeys);
+static bool idxTxnReplay();
+static bool idxWriteNbKeys(uint8_t n);
+static bool idxUpdateCrc(int slot);
+static void idxAddCrcs();
+static void idxResetHdrs();
+static bool idxCompact(uint16_t maxWrites);
+static int idxDeadSpace();
+static CFG_IDX_t* findSlotIdx(int s);
+static bool idxStoreFits(uint16_t newData, uint8_t maxNewLen);
 static uint16_t getIdxKey(int idx);
 static uint8_t getIdxLen(int idx);
 static uint16_t getIdxOff(int idx);
+#endif
 static void informListeners(uint16_t key);
+static int cborImport(const uint8_t* blob, uint16_t len, bool apply);
+static bool txnStageNext(uint16_t k, uint8_t l, void* d);
+static const CFG_SCHEMA_t* schemaFind(uint16_t key);
+static bool schemaValid(const CFG_SCHEMA_t* e, const uint8_t* d, uint8_t len);
+static void schemaSetInt(const CFG_SCHEMA_t* e, uint8_t* d, int64_t v);
+static bool schemaLoad(const CFG_SCHEMA_t* e);
+static void schemaRefresh(uint16_t key);
+static bool cborGetHead(const uint8_t* b, uint16_t blen, uint16_t* pos, uint8_t* major, uint32_t* arg);
+static void informKeyListeners(const uint16_t* keys, uint8_t nkeys);
+static void notifyQueue(uint16_t key, uint32_t cbs);
+static bool addListener(CFG_CBFN_t cb, uint8_t module, uint16_t keyMin, uint16_t keyMax, bool deferred);
+static void notifyEv(struct os_event* ev);
+static void informChangesListeners(const uint16_t* keys, uint8_t nkeys);
 #ifndef RELEASE_BUILD
 void dumpCfg();
 #endif /* RELEASE_BUILD */
@@ -59,38 +260,159 @@ void dumpCfg();
 
 // Register a callback fn for whenever the cfg changes
 bool CFMgr_registerCB(CFG_CBFN_t cb) {
-    if (_cfg.nCBs>=MAX_CFG_CBS) {
+    return addListener(cb, 0, 0, 0xFFFF, false);
+}
+// Register a callback fn for changes to the keys of a module
+bool CFMgr_registerModuleCB(CFG_CBFN_t cb, uint8_t module, bool deferred) {
+    cfgLockR();
+    // Already got this cb for another module?
+    for(int i=0;i<_cfg.nCBs;i++) {
+        CFG_LISTENER_t* l = &_cfg.cbList[i];
+        if (l->cb==cb && l->deferred==deferred && l->keyMin>l->keyMax) {
+            l->modules[module>>5] |= (1u << (module & 0x1f));
+            cfgUnlockR();
+            return true;
+        }
+    }
+    cfgUnlockR();
+    return addListener(cb, module, 1, 0, deferred);
+}
+// Register a callback fn for changes to a range of keys
+bool CFMgr_registerKeyRangeCB(CFG_CBFN_t cb, uint16_t keyMin, uint16_t keyMax, bool deferred) {
+    if (keyMin>keyMax) {
+        return false;
+    }
+    return addListener(cb, 0, keyMin, keyMax, deferred);
+}
+// Register a callback fn to be told of each set of changes (ie once per transaction)
+bool CFMgr_registerChangesCB(CFG_CHANGES_CBFN_t cb) {
+    if (_cfg.nChangesCBs>=MAX_CFG_CBS) {
         return false;
     }
     if (cb==NULL) {
         return false;
     }
-    _cfg.cbList[_cfg.nCBs++] = cb;
+    cfgLockR();
+    _cfg.changesCBList[_cfg.nChangesCBs++] = cb;
+    cfgUnlockR();
+    return true;
+}
+
+// Declare a module's keys (the table must stay valid, normally it is const). All its keys are loaded in one go into
+// their RAM mirrors : missing keys, or values out of range, get the default, and are written in one transaction.
+// After this, sets out of range are refused, and the mirrors follow all changes to the keys.
+// Returns false (and the table is not registered) if a key is already declared, or the defaults could not be written.
+// The mirrors are valid anyway.
+bool CFMgr_registerSchema(const CFG_SCHEMA_t* schema, uint8_t nb) {
+    if (_cfg.nSchemas>=MAX_SCHEMAS || txnRunning()) {
+        return false;
+    }
+    // A key can only be declared once
+    for(int i=0;i<nb;i++) {
+        bool dup = (schemaFind(schema[i].key)!=NULL);
+        for(int j=0;j<i && !dup;j++) {
+            dup = (schema[j].key==schema[i].key);
+        }
+        if (dup) {
+            log_noout("CFG schema key %4x already declared", schema[i].key);
+            return false;
+        }
+    }
+    bool ret = true;
+    bool missing = false;
+    // Keys whose length is different in this build are resized first (not possible during a transaction)
+    for(int i=0;i<nb;i++) {
+        uint8_t len = CFMgr_getElementLen(schema[i].key);
+        if (len!=0 && len!=schema[i].len) {
+            log_noout("CFG schema key %4x len %d now %d", schema[i].key, len, schema[i].len);
+            CFMgr_resizeElement(schema[i].key, schema[i].len);
+        }
+    }
+    CFMgr_txnBegin();
+    for(int i=0;i<nb;i++) {
+        const CFG_SCHEMA_t* e = &schema[i];
+        if (!schemaLoad(e)) {
+            // missing or out of range : use the default
+            if (e->type!=CFG_TYPE_BLOB) {
+                schemaSetInt(e, e->mirror, e->def);
+            } else if (e->defData!=NULL) {
+                memcpy(e->mirror, e->defData, e->len);
+            }
+            // (else the mirror's initial content is the default, as for getOrAddElement)
+            if (!txnStageNext(e->key, e->len, e->mirror)) {
+                log_noout("CFG schema FAIL key %4x", e->key);
+                ret = false;
+            }
+            missing = true;
+        }
+    }
+    if (!missing || !ret) {
+        CFMgr_txnAbort();       // nothing to write, or failed
+    } else if (!CFMgr_txnCommit()) {
+        log_noout("CFG schema FAIL writing defaults");
+        ret = false;
+    }
+    if (!ret) {
+        return false;
+    }
+    cfgLockR();
+    _cfg.schemas[_cfg.nSchemas].s = schema;
+    _cfg.schemas[_cfg.nSchemas].n = nb;
+    _cfg.nSchemas++;
+    cfgUnlockR();
     return true;
 }
 
+// Typed accessors of declared keys, generated per int type : get gives the RAM mirror, set checks the range and
+// writes it (the mirror follows). Both fail if the key is not declared with that type.
+static const CFG_SCHEMA_t* schemaFindTyped(uint16_t key, uint8_t type) {
+    const CFG_SCHEMA_t* e = schemaFind(key);
+    return (e!=NULL && e->type==type)?e:NULL;
+}
+#define CFG_SCHEMA_FN(__T, __t) \
+bool CFMgr_getSchema##__T(uint16_t key, __t* v) { \
+    const CFG_SCHEMA_t* e = schemaFindTyped(key, CFG_TYPE_##__T); \
+    if (e==NULL) { \
+        return false; \
+    } \
+    memcpy(v, e->mirror, sizeof(__t)); \
+    return true; \
+} \
+bool CFMgr_setSchema##__T(uint16_t key, __t v) { \
+    if (schemaFindTyped(key, CFG_TYPE_##__T)==NULL) { \
+        return false; \
+    } \
+    return CFMgr_setElement(key, &v, sizeof(__t)); \
+}
+CFG_SCHEMA_FN(UINT32, uint32_t)
+CFG_SCHEMA_FN(INT32, int32_t)
+CFG_SCHEMA_FN(UINT16, uint16_t)
+CFG_SCHEMA_FN(INT16, int16_t)
+CFG_SCHEMA_FN(UINT8, uint8_t)
+CFG_SCHEMA_FN(INT8, int8_t)
+
 // Add a new element definition key. If the key is already known AND has the same len, this is a noop. 
 // If the key exists but has a different length, false is returned.
 // If the key is unknown, it is added to the dictionary and the value is set to that of initdata.
 bool CFMgr_addElementDef(uint16_t key, uint8_t len, void* initdata) {
     bool ret = false;
     cfgLockR();
-    int idx = findKeyIdx(key);
-    if (idx>=0) {
-        if (getIdxLen(idx) == len) {
+    CFG_IDX_t* ke = findKeyIdx(key);
+    if (ke!=NULL) {
+        if (ke->len == len) {
             ret = true;
         } else {
             ret = false;       // exists already but with different len!
         }
     } else {
         cfgLockW();
-        idx = createKey(key, len, (uint8_t*)initdata);
+        ke = createKey(key, len, (uint8_t*)initdata);
         cfgUnlockW();
-        ret = (idx>=0);
-        if (idx<0) {
-            log_noout("CFGAE:FAIL CK %4x at idx %d", key, idx);
+        ret = (ke!=NULL);
+        if (ke==NULL) {
+            log_noout("CFGAE:FAIL CK %4x", key);
         } else {
-            log_noout("CFGAE: CK %4x at idx %d", key, idx);
+            log_noout("CFGAE: CK %4x at slot %d", key, ke->slot);
         }
     }
     cfgUnlockR();
@@ -100,140 +422,94 @@ bool CFMgr_addElementDef(uint16_t key, uint8_t len, void* initdata) {
 bool CFMgr_getOrAddElement(uint16_t key, void* data, uint8_t len) {
     bool ret = false;
     cfgLockR();
-    int idx = findKeyIdx(key);
-    if (idx<0) {
+    CFG_IDX_t* ke = findKeyIdx(key);
+    CFG_TXN_KEY_t* tk = txnFind(key);
+    if (tk!=NULL) {
+        // staged value in current transaction
+        memcpy(data, &_txn.buf[tk->boff], (tk->len>len)?len:tk->len);
+        ret = true;
+    } else if (ke==NULL) {
         cfgLockW();
-        idx = createKey(key, len, (uint8_t*)data);
+        ke = createKey(key, len, (uint8_t*)data);
         cfgUnlockW();
-        ret = (idx>=0);
-        if (idx<0) {
-            log_noout("CFGGE:FAIL CK %4x at idx %d", key, idx);
+        ret = (ke!=NULL);
+        if (ke==NULL) {
+            log_noout("CFGGE:FAIL CK %4x", key);
         } else {
-            log_noout("CFGGE:CK %4x at idx %d", key, idx);
+            log_noout("CFGGE:CK %4x at slot %d", key, ke->slot);
         }
     } else {
         // read data
         // Check the given buffer length is correct for the key
-        uint8_t klen = getIdxLen(idx);
+        uint8_t klen = ke->len;
         if (klen>len) {
             // incorrect code?
-            log_noout("CFGGE:WARN CK %4x at idx %d KL %d DL %d", key, idx, klen, len);
+            log_noout("CFGGE:WARN CK %4x at slot %d KL %d DL %d", key, ke->slot, klen, len);
             // continue in case just caller limiting buffer size
             klen = len;
         }
-        ret = hal_bsp_nvmRead(getIdxOff(idx), klen, (uint8_t*)data);
+        ret = readValue(ke, (uint8_t*)data, klen);
     }
     cfgUnlockR();
     return ret;
 }
 
 // Helper getOrAdd methods for specific int types that check the range
-bool CFMgr_getOrAddElementCheckRangeUINT32(uint16_t key, uint32_t* data, uint32_t min, uint32_t max) {
+static bool getOrAddCheckRange(uint16_t key, void* data, uint8_t type, uint8_t len, int64_t min, int64_t max) {
     // get the value
-    uint32_t cv = 0;
-    int len = CFMgr_getElement(key, &cv, sizeof(uint32_t));
-    if (len==-1) {
+    uint8_t cv[4];
+    int clen = CFMgr_getElement(key, cv, len);
+    if (clen==-1) {
         // create with given default (which we will assume is valid...)
-        CFMgr_getOrAddElement(key, data, sizeof(uint32_t));
+        CFMgr_getOrAddElement(key, data, len);
         return true;
     }
-    if (len!=sizeof(uint32_t)) {
+    if (clen!=len) {
         return false;       // this should not happen
     }
     // Check configured value is ok
-    if (cv>=min && cv<=max) {
+    CFG_SCHEMA_t e = { .key=key, .type=type, .len=len, .min=min, .max=max };
+    if (schemaValid(&e, cv, len)) {
         // ok value, return it
-        *data = cv;
+        memcpy(data, cv, len);
         return true;
     }
     // Overwrite the bad value with default to ensure ok from now
-    CFMgr_setElement(key, data, sizeof(uint32_t));
-    return false;       // it was bad...
-}
-
-bool CFMgr_getOrAddElementCheckRangeUINT8(uint16_t key, uint8_t* data, uint8_t min, uint8_t max) {
-    // get the value
-    uint8_t cv = 0;
-    int len = CFMgr_getElement(key, &cv, sizeof(uint8_t));
-    if (len==-1) {
-        // create with given default (which we will assume is valid...)
-        CFMgr_getOrAddElement(key, data, sizeof(uint8_t));
-        return true;
-    }
-    if (len!=sizeof(uint8_t)) {
-        return false;       // this should not happen
-    }
-    // Check configured value is ok
-    if (cv>=min && cv<=max) {
-        // ok value, return it
-        *data = cv;
-        return true;
-    }
-    // Overwrite the bad value with default?
-    CFMgr_setElement(key, data, sizeof(uint8_t));
-    return false;       // it was bad...
-}
-bool CFMgr_getOrAddElementCheckRangeINT32(uint16_t key, int32_t* data, int32_t min, int32_t max) {
-    // get the value
-    int32_t cv = 0;
-    int len = CFMgr_getElement(key, &cv, sizeof(int32_t));
-    if (len==-1) {
-        // create with given default (which we will assume is valid...)
-        CFMgr_getOrAddElement(key, data, sizeof(int32_t));
-        return true;
-    }
-    if (len!=sizeof(int32_t)) {
-        return false;       // this should not happen
-    }
-    // Check configured value is ok
-    if (cv>=min && cv<=max) {
-        // ok value, return it
-        *data = cv;
-        return true;
-    }
-    // Overwrite the bad value with default?
-    CFMgr_setElement(key, data, sizeof(int32_t));
+    CFMgr_setElement(key, data, len);
     return false;       // it was bad...
 }
-bool CFMgr_getOrAddElementCheckRangeINT8(uint16_t key, int8_t* data, int8_t min, int8_t max) {
-        // get the value
-    int8_t cv = 0;
-    int len = CFMgr_getElement(key, &cv, sizeof(int8_t));
-    if (len==-1) {
-        // create with given default (which we will assume is valid...)
-        CFMgr_getOrAddElement(key, data, sizeof(int8_t));
-        return true;
-    }
-    if (len!=sizeof(int8_t)) {
-        return false;       // this should not happen
-    }
-    // Check configured value is ok
-    if (cv>=min && cv<=max) {
-        // ok value, return it
-        *data = cv;
-        return true;
-    }
-    // Overwrite the bad value with default?
-    CFMgr_setElement(key, data, sizeof(int8_t));
-    return false;       // it was bad...
+#define CFG_CHECKRANGE_FN(__T, __t) \
+bool CFMgr_getOrAddElementCheckRange##__T(uint16_t key, __t* data, __t min, __t max) { \
+    return getOrAddCheckRange(key, data, CFG_TYPE_##__T, sizeof(__t), min, max); \
 }
+CFG_CHECKRANGE_FN(UINT32, uint32_t)
+CFG_CHECKRANGE_FN(INT32, int32_t)
+CFG_CHECKRANGE_FN(UINT16, uint16_t)
+CFG_CHECKRANGE_FN(INT16, int16_t)
+CFG_CHECKRANGE_FN(UINT8, uint8_t)
+CFG_CHECKRANGE_FN(INT8, int8_t)
 
 // get a config value into the data buffer, of size maxlen.
 // Returns the actual length of the element returned, or -1 if the key does not exist
 int CFMgr_getElement(uint16_t key, void* data, uint8_t maxlen) {
     int len = 0;
     cfgLockR();
-    int idx = findKeyIdx(key);
-    if (idx<0) {
+    CFG_IDX_t* ke = findKeyIdx(key);
+    CFG_TXN_KEY_t* tk = txnFind(key);
+    if (tk!=NULL) {
+        // staged value in current transaction
+        len = (tk->len>maxlen)?maxlen:tk->len;
+        memcpy(data, &_txn.buf[tk->boff], len);
+    } else if (ke==NULL) {
         len = -1;      // no such key
     } else {
         // read data
-        len = getIdxLen(idx);
+        len = ke->len;
         // limit to buffer given!
         if (len>maxlen) {
             len = maxlen;
         }
-        if (hal_bsp_nvmRead(getIdxOff(idx), len, (uint8_t*)data)==false) {
+        if (readValue(ke, (uint8_t*)data, len)==false) {
             len = -1;      // fail
         }
     }
@@ -243,9 +519,12 @@ int CFMgr_getElement(uint16_t key, void* data, uint8_t maxlen) {
 uint8_t CFMgr_getElementLen(uint16_t key) {
     uint8_t ret = 0;
     cfgLockR();
-    int idx = findKeyIdx(key);
-    if (idx>=0) {
-        ret = getIdxLen(idx);
+    CFG_IDX_t* ke = findKeyIdx(key);
+    CFG_TXN_KEY_t* tk = txnFind(key);
+    if (tk!=NULL) {
+        ret = tk->len;
+    } else if (ke!=NULL) {
+        ret = ke->len;
     }
     cfgUnlockR();
     return ret;
@@ -253,27 +532,42 @@ uint8_t CFMgr_getElementLen(uint16_t key) {
 // Set an element value. Creates key if unknown if it can
 bool CFMgr_setElement(uint16_t key, void* data, uint8_t len) {
     bool ret = false;
+    const CFG_SCHEMA_t* se = schemaFind(key);
+    if (se!=NULL && !schemaValid(se, (uint8_t*)data, len)) {
+        log_noout("CFGSE:FAIL SK %4x out of schema range", key);
+        return false;
+    }
     cfgLockR();
-    int idx = findKeyIdx(key);
-    if (idx<0) {
+    CFG_IDX_t* ke = findKeyIdx(key);
+    if (txnMine()) {
+        // Just stage it : written (and key created if required) at commit, which tells the listeners
+        if (ke!=NULL && ke->len!=len) {
+            log_noout("CFGSE:FAIL TK %4x bad len %d should be %d", key, len, ke->len);
+        } else {
+            ret = txnStage(key, len, (uint8_t*)data);
+        }
+        cfgUnlockR();
+        return ret;
+    }
+    if (ke==NULL) {
         cfgLockW();
-        idx = createKey(key, len, (uint8_t*)data);
+        ke = createKey(key, len, (uint8_t*)data);
         cfgUnlockW();
-        ret = (idx>=0);
-        if (idx<0) {
-            log_noout("CFGSE:FAIL CK %4x at idx %d", key, idx);
+        ret = (ke!=NULL);
+        if (ke==NULL) {
+            log_noout("CFGSE:FAIL CK %4x", key);
         } else {
-            log_noout("CFGSE:CK %4x at idx %d", key, idx);
+            log_noout("CFGSE:CK %4x at slot %d", key, ke->slot);
         }
     } else {
-        uint8_t klen = getIdxLen(idx);
+        uint8_t klen = ke->len;
         if (len==klen) {
             // Write data
             cfgLockW();
-            ret = hal_bsp_nvmWrite(getIdxOff(idx), getIdxLen(idx), (uint8_t*)data);
+            ret = writeValue(ke, (uint8_t*)data);
             cfgUnlockW();
         } else {
-            log_noout("CFGSE:FAIL SK %4x at idx %d bad len %d should be %d", key, idx, len, klen);
+            log_noout("CFGSE:FAIL SK %4x at slot %d bad len %d should be %d", key, ke->slot, len, klen);
             ret = false;
         }
     }
@@ -288,17 +582,26 @@ bool CFMgr_setElement(uint16_t key, void* data, uint8_t len) {
 bool CFMgr_resetElement(uint16_t key) {
     bool ret = true;
     cfgLockR();
-    int idx = findKeyIdx(key);
-    if (idx<0) {
+    CFG_IDX_t* ke = findKeyIdx(key);
+    if (txnMine()) {
+        // Stage 0 data
+        CFG_TXN_KEY_t* tk = txnFind(key);
+        if (tk!=NULL) {
+            ret = txnStage(key, tk->len, NULL);
+        } else if (ke!=NULL) {
+            ret = txnStage(key, ke->len, NULL);
+        } else {
+            ret = false;
+        }
+        cfgUnlockR();
+        return ret;
+    }
+    if (ke==NULL) {
         ret = false;
     } else {
         // Write 0 data
-        uint8_t vlen = getIdxLen(idx);
-        uint16_t voff = getIdxOff(idx);
         cfgLockW();
-        for(int i=0;i<vlen;i++) {
-            ret &= hal_bsp_nvmWrite8(voff + i, 0);      // any failure sets result to failure
-        }
+        ret = writeValue(ke, NULL);
         cfgUnlockW();
     }
     cfgUnlockR();
@@ -308,232 +611,2144 @@ bool CFMgr_resetElement(uint16_t key) {
     return ret;
 }
 
+// Remove a key and its value. Its space is reclaimed by the next compaction. Not allowed during a transaction.
+bool CFMgr_deleteElement(uint16_t key) {
+    if (txnRunning()) {
+        return false;
+    }
+    bool ret = false;
+    cfgLockR();
+    CFG_IDX_t* ke = findKeyIdx(key);
+    if (ke!=NULL) {
+        cacheInvalidate(key);
+        cfgLockW();
+        ret = deleteKey(ke);
+        cfgUnlockW();
+    }
+    cfgUnlockR();
+    if (ret) {
+        log_noout("CFGDE: DK %4x", key);
+        informListeners(key);
+    }
+    return ret;
+}
+
+// Change the length of a key's value. The start of the current value is kept, and any new bytes are 0.
+// Not allowed during a transaction.
+bool CFMgr_resizeElement(uint16_t key, uint8_t newlen) {
+    if (newlen==0 || txnRunning()) {
+        return false;
+    }
+    bool ret = false;
+    cfgLockR();
+    CFG_IDX_t* ke = findKeyIdx(key);
+    if (ke!=NULL) {
+        if (ke->len==newlen) {
+            cfgUnlockR();
+            return true;        // noop
+        }
+        cacheInvalidate(key);
+        cfgLockW();
+        ret = resizeKey(ke, newlen);
+        cfgUnlockW();
+    }
+    cfgUnlockR();
+    if (ret) {
+        log_noout("CFGRE: RK %4x len %d", key, newlen);
+        informListeners(key);
+    } else {
+        log_noout("CFGRE:FAIL RK %4x len %d", key, newlen);
+    }
+    return ret;
+}
+
+// Reclaim the space of deleted/resized keys, writing at most maxWrites bytes to PROM. Can be called repeatedly
+// (eg when idle) until it returns true, which means there is no more space to reclaim.
+bool CFMgr_compact(uint16_t maxWrites) {
+    if (txnRunning()) {
+        return false;
+    }
+    cfgLockR();
+    cfgLockW();
+    bool ret = compactStore(maxWrites);
+    cfgUnlockW();
+    cfgUnlockR();
+    return ret;
+}
+
 // iterate over all keys, calling cb for each.
 // in the CB the other access methods can be called
+// Keys are given in increasing key order. The CB may create new keys : we always look for the next key after the
+// last one given (rather than using a position in the index) so insertions don't cause keys to be skipped or repeated
 void CFMgr_iterateKeys(int keymodule, CFG_CBFN_t cb, void* cbctx) {
-    int key = 0;
-    for(int i=0;i<_cfg.nbKeys; i++) {
+    uint16_t key = CFG_KEY_ILLEGAL;
+    // if filtering on module, start at the first key of the module (0 is the illegal key so start at 1)
+    int pos = findKeyPos((keymodule>0)?CFGKEY(keymodule, 0):1);
+    while(true) {
         // get each key, but ensure NVM in state to allow CB to call other methods
         cfgLockR();
-        key = getIdxKey(i);
+        if (pos>=_cfg.nbIdx) {
+            cfgUnlockR();
+            return;
+        }
+        key = _cfg.index[pos].key;
         cfgUnlockR();
         // if no keymodule filter, or the key has the correct keymodule as its MSB, give it to CB
         if (keymodule==-1 || (key>>8)==keymodule) {
             (*(cb))(cbctx, key);
+        } else if (keymodule>=0 && (key>>8)>keymodule) {
+            // sorted so no more for this module
+            return;
         }
+        if (key==0xFFFF) {
+            return;     // last possible key
+        }
+        // next key after this one (whatever the CB did to the index)
+        pos = findKeyPos(key+1);
     }
-
-
 }
 
-// Internals
-
-static void informListeners(uint16_t key) {
-    // tell anyone that cares
-    for(int i=0;i<_cfg.nCBs;i++) {
-        (*(_cfg.cbList[i]))(NULL, key);
+// Start staging changes. The lock is kept until the commit/abort, so other tasks wait to access the config until
+// the transaction is done (and never see its staged values). Fails if this task already has a transaction running
+bool CFMgr_txnBegin(void) {
+    cfgLockR();
+    if (_txn.active) {
+        cfgUnlockR();
+        return false;
     }
+    txnReset();
+    _txn.active = true;
+    _txn.owner = os_sched_get_current_task();
+    return true;
 }
-/** PROM layout
-0000 [nbKeys(Pri)] [nbKeys(Sec)] [IdxStart_LSB] [IdxStart_MSB] [StoreStart_LSB] [StoreStart_MSB] [RFU=0]x10
-0010-(0x10+MAX_KEYS*5) [[Key_LSB] [K_MSB] [Len] [StoreOff_LSB][StoreOff_MSB]] x nbKeys (max 200)
- */
 
-/** startup:
- * read nbKeys(Pri), nbKeys(Sec). If sec>pri, nbKeys = pri.
- * read IdxStart (2 bytes). If 0 or > PROM_SIZE, IdxStart=0x0010, nbKeys=0
- * readStoreStart (2 bytes). If 0 or > PROM_SIZE, StoreStart=MAXKEYS*5+0x10, IdxStart=0x0010, nbKeys=0
- * StoreOffset = StoreStart
- * read in Idx, updating StoreOffset at each entry read to be its StoreOff+len.
- */
-void CFMgr_init(void) {
+// Write all staged changes atomically and then tell the listeners
+bool CFMgr_txnCommit(void) {
     cfgLockR();
-    uint8_t nbK_pri = hal_bsp_nvmRead8(0);
-    uint8_t nbK_sec = hal_bsp_nvmRead8(1);
-    if (nbK_sec!=nbK_pri) {
-        // oops. can't log yet
-        log_noout("PROM cfg store corruption (%d, %d)", nbK_pri, nbK_sec);
-        // log our fn address, and continue. Might be ok...
-        log_fn_fn();
+    if (!txnMine()) {
+        cfgUnlockR();
+        return false;
     }
-    _cfg.nbKeys = nbK_pri;
-    _cfg.indexStart = hal_bsp_nvmRead16(2);
-    _cfg.storeStart = hal_bsp_nvmRead16(4);
-    if (_cfg.indexStart<NVM_HDR_SIZE|| _cfg.indexStart>hal_bsp_nvmSize() ||
-             _cfg.storeStart<NVM_HDR_SIZE || _cfg.storeStart>hal_bsp_nvmSize() || 
-             _cfg.storeStart < (_cfg.indexStart+MAX_KEYS*INDEX_SIZE)) {
-        log_noout("CFG BAD, resetting");
-        _cfg.nbKeys=0;
-        _cfg.indexStart=NVM_HDR_SIZE;
-        _cfg.storeStart=_cfg.indexStart + (MAX_KEYS+1)*INDEX_SIZE;
-        _cfg.storeOffset = _cfg.storeStart; 
+    bool ret = false;
+    if (_txn.failed) {
+        log_noout("CFG txn FAIL, too many changes");
+    } else {
+        NVM_STAT_ADD(valueBytes, _txn.bufUsed);
+        // All writes in the same PROM unlock window
         cfgLockW();
-        hal_bsp_nvmWrite8(0,0);
-        hal_bsp_nvmWrite8(1,0);
-        hal_bsp_nvmWrite16(2, _cfg.indexStart);
-        hal_bsp_nvmWrite16(4, _cfg.storeStart);
+        ret = txnApply();
         cfgUnlockW();
-        // just log passage : no assert (as this writes to PROM!)
-        log_fn_fn();
     }
-/*
-    // Calculate where next free space in store it while reading the key index into ram
-    for(int i=0;i<_cfg.nbKeys; i++) {
-        _cfg.indexTable[i].key = nvmRead16(_cfg.indexStart+(i*INDEX_SIZE));
-        _cfg.indexTable[i].len = nvmRead8(_cfg.indexStart+(i*INDEX_SIZE)+2);
-        _cfg.indexTable[i].off = nvmRead16(_cfg.indexStart+(i*INDEX_SIZE)+3);
-        _cfg.storeOffset = _cfg.indexTable[i].off + _cfg.indexTable[i].len;
+    // keep list of keys for listeners, as they may start a new transaction
+    uint16_t keys[TXN_MAX_KEYS];
+    uint8_t nkeys = _txn.nKeys;
+    for(int i=0;i<nkeys;i++) {
+        keys[i] = _txn.keys[i].key;
+        cacheInvalidate(keys[i]);
+        if (ret) {
+            cacheUpdate(keys[i], _txn.keys[i].len, &_txn.buf[_txn.keys[i].boff]);
+        }
     }
-*/
-    if (_cfg.nbKeys==0) {
-        // no keys its at the store start
-        _cfg.storeOffset = _cfg.storeStart;
+    txnReset();
+    cfgUnlockR();
+    cfgUnlockR();       // the lock held since txnBegin
+    if (ret) {
+        log_noout("CFG txn commit %d keys", nkeys);
+        informKeyListeners(keys, nkeys);
+        informChangesListeners(keys, nkeys);
     } else {
-        // Its after the last one
-        _cfg.storeOffset = getIdxOff(_cfg.nbKeys-1) + getIdxLen(_cfg.nbKeys-1);
+        log_noout("CFG txn commit FAIL");
     }
+    return ret;
+}
 
+// Drop staged changes
+void CFMgr_txnAbort(void) {
+    cfgLockR();
+    if (txnMine()) {
+        txnReset();
+        cfgUnlockR();       // the lock held since txnBegin
+    }
     cfgUnlockR();
+}
 
-    // ready to roll
-    // debug
-    log_noout("CFG nbK %d", _cfg.nbKeys);
+typedef struct {
+    CborEncoder map;
+    CborError err;
+} CFG_EXPORT_CTX_t;
 
-//    dumpCfg();
+// Not on the stack of the iterate caller : the export holds the lock so only 1 export at a time uses it
+static uint8_t _exportVal[255];
+static void exportKeyCB(void* ctx, uint16_t key) {
+    CFG_EXPORT_CTX_t* ec = (CFG_EXPORT_CTX_t*)ctx;
+    uint8_t* val = _exportVal;
+    int len = CFMgr_getElement(key, val, sizeof(_exportVal));
+    if (len<=0) {
+        return;
+    }
+    // Once out of space, the encoder just counts the bytes it would need
+    ec->err |= cbor_encode_uint(&ec->map, key);
+    ec->err |= cbor_encode_byte_string(&ec->map, val, len);
 }
 
-/** Adding new key
- * If nbKeys>=200, fail
- * Write index entry to PROM_START+IdxStart+(nbKeys*5) [K, L, StoreOffset]
- * StoreOffset+=len
- * nbKeys++
- * write nbKeys(sec)
- * write nbKeys(pri)
- * Returns index in the table of the new key
- * !! MUST HAVE cfgLockW/cfgUnlockW round this call
- */
-static int createKey(uint16_t k, uint8_t l, uint8_t* d) {
-    assert(l!=0);
-    if (_cfg.nbKeys>=MAX_KEYS) {
-        return -1;       // no joy
+// Write all keys (or only those of the given module, as for CFMgr_iterateKeys) into buf as a CBOR map of
+// key (uint) -> value (byte string). Returns the length of the blob, or -1 if it does not fit
+int CFMgr_exportCBOR(int keymodule, uint8_t* buf, uint16_t bufsz) {
+    CborEncoder enc;
+    CFG_EXPORT_CTX_t ec;
+    ec.err = CborNoError;
+    cbor_encoder_init(&enc, buf, bufsz, 0);
+    // Indefinite length map so the keys are encoded as they are found
+    ec.err |= cbor_encoder_create_map(&enc, &ec.map, CborIndefiniteLength);
+    cfgLockR();
+    CFMgr_iterateKeys(keymodule, &exportKeyCB, &ec);
+    cfgUnlockR();
+    ec.err |= cbor_encoder_close_container(&enc, &ec.map);
+    if (ec.err!=CborNoError) {
+        log_noout("CFG export FAIL %d (need %d more bytes)", ec.err, (int)cbor_encoder_get_extra_bytes_needed(&enc));
+        return -1;
     }
-    if (_cfg.storeOffset+l > hal_bsp_nvmSize()) {
-        return -1;         // full up
+    return cbor_encoder_get_buffer_size(&enc, buf);
+}
+
+// Apply a blob made by CFMgr_exportCBOR(), creating any keys that do not exist. The whole blob is checked before
+// anything is written (an existing key must keep its length). The values are written by 1 transaction, so all or
+// none of them are applied : a blob that does not fit in one (CFG_TXN_MAX_KEYS/CFG_TXN_BUF_SZ) is refused.
+// Not allowed during a transaction. Returns the number of keys written, or -1 if the blob is bad, too big or the
+// commit fails
+int CFMgr_importCBOR(const uint8_t* blob, uint16_t len) {
+    if (txnRunning()) {
+        return -1;
     }
-    int ret = _cfg.nbKeys;
-    // Wrtie to PROM new index entry
-    // check results of PROM accesses and fail nicely
-    if (!hal_bsp_nvmWrite16(_cfg.indexStart+ret*INDEX_SIZE, k)) {
-        log_noout("CFG fail to write at %4x key %4x",_cfg.indexStart+ret*INDEX_SIZE, k);
-        return -1;       // no joy
+    int nkeys = cborImport(blob, len, false);
+    if (nkeys<0) {
+        log_noout("CFG import FAIL bad blob");
+        return -1;
     }
-    if (!hal_bsp_nvmWrite8(_cfg.indexStart+ret*INDEX_SIZE+2, l)) {
-        log_noout("CFG fail to write at %4x len %2x",_cfg.indexStart+ret*INDEX_SIZE, l);
-        return -1;       // no joy
+    if (!CFMgr_txnBegin()) {
+        return -1;
     }
-    if (!hal_bsp_nvmWrite16(_cfg.indexStart+ret*INDEX_SIZE+3, _cfg.storeOffset)) {
-        log_noout("CFG fail to write at %4x off %4x",_cfg.indexStart+ret*INDEX_SIZE, _cfg.storeOffset);
-        return -1;       // no joy
+    if (cborImport(blob, len, true)<0) {
+        CFMgr_txnAbort();
+        log_noout("CFG import FAIL, too big for a transaction");
+        return -1;
     }
-    // update memory copy
-//    _cfg.indexTable[ret].key = k;
-//    _cfg.indexTable[ret].len = l;
-//    _cfg.indexTable[ret].off = _cfg.storeOffset;
-    // Write data into store
-    if (!hal_bsp_nvmWrite(_cfg.storeOffset, l, d)) {
-        log_noout("CFG fail to write data at %4x len %2x",_cfg.storeOffset, l);
-        return -1;       // no joy
+    if (!CFMgr_txnCommit()) {
+        return -1;
     }
+    log_noout("CFG import %d keys", nkeys);
+    return nkeys;
+}
 
-    // Move next free space in store along    
-    _cfg.storeOffset+=l;
-    _cfg.nbKeys++;
-    // Update number of key in index in PROM
-    if (!hal_bsp_nvmWrite8(1, _cfg.nbKeys)) {
-        log_noout("CFG fail to write nbKeysSec %2x",_cfg.nbKeys);
-        // rewind
-        _cfg.storeOffset-=l;
-        _cfg.nbKeys--;
-        return -1;       // no joy
+// Internals
+
+static void informListeners(uint16_t key) {
+    informKeyListeners(&key, 1);
+    informChangesListeners(&key, 1);
+}
+// tell anyone that cares about these keys : now (once, with the first of them it wants and the whole set as ctx), or
+// queue them for the deferred ones
+static void informKeyListeners(const uint16_t* keys, uint8_t nkeys) {
+    CFG_CHANGES_t set = { .keys=keys, .nkeys=nkeys };
+    uint32_t told = 0;
+    for(int k=0;k<nkeys;k++) {
+        schemaRefresh(keys[k]);
     }
-    if (!hal_bsp_nvmWrite8(0, _cfg.nbKeys)) {
-        log_noout("CFG fail to write nbKeysPri %2x",_cfg.nbKeys);
-        // rewind
-        _cfg.storeOffset-=l;
-        _cfg.nbKeys--;
-        return -1;       // no joy
+    for(int k=0;k<nkeys;k++) {
+        uint16_t key = keys[k];
+        uint8_t m = (key >> 8);
+        uint32_t deferred = 0;
+        for(int i=0;i<_cfg.nCBs;i++) {
+            CFG_LISTENER_t* l = &_cfg.cbList[i];
+            if ((key>=l->keyMin && key<=l->keyMax) || (l->modules[m>>5] & (1u << (m & 0x1f)))) {
+                if (l->deferred) {
+                    deferred |= (1u << i);
+                } else if ((told & (1u << i))==0) {
+                    told |= (1u << i);
+                    (*(l->cb))(&set, key);
+                }
+            }
+        }
+        if (deferred!=0) {
+            notifyQueue(key, deferred);
+        }
     }
-
-    return ret;
 }
-
-// Find the index in the key table for the given key, or -1 if not found
-// * !! No need to UNLOCK to make this call as only READ
-static int findKeyIdx(uint16_t k) {
-    assert(k!=CFG_KEY_ILLEGAL);
-    for(int i=0;i<_cfg.nbKeys; i++) {
-//        if (_cfg.indexTable[i].key == k) {
-        if (getIdxKey(i) == k) {    
-            return i;
+// Queue a changed key for the deferred listeners in the bitmap
+static void notifyQueue(uint16_t key, uint32_t deferred) {
+    bool queued = false;
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    for(int i=0;i<_notify.n;i++) {
+        if (_notify.q[i].key==key) {
+            // already waiting : just add any more cbs
+            _notify.q[i].cbs |= deferred;
+            queued = true;
+            break;
+        }
+    }
+    if (!queued && _notify.n<NOTIFY_Q_SZ) {
+        _notify.q[_notify.n].key = key;
+        _notify.q[_notify.n].cbs = deferred;
+        _notify.n++;
+        queued = true;
+    }
+    OS_EXIT_CRITICAL(sr);
+    if (queued) {
+        if (!_notify.ev.ev_queued) {
+            _notify.ev.ev_cb = notifyEv;
+            os_eventq_put(os_eventq_dflt_get(), &_notify.ev);
+        }
+    } else {
+        // No space to defer : better late than never
+        log_noout("CFG notify queue full for %4x", key);
+        CFG_CHANGES_t set = { .keys=&key, .nkeys=1 };
+        for(int i=0;i<_cfg.nCBs;i++) {
+            if (deferred & (1u << i)) {
+                (*(_cfg.cbList[i].cb))(&set, key);
+            }
         }
     }
-    return -1;
 }
-// * !! No need to UNLOCK to make this call as only READ
-static uint16_t getIdxKey(int idx) {
-    if (idx<0 || idx>=_cfg.nbKeys) {
-        return CFG_KEY_ILLEGAL;
+// Tell each deferred listener once of all the changes queued for it, oldest first
+static void notifyEv(struct os_event* ev) {
+    // take the whole queue : changes made by the listeners are queued again for the next run
+    uint16_t keys[NOTIFY_Q_SZ];
+    uint32_t cbs[NOTIFY_Q_SZ];
+    uint8_t n;
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    n = _notify.n;
+    for(int j=0;j<n;j++) {
+        keys[j] = _notify.q[j].key;
+        cbs[j] = _notify.q[j].cbs;
+    }
+    _notify.n = 0;
+    OS_EXIT_CRITICAL(sr);
+    uint16_t mine[NOTIFY_Q_SZ];
+    for(int i=0;i<_cfg.nCBs;i++) {
+        uint8_t nm = 0;
+        for(int j=0;j<n;j++) {
+            if (cbs[j] & (1u << i)) {
+                mine[nm++] = keys[j];
+            }
+        }
+        if (nm>0) {
+            CFG_CHANGES_t set = { .keys=mine, .nkeys=nm };
+            (*(_cfg.cbList[i].cb))(&set, mine[0]);
+        }
     }
-    return hal_bsp_nvmRead16(_cfg.indexStart+(idx*INDEX_SIZE));
-
 }
-// * !! No need to UNLOCK to make this call as only READ
-static uint8_t getIdxLen(int idx) {
-    if (idx<0 || idx>=_cfg.nbKeys) {
-        return 0;
+static bool addListener(CFG_CBFN_t cb, uint8_t module, uint16_t keyMin, uint16_t keyMax, bool deferred) {
+    if (_cfg.nCBs>=MAX_CFG_CBS) {
+        return false;
+    }
+    if (cb==NULL) {
+        return false;
+    }
+    cfgLockR();
+    CFG_LISTENER_t* l = &_cfg.cbList[_cfg.nCBs];
+    memset(l, 0, sizeof(CFG_LISTENER_t));
+    l->cb = cb;
+    l->keyMin = keyMin;
+    l->keyMax = keyMax;
+    l->deferred = deferred;
+    if (keyMin>keyMax) {
+        // module listener
+        l->modules[module>>5] = (1u << (module & 0x1f));
     }
-    return hal_bsp_nvmRead8(_cfg.indexStart+(idx*INDEX_SIZE)+2);
-    
+    _cfg.nCBs++;
+    cfgUnlockR();
+    return true;
 }
-// * !! No need to UNLOCK to make this call as only READ
-static uint16_t getIdxOff(int idx) {
-    if (idx<0 || idx>=_cfg.nbKeys) {
-        return 0;
+static void informChangesListeners(const uint16_t* keys, uint8_t nkeys) {
+    if (nkeys==0) {
+        return;
+    }
+    for(int i=0;i<_cfg.nChangesCBs;i++) {
+        (*(_cfg.changesCBList[i]))(NULL, keys, nkeys);
     }
-    return hal_bsp_nvmRead16(_cfg.indexStart+(idx*INDEX_SIZE)+3);    
 }
 
-// Protect access to PROM
-// Lock for reading only
-static void cfgLockR() {
-    // NOOP currently : add mutex if required
+static void txnReset() {
+    _txn.active = false;
+    _txn.failed = false;
+    _txn.owner = NULL;
+    _txn.nKeys = 0;
+    _txn.bufUsed = 0;
 }
-static void cfgUnlockR() {
-    // NOOP currently : add mutex if required
+// Is there a transaction, and does it belong to the calling task? (call with the lock held)
+static bool txnMine() {
+    return (_txn.active && _txn.owner==os_sched_get_current_task());
 }
-// Lock for Writing (and reading). Include PROM protection unlock/lock
-static void cfgLockW() {
-    // No mutex yet
-    // Unlock PROM so can wrtie to it
-    hal_bsp_nvmUnlock();
+// Is this task in a transaction? Other tasks' ones are waited for (by the lock) so are always done by the time it
+// returns false.
+static bool txnRunning() {
+    cfgLockR();
+    bool ret = _txn.active;
+    cfgUnlockR();
+    return ret;
+}
+static CFG_TXN_KEY_t* txnFind(uint16_t k) {
+    if (!txnMine()) {
+        return NULL;
+    }
+    for(int i=0;i<_txn.nKeys;i++) {
+        if (_txn.keys[i].key==k) {
+            return &_txn.keys[i];
+        }
+    }
+    return NULL;
+}
+// Stage a value (0s if d==NULL) in the current transaction
+static bool txnStage(uint16_t k, uint8_t l, uint8_t* d) {
+    if (k==CFG_KEY_ILLEGAL || l==0) {
+        return false;
+    }
+    CFG_TXN_KEY_t* tk = txnFind(k);
+    if (tk!=NULL) {
+        if (tk->len!=l) {
+            log_noout("CFG txn key %4x bad len %d should be %d", k, l, tk->len);
+            return false;
+        }
+    } else {
+        if (_txn.nKeys>=TXN_MAX_KEYS || (_txn.bufUsed+l)>TXN_BUF_SZ) {
+            log_noout("CFG txn full for key %4x", k);
+            _txn.failed = true;
+            return false;
+        }
+        tk = &_txn.keys[_txn.nKeys++];
+        tk->key = k;
+        tk->len = l;
+        tk->boff = _txn.bufUsed;
+        _txn.bufUsed += l;
+    }
+    if (d!=NULL) {
+        memcpy(&_txn.buf[tk->boff], d, l);
+    } else {
+        memset(&_txn.buf[tk->boff], 0, l);
+    }
+    return true;
+}
+
+// Walk the CBOR map of an import blob, checking each entry, or (if apply) staging it in the current transaction.
+// Returns the number of entries, or -1 if any is bad (or does not fit in the transaction).
+// Only what CFMgr_exportCBOR() makes is understood : a map (definite or not) of uint keys to byte string values
+static int cborImport(const uint8_t* blob, uint16_t len, bool apply) {
+    uint16_t pos = 0;
+    uint8_t major;
+    uint32_t arg;
+    if (!cborGetHead(blob, len, &pos, &major, &arg) || major!=5) {
+        return -1;
+    }
+    bool indef = (arg==0xFFFFFFFF);
+    uint32_t remaining = arg;
+    int n = 0;
+    while(indef || remaining>0) {
+        if (!cborGetHead(blob, len, &pos, &major, &arg)) {
+            return -1;
+        }
+        if (indef && major==7 && arg==0xFFFFFFFF) {
+            break;      // end of map
+        }
+        if (major!=0 || arg==CFG_KEY_ILLEGAL || arg>0xFFFF) {
+            return -1;
+        }
+        uint16_t key = (uint16_t)arg;
+        if (!cborGetHead(blob, len, &pos, &major, &arg) || major!=2 || arg==0 || arg>255 || (pos+arg)>len) {
+            return -1;
+        }
+        uint8_t vlen = (uint8_t)arg;
+        if (apply) {
+            if (!CFMgr_setElement(key, (void*)&blob[pos], vlen)) {
+                return -1;
+            }
+        } else {
+            uint8_t klen = CFMgr_getElementLen(key);
+            if (klen!=0 && klen!=vlen) {
+                log_noout("CFG import key %4x bad len %d should be %d", key, vlen, klen);
+                return -1;
+            }
+            const CFG_SCHEMA_t* se = schemaFind(key);
+            if (se!=NULL && !schemaValid(se, &blob[pos], vlen)) {
+                log_noout("CFG import key %4x out of schema range", key);
+                return -1;
+            }
+        }
+        pos += vlen;
+        remaining--;
+        n++;
+    }
+    // Nothing allowed after the map
+    return (pos==len)?n:-1;
+}
+
+// Read the head of a CBOR item at *pos : its major type and argument (value or length, 0xFFFFFFFF for indefinite)
+static bool cborGetHead(const uint8_t* b, uint16_t blen, uint16_t* pos, uint8_t* major, uint32_t* arg) {
+    if (*pos>=blen) {
+        return false;
+    }
+    uint8_t ib = b[(*pos)++];
+    uint8_t ai = (ib & 0x1f);
+    *major = (ib >> 5);
+    if (ai<24) {
+        *arg = ai;
+        return true;
+    }
+    if (ai==31) {
+        *arg = 0xFFFFFFFF;
+        return true;
+    }
+    if (ai>26) {
+        return false;       // 64 bit arguments are never valid for us, 28-30 are reserved
+    }
+    int nb = (1 << (ai-24));
+    if ((*pos+nb)>blen) {
+        return false;
+    }
+    *arg = 0;
+    for(int i=0;i<nb;i++) {
+        *arg = (*arg << 8) | b[(*pos)++];
+    }
+    return true;
+}
+
+// Stage a value in the current transaction, first committing it and starting a new one if it is full
+static bool txnStageNext(uint16_t k, uint8_t l, void* d) {
+    if (txnFind(k)==NULL && (_txn.nKeys>=TXN_MAX_KEYS || (_txn.bufUsed+l)>TXN_BUF_SZ)) {
+        if (!CFMgr_txnCommit() || !CFMgr_txnBegin()) {
+            return false;
+        }
+    }
+    return CFMgr_setElement(k, d, l);
+}
+
+static const uint8_t _typeSz[] = { 0, 1, 1, 2, 2, 4, 4 };      // by CFG_TYPE_t
+
+static const CFG_SCHEMA_t* schemaFind(uint16_t key) {
+    for(int i=0;i<_cfg.nSchemas;i++) {
+        for(int j=0;j<_cfg.schemas[i].n;j++) {
+            if (_cfg.schemas[i].s[j].key==key) {
+                return &_cfg.schemas[i].s[j];
+            }
+        }
+    }
+    return NULL;
+}
+// value has the right length, and is in the range for int types
+static bool schemaValid(const CFG_SCHEMA_t* e, const uint8_t* d, uint8_t len) {
+    if (len!=e->len) {
+        return false;
+    }
+    int64_t v = 0;
+    switch(e->type) {
+        case CFG_TYPE_BLOB: {
+            return true;
+        }
+        case CFG_TYPE_UINT8: {
+            v = d[0];
+            break;
+        }
+        case CFG_TYPE_INT8: {
+            v = (int8_t)d[0];
+            break;
+        }
+        case CFG_TYPE_UINT16: {
+            uint16_t t;
+            memcpy(&t, d, 2);
+            v = t;
+            break;
+        }
+        case CFG_TYPE_INT16: {
+            int16_t t;
+            memcpy(&t, d, 2);
+            v = t;
+            break;
+        }
+        case CFG_TYPE_UINT32: {
+            uint32_t t;
+            memcpy(&t, d, 4);
+            v = t;
+            break;
+        }
+        case CFG_TYPE_INT32: {
+            int32_t t;
+            memcpy(&t, d, 4);
+            v = t;
+            break;
+        }
+        default:
+            return false;
+    }
+    return (e->len==_typeSz[e->type] && v>=e->min && v<=e->max);
+}
+static void schemaSetInt(const CFG_SCHEMA_t* e, uint8_t* d, int64_t v) {
+    // values are kept in native byte order, like a memcpy of the variable
+    switch(e->type) {
+        case CFG_TYPE_UINT8:
+        case CFG_TYPE_INT8: {
+            d[0] = (uint8_t)v;
+            break;
+        }
+        case CFG_TYPE_UINT16:
+        case CFG_TYPE_INT16: {
+            uint16_t t = (uint16_t)v;
+            memcpy(d, &t, 2);
+            break;
+        }
+        case CFG_TYPE_UINT32:
+        case CFG_TYPE_INT32: {
+            uint32_t t = (uint32_t)v;
+            memcpy(d, &t, 4);
+            break;
+        }
+        default:
+            break;
+    }
+}
+// Read a declared key into its RAM mirror, if it exists with a valid value (else the mirror is not changed)
+static bool schemaLoad(const CFG_SCHEMA_t* e) {
+    if (CFMgr_getElementLen(e->key)!=e->len) {
+        return false;
+    }
+    if (e->type==CFG_TYPE_BLOB) {
+        return (CFMgr_getElement(e->key, e->mirror, e->len)==e->len);
+    }
+    uint8_t v[4];
+    if (CFMgr_getElement(e->key, v, e->len)==e->len && schemaValid(e, v, e->len)) {
+        memcpy(e->mirror, v, e->len);
+        return true;
+    }
+    return false;
+}
+// Update the RAM mirror of a declared key after a change (a deleted key keeps its last value)
+static void schemaRefresh(uint16_t key) {
+    const CFG_SCHEMA_t* e = schemaFind(key);
+    if (e!=NULL) {
+        schemaLoad(e);
+    }
+}
+
+// crc8 (poly 0x07)
+static uint8_t crc8(uint8_t crc, uint8_t* d, int l) {
+    for(int i=0;i<l;i++) {
+        crc ^= d[i];
+        for(int b=0;b<8;b++) {
+            crc = (crc & 0x80)?((crc<<1) ^ 0x07):(crc<<1);
+        }
+    }
+    return crc;
+}
+
+/** PROM layout
+0000 [nbKeys(Pri)] [nbKeys(Sec)] [IdxStart_LSB] [IdxStart_MSB] [StoreStart_LSB] [StoreStart_MSB]
+0006 [TXN_MAGIC] [JOff_LSB] [JOff_MSB] [JLen_LSB] [JLen_MSB] [nbKeys after txn] [Crc] (txn journal descriptor)
+000D [RFU=0]x3
+0010-(0x10+NVM_MAX_KEYS*5) [[Key_LSB] [K_MSB] [Len] [StoreOff_LSB][StoreOff_MSB]] x nbKeys (max 200)
+ A slot with Len=0 is a deleted key. If a key is in 2 slots (interrupted resize), the later slot is the valid one.
+ Store values from StoreStart up to the header copies.
+END-0xD8 [IDX_HDR_MAGIC] [Version=2] [Gen_LSB] [Gen_MSB] [nbKeys] [RFU=0]x2 [Crc] x 2 (header copies A/B)
+END-0xC8 [Crc] x NVM_MAX_KEYS (crc of each slot's index entry + value)
+ The valid header copy with the highest generation gives nbKeys. It is changed by writing the other copy with the next
+ generation. nbKeys(Pri/Sec) are still written, for older builds and in case both copies are lost.
+ A store from an older build has no header copies : it gets them (and the crcs) at boot if the store does not use
+ that space.
+ */
+
+/** startup:
+ * read IdxStart (2 bytes). If 0 or > PROM_SIZE, IdxStart=0x0010, nbKeys=0
+ * readStoreStart (2 bytes). If 0 or > PROM_SIZE, StoreStart=MAXKEYS*5+0x10, IdxStart=0x0010, nbKeys=0
+ * read the header copies for nbKeys, or if none is valid, nbKeys(Pri), nbKeys(Sec) (and no crc checks)
+ * StoreOffset = StoreStart
+ * read in Idx (in bursts) into the RAM index (sorted by key), updating StoreOffset at each entry read to be after its
+ * StoreOff+len. An entry whose crc is bad is dropped (and its key gets its default value when next used).
+ */
+void CFMgr_init(void) {
+    os_mutex_init(&_cfg.lock);
+    cfgLockR();
+#if CACHE_ENTRIES>0
+    memset(&_cache, 0, sizeof(_cache));
+#endif
+#if MYNEWT_VAL(CFG_LOG_STORE)
+    logInit();
+#else
+    if (idxLoad()) {
+        // finish off any transaction that was committed but not completely applied
+        cfgLockW();
+        if (idxTxnReplay()) {
+            log_noout("CFG txn replayed");
+            idxLoad();
+        }
+        if (!_cfg.crcs) {
+            idxAddCrcs();
+        }
+        // Reclaim space of deleted/resized keys, a bit at each boot
+        if (idxDeadSpace()>0) {
+            idxCompact(MYNEWT_VAL(CFG_COMPACT_MAX_WRITES));
+        }
+        cfgUnlockW();
+    } else {
+        log_noout("CFG BAD, resetting");
+        _cfg.nbKeys=0;
+        _cfg.nbIdx=0;
+        _cfg.indexStart=NVM_HDR_SIZE;
+        _cfg.storeStart=_cfg.indexStart + (NVM_MAX_KEYS+1)*INDEX_SIZE;
+        _cfg.storeOffset = _cfg.storeStart;
+        cfgLockW();
+        nvmWrite8(0,0);
+        nvmWrite8(1,0);
+        nvmWrite16(2, _cfg.indexStart);
+        nvmWrite16(4, _cfg.storeStart);
+        nvmWrite8(TXN_DESC_OFF, 0);
+        idxResetHdrs();
+        cfgUnlockW();
+        // just log passage : no assert (as this writes to PROM!)
+        log_fn_fn();
+    }
+#endif
+    cfgUnlockR();
+
+    // ready to roll
+    // debug
+    log_noout("CFG nbK %d", _cfg.nbKeys);
+#if defined(UNITTEST) && MYNEWT_VAL(CFG_NVM_STATS)
+    // resets the device at each boot until the whole sequence has been tried
+    unittest_cfg_powerfail();
+#endif
+
+//    dumpCfg();
+}
+
+// Read the index layout header and key index into ram. Returns false if the header is bad (and does not write to PROM)
+static bool idxLoad() {
+    _cfg.indexStart = nvmRead16(2);
+    _cfg.storeStart = nvmRead16(4);
+    if (_cfg.indexStart<NVM_HDR_SIZE|| _cfg.indexStart>hal_bsp_nvmSize() ||
+             _cfg.storeStart<NVM_HDR_SIZE || _cfg.storeStart>hal_bsp_nvmSize() ||
+             _cfg.storeStart < (_cfg.indexStart+NVM_MAX_KEYS*INDEX_SIZE)) {
+        return false;
+    }
+    uint16_t g0 = 0;
+    uint16_t g1 = 0;
+    uint8_t n0 = 0;
+    uint8_t n1 = 0;
+    bool v0 = idxReadHdr(0, &g0, &n0);
+    bool v1 = idxReadHdr(1, &g1, &n1);
+    if (v0 || v1) {
+        if (v0 && (!v1 || ((int16_t)(g0-g1))>0)) {
+            _cfg.bank = 0;
+            _cfg.gen = g0;
+            _cfg.nbKeys = n0;
+        } else {
+            _cfg.bank = 1;
+            _cfg.gen = g1;
+            _cfg.nbKeys = n1;
+        }
+        _cfg.crcs = true;
+        _cfg.storeEnd = idxHdrOff(0);
+    } else {
+        // Older build's store (or both header copies lost)
+        uint8_t nbK_pri = nvmRead8(0);
+        uint8_t nbK_sec = nvmRead8(1);
+        if (nbK_sec!=nbK_pri) {
+            // oops. can't log yet
+            log_noout("PROM cfg store corruption (%d, %d)", nbK_pri, nbK_sec);
+            // log our fn address, and continue. Might be ok...
+            log_fn_fn();
+        }
+        if (nbK_pri>NVM_MAX_KEYS) {
+            return false;
+        }
+        _cfg.nbKeys = nbK_pri;
+        _cfg.crcs = false;
+        _cfg.storeEnd = hal_bsp_nvmSize();
+    }
+
+    // Read the key index into ram (a burst of entries and their crcs per PROM read), calculating where next free space
+    // in store is
+    _cfg.nbIdx = 0;
+    _cfg.idxFull = false;
+    _cfg.storeOffset = _cfg.storeStart;
+    for(int i=0;i<_cfg.nbKeys; i+=IDX_LOAD_BURST) {
+        uint8_t ie[IDX_LOAD_BURST*INDEX_SIZE];
+        uint8_t crc[IDX_LOAD_BURST] = { 0 };
+        int n = ((_cfg.nbKeys-i)>IDX_LOAD_BURST)?IDX_LOAD_BURST:(_cfg.nbKeys-i);
+        if (!nvmRead(_cfg.indexStart+(i*INDEX_SIZE), n*INDEX_SIZE, ie) ||
+                (_cfg.crcs && !nvmRead(idxCrcOff(i), n, crc))) {
+            log_noout("CFG fail to read idx %d", i);
+            continue;
+        }
+        for(int j=0;j<n;j++) {
+            idxLoadEntry(i+j, &ie[j*INDEX_SIZE], crc[j]);
+        }
+    }
+    return true;
+}
+
+static void idxLoadEntry(int slot, uint8_t* ie, uint8_t crc) {
+    uint16_t k = Util_readLE_uint16_t(&ie[0], 2);
+    uint8_t l = ie[2];
+    uint16_t off = Util_readLE_uint16_t(&ie[3], 2);
+    if (l==0) {
+        return;       // deleted key
+    }
+    if (k==CFG_KEY_ILLEGAL || off<_cfg.storeStart || (off+l) > _cfg.storeEnd) {
+        log_noout("CFG bad key %4x at idx %d", k, slot);
+        return;
+    }
+    // Whatever happens, the store space used by this entry is not free
+    if (off+l > _cfg.storeOffset) {
+        _cfg.storeOffset = off+l;
+    }
+    if (_cfg.crcs) {
+        uint8_t c = 0;
+        if (!idxEntryCrc(ie, &c) || c!=crc) {
+            log_noout("CFG bad crc for key %4x at idx %d, dropped", k, slot);
+            return;
+        }
+    }
+    CFG_IDX_t* ke = findKeyIdx(k);
+    if (ke!=NULL) {
+        // A resize that was interrupted before the old entry was deleted : the later one is the new one
+        log_noout("CFG duplicate key %4x at idx %d", k, slot);
+        ke->len = l;
+        ke->off = off;
+        ke->slot = slot;
+        return;
+    }
+    if (addKeyIdx(k, l, off, slot)==NULL) {
+        // This build is configured for less keys than are in the PROM : keep going to find the end of the store
+        if (!_cfg.idxFull) {
+            log_noout("CFG RAM index full at idx %d (%d keys in PROM)", slot, _cfg.nbKeys);
+            log_fn_fn();
+        }
+        _cfg.idxFull = true;
+    }
+}
+
+static uint16_t idxHdrOff(uint8_t c) {
+    return hal_bsp_nvmSize()-IDX_TAIL_SIZE+(c*IDX_HDR_SIZE);
+}
+static uint16_t idxCrcOff(int slot) {
+    return hal_bsp_nvmSize()-NVM_MAX_KEYS+slot;
+}
+// Read and check an index layout header copy
+static bool idxReadHdr(uint8_t c, uint16_t* gen, uint8_t* nbKeys) {
+    uint8_t h[IDX_HDR_SIZE];
+    if (!nvmRead(idxHdrOff(c), IDX_HDR_SIZE, h)) {
+        return false;
+    }
+    if (h[0]!=IDX_HDR_MAGIC || h[1]!=IDX_HDR_VERSION || h[4]>NVM_MAX_KEYS || crc8(0, h, 7)!=h[7]) {
+        return false;
+    }
+    *gen = Util_readLE_uint16_t(&h[2], 2);
+    *nbKeys = h[4];
+    return true;
+}
+// crc of an index entry and its value (read from PROM)
+static bool idxEntryCrc(uint8_t* ie, uint8_t* crc) {
+    uint16_t off = Util_readLE_uint16_t(&ie[3], 2);
+    uint8_t c = crc8(0, ie, INDEX_SIZE);
+    uint8_t buf[CFG_COPY_CHUNK];
+    for(int i=0;i<ie[2];i+=CFG_COPY_CHUNK) {
+        uint8_t cl = ((ie[2]-i)>CFG_COPY_CHUNK)?CFG_COPY_CHUNK:(ie[2]-i);
+        if (!nvmRead(off+i, cl, buf)) {
+            return false;
+        }
+        c = crc8(c, buf, cl);
+    }
+    *crc = c;
+    return true;
+}
+
+/** Adding new key
+ * If nbKeys>=200, fail
+ * Write index entry to PROM_START+IdxStart+(nbKeys*5) [K, L, StoreOffset]
+ * StoreOffset+=len
+ * nbKeys++
+ * write nbKeys(sec)
+ * write nbKeys(pri)
+ * For the log store, just append a record for the key.
+ * Returns the new key's entry in the RAM index
+ * !! MUST HAVE cfgLockW/cfgUnlockW round this call
+ */
+static CFG_IDX_t* createKey(uint16_t k, uint8_t l, uint8_t* d) {
+    assert(l!=0);
+    NVM_STAT_ADD(valueBytes, l);
+    if (k==CFG_KEY_ILLEGAL) {
+        return NULL;       // never allowed
+    }
+#if MYNEWT_VAL(CFG_LOG_STORE)
+    if (_cfg.nbIdx>=MAX_KEYS) {
+        return NULL;       // no joy
+    }
+    int off = logAppend(k, l, d, NULL);
+    if (off<0) {
+        return NULL;       // full up even after compaction
+    }
+    _cfg.nbKeys++;
+    _cfg.liveBytes += (LOG_REC_HDR_SIZE+l);
+    return addKeyIdx(k, l, off, 0);
+#else
+    if ((_cfg.nbKeys>=NVM_MAX_KEYS || !idxStoreFits(l, l)) && idxDeadSpace()>0) {
+        // Get back the space of deleted keys
+        idxCompact(0xFFFF);
+    }
+    if (_cfg.nbKeys>=NVM_MAX_KEYS || _cfg.nbIdx>=MAX_KEYS) {
+        return NULL;       // no joy
+    }
+    if (!idxStoreFits(l, l)) {
+        return NULL;         // full up
+    }
+    int slot = _cfg.nbKeys;
+    // Wrtie to PROM new index entry
+    // check results of PROM accesses and fail nicely
+    if (!nvmWrite16(_cfg.indexStart+slot*INDEX_SIZE, k)) {
+        log_noout("CFG fail to write at %4x key %4x",_cfg.indexStart+slot*INDEX_SIZE, k);
+        return NULL;       // no joy
+    }
+    if (!nvmWrite8(_cfg.indexStart+slot*INDEX_SIZE+2, l)) {
+        log_noout("CFG fail to write at %4x len %2x",_cfg.indexStart+slot*INDEX_SIZE, l);
+        return NULL;       // no joy
+    }
+    if (!nvmWrite16(_cfg.indexStart+slot*INDEX_SIZE+3, _cfg.storeOffset)) {
+        log_noout("CFG fail to write at %4x off %4x",_cfg.indexStart+slot*INDEX_SIZE, _cfg.storeOffset);
+        return NULL;       // no joy
+    }
+    // Write data into store
+    if (!nvmWrite(_cfg.storeOffset, l, d)) {
+        log_noout("CFG fail to write data at %4x len %2x",_cfg.storeOffset, l);
+        return NULL;       // no joy
+    }
+    if (_cfg.crcs && !idxUpdateCrc(slot)) {
+        log_noout("CFG fail to write crc for slot %d", slot);
+        return NULL;       // no joy
+    }
+
+    // Move next free space in store along
+    _cfg.storeOffset+=l;
+    _cfg.nbKeys++;
+    // Update number of key in index in PROM
+    if (!idxWriteNbKeys(_cfg.nbKeys)) {
+        log_noout("CFG fail to write nbKeys %2x",_cfg.nbKeys);
+        // rewind
+        _cfg.storeOffset-=l;
+        _cfg.nbKeys--;
+        return NULL;       // no joy
+    }
+    // update memory copy
+    return addKeyIdx(k, l, _cfg.storeOffset-l, slot);
+#endif
+}
+
+// Write a new value (of the key's length) for an existing key. d==NULL to write 0s.
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool writeValue(CFG_IDX_t* ke, uint8_t* d) {
+    NVM_STAT_ADD(valueBytes, ke->len);
+    // Drop any cached value first so a failed write can't leave a stale one
+    cacheInvalidate(ke->key);
+    bool ret = true;
+#if MYNEWT_VAL(CFG_LOG_STORE)
+    // no need to use up log space if same value
+    if (!logSameValue(ke, d)) {
+        int off = logAppend(ke->key, ke->len, d, NULL);
+        if (off<0) {
+            ret = false;
+        } else {
+            ke->off = off;
+        }
+    }
+#else
+    if (_cfg.crcs) {
+        // Value and crc via the journal : written in place then its crc, a power fail between the two would lose the
+        // key (bad crc). idxStoreFits() always leaves the space for it after the store.
+        CFG_JENTRY_t je = { .off=ke->off, .len=ke->len, .d=d, .from=0, .crcSlot=ke->slot };
+        ret = idxJournalCommit(&je, 1, _cfg.storeOffset, _cfg.nbKeys);
+    } else if (d==NULL) {
+        for(int i=0;i<ke->len;i++) {
+            ret &= nvmWrite8(ke->off + i, 0);      // any failure sets result to failure
+        }
+    } else {
+        ret = nvmWrite(ke->off, ke->len, d);
+    }
+#endif
+    // write through to cache (reset values are not cached until next read)
+    if (ret && d!=NULL) {
+        cacheUpdate(ke->key, ke->len, d);
+    }
+    return ret;
+}
+
+// Read a value (the first len bytes) from the cache if there, else from PROM (and cache it if small enough)
+static bool readValue(CFG_IDX_t* ke, uint8_t* d, uint8_t len) {
+#if CACHE_ENTRIES>0
+    _cache.tick++;
+    for(int i=0;i<CACHE_ENTRIES;i++) {
+        if (_cache.e[i].key==ke->key) {
+            _cache.e[i].used = _cache.tick;
+            _cache.hits++;
+            memcpy(d, _cache.e[i].data, len);
+            return true;
+        }
+    }
+    _cache.misses++;
+    if (ke->len<=CACHE_VAL_SZ) {
+        uint8_t v[CACHE_VAL_SZ];
+        if (!nvmRead(ke->off, ke->len, v)) {
+            return false;
+        }
+        cacheUpdate(ke->key, ke->len, v);
+        memcpy(d, v, len);
+        return true;
+    }
+#endif
+    return nvmRead(ke->off, len, d);
+}
+// Update the cached value for a key, taking the least recently used entry if not already there
+static void cacheUpdate(uint16_t k, uint8_t l, uint8_t* d) {
+#if CACHE_ENTRIES>0
+    if (l>CACHE_VAL_SZ) {
+        return;
+    }
+    int best = 0;
+    for(int i=0;i<CACHE_ENTRIES;i++) {
+        if (_cache.e[i].key==k) {
+            best = i;
+            break;
+        }
+        // free entry, or older than best so far
+        if (_cache.e[best].key!=CFG_KEY_ILLEGAL &&
+                (_cache.e[i].key==CFG_KEY_ILLEGAL ||
+                 (uint16_t)(_cache.tick-_cache.e[i].used) > (uint16_t)(_cache.tick-_cache.e[best].used))) {
+            best = i;
+        }
+    }
+    _cache.e[best].key = k;
+    _cache.e[best].len = l;
+    _cache.e[best].used = _cache.tick;
+    memcpy(_cache.e[best].data, d, l);
+#endif
+}
+static void cacheInvalidate(uint16_t k) {
+#if CACHE_ENTRIES>0
+    for(int i=0;i<CACHE_ENTRIES;i++) {
+        if (_cache.e[i].key==k) {
+            _cache.e[i].key = CFG_KEY_ILLEGAL;
+        }
+    }
+#endif
+}
+
+// Get the value cache hit/miss counts (to size CFG_CACHE_ENTRIES)
+void CFMgr_getCacheStats(uint32_t* hits, uint32_t* misses) {
+#if CACHE_ENTRIES>0
+    *hits = _cache.hits;
+    *misses = _cache.misses;
+#else
+    *hits = 0;
+    *misses = 0;
+#endif
+}
+
+// Find the position in the RAM index of the given key, or of where it would be inserted if not present
+// (ie the position of the first key >= k). Binary search as index is sorted by key.
+static int findKeyPos(uint16_t k) {
+    int lo = 0;
+    int hi = _cfg.nbIdx;
+    while(lo<hi) {
+        int mid = (lo+hi)/2;
+        if (_cfg.index[mid].key<k) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Find the entry in the RAM index for the given key, or NULL if not found
+// * !! No need to UNLOCK to make this call as only READ (and does not access PROM)
+static CFG_IDX_t* findKeyIdx(uint16_t k) {
+    if (k==CFG_KEY_ILLEGAL) {
+        return NULL;        // never in the index
+    }
+    int pos = findKeyPos(k);
+    if (pos<_cfg.nbIdx && _cfg.index[pos].key==k) {
+        return &_cfg.index[pos];
+    }
+    return NULL;
+}
+
+// Insert a key into the RAM index, keeping it sorted. Returns NULL if no space
+static CFG_IDX_t* addKeyIdx(uint16_t k, uint8_t l, uint16_t off, uint8_t slot) {
+    if (_cfg.nbIdx>=MAX_KEYS) {
+        return NULL;
+    }
+    int pos = findKeyPos(k);
+    // shift up to make space
+    memmove(&_cfg.index[pos+1], &_cfg.index[pos], (_cfg.nbIdx-pos)*sizeof(CFG_IDX_t));
+    _cfg.index[pos].key = k;
+    _cfg.index[pos].len = l;
+    _cfg.index[pos].off = off;
+    _cfg.index[pos].slot = slot;
+    _cfg.nbIdx++;
+    return &_cfg.index[pos];
+}
+
+// Remove a key from the RAM index
+static void removeKeyIdx(CFG_IDX_t* ke) {
+    int pos = ke-&_cfg.index[0];
+    memmove(&_cfg.index[pos], &_cfg.index[pos+1], (_cfg.nbIdx-pos-1)*sizeof(CFG_IDX_t));
+    _cfg.nbIdx--;
+}
+
+#if MYNEWT_VAL(CFG_LOG_STORE)
+/** Log store PROM layout
+ * The PROM is split into 2 equal banks. Only one is active : the one with a valid header and the highest generation.
+ * Bank header : [MAGIC_0] [MAGIC_1] [0] [0] [Gen_LSB] [Gen_MSB] [Crc] [RFU=0]
+ *   (bytes 2/3 are 0 so that a build using the index layout sees a bad IdxStart and resets)
+ * Then records : [Key_LSB] [Key_MSB] [Len] [Seq_LSB] [Seq_MSB] [Crc] [data x Len]
+ *   The crc covers the record header and data, and is seeded with the bank generation. Seq starts at 0 in each bank and
+ *   increments by 1 for each record, so a record is only valid if it follows on from the previous one.
+ * The value of a key is its most recent record. Values are never rewritten in place : a change appends a new record
+ * (data first, then the header) so a power fail during a write just leaves an invalid record at the tail.
+ * At boot, the log is scanned to rebuild the RAM index, and the tail is after the last valid record.
+ * Compaction copies the latest record of every key into the other bank, then writes that bank's header with
+ * generation+1 : this is the commit point. Until then, the old bank remains the valid one.
+ * It is done when a write finds no space, or in the background (default eventq) when free space gets low.
+ * A transaction is written as a txn record [0] [0] [3] [Seq_LSB] [Seq_MSB] [Crc] [n] [RLen_LSB] [RLen_MSB] followed by
+ * its n records (RLen bytes). At boot it is only taken into account if all n records are valid. If not, its records
+ * are ignored and the log carries on after them, with seq+1+n : their space and seqs are never reused, so a later
+ * record can't make what is left of them look valid.
+ * A key is deleted by a record [0] [0] [2] [Seq_LSB] [Seq_MSB] [Crc] [Key_LSB] [Key_MSB]. A resize is just a new value
+ * record with the new length. Compaction drops the deleted keys.
+ */
+
+static uint16_t logBankStart(uint8_t b) {
+    return (b==0)?0:(hal_bsp_nvmSize()/2);
+}
+static uint16_t logBankEnd(uint8_t b) {
+    return logBankStart(b) + (hal_bsp_nvmSize()/2);
+}
+static uint8_t logCrcSeed(uint16_t gen) {
+    uint8_t g[2] = { (gen & 0xff), (gen >> 8) };
+    return crc8(0, g, 2);
+}
+// Read and check a bank header, returning its generation if valid
+static bool logReadBankHdr(uint8_t b, uint16_t* gen) {
+    uint8_t h[LOG_BANK_HDR_SIZE];
+    if (!nvmRead(logBankStart(b), LOG_BANK_HDR_SIZE, h)) {
+        return false;
+    }
+    if (h[0]!=LOG_MAGIC_0 || h[1]!=LOG_MAGIC_1 || h[2]!=0 || h[3]!=0 || crc8(0, h, 6)!=h[6]) {
+        return false;
+    }
+    *gen = Util_readLE_uint16_t(&h[4], 2);
+    return true;
+}
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool logWriteBankHdr(uint8_t b, uint16_t gen) {
+    uint8_t h[LOG_BANK_HDR_SIZE] = { LOG_MAGIC_0, LOG_MAGIC_1, 0, 0, (gen & 0xff), (gen >> 8), 0, 0 };
+    h[6] = crc8(0, h, 6);
+    return nvmWrite(logBankStart(b), LOG_BANK_HDR_SIZE, h);
+}
+static uint16_t logFree() {
+    return logBankEnd(_cfg.bank) - _cfg.storeOffset;
+}
+// Worth compacting if free space is low and we would at least double it
+static bool logCompactNeeded() {
+    uint16_t free = logFree();
+    uint16_t dead = (_cfg.storeOffset - _cfg.storeStart) - _cfg.liveBytes;
+    return ((free*100) < ((hal_bsp_nvmSize()/2)*LOG_COMPACT_PC)) && (dead > free);
+}
+
+// Write a record (data then header) at the given offset. If d==NULL, the first fromLen bytes of data are copied from
+// that PROM offset instead, and the rest is 0s. Returns false if any write fails.
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool logWriteRec(uint16_t off, uint16_t gen, uint16_t seq, uint16_t k, uint8_t l, uint8_t* d, uint16_t from, uint8_t fromLen) {
+    uint8_t h[LOG_REC_HDR_SIZE] = { (k & 0xff), (k >> 8), l, (seq & 0xff), (seq >> 8), 0 };
+    uint8_t crc = crc8(logCrcSeed(gen), h, 5);
+    if (d!=NULL) {
+        crc = crc8(crc, d, l);
+        if (!nvmWrite(off+LOG_REC_HDR_SIZE, l, d)) {
+            return false;
+        }
+    } else {
+        // zeros or copy, in small chunks to keep the stack small
+        uint8_t buf[CFG_COPY_CHUNK];
+        for(int i=0;i<l;i+=CFG_COPY_CHUNK) {
+            uint8_t cl = ((l-i)>CFG_COPY_CHUNK)?CFG_COPY_CHUNK:(l-i);
+            memset(buf, 0, CFG_COPY_CHUNK);
+            if (i<fromLen && !nvmRead(from+i, ((fromLen-i)<cl)?(fromLen-i):cl, buf)) {
+                return false;
+            }
+            crc = crc8(crc, buf, cl);
+            if (!nvmWrite(off+LOG_REC_HDR_SIZE+i, cl, buf)) {
+                return false;
+            }
+        }
+    }
+    h[5] = crc;
+    // header last : record is only valid once this is done
+    return nvmWrite(off, LOG_REC_HDR_SIZE, h);
+}
+
+// Append a record for key k at the tail of the log, compacting first if no space. Returns offset of value or -1
+// If d is NULL, the value is copied from the current value of src (if not NULL, 0 filled if longer) or is all 0s
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static int logAppend(uint16_t k, uint8_t l, uint8_t* d, CFG_IDX_t* src) {
+    if (logFree() < (LOG_REC_HDR_SIZE+l)) {
+        // Try to make space now
+        if (!logCompact() || logFree() < (LOG_REC_HDR_SIZE+l)) {
+            log_noout("CFG log full for key %4x", k);
+            return -1;
+        }
+    }
+    uint16_t off = _cfg.storeOffset;
+    // src offset is only valid after any compaction
+    if (!logWriteRec(off, _cfg.gen, _cfg.seq, k, l, d, (src!=NULL)?src->off:0, (src!=NULL)?src->len:0)) {
+        log_noout("CFG fail to write rec at %4x key %4x", off, k);
+        // The space may be partially written : next append just overwrites it
+        return -1;
+    }
+    _cfg.storeOffset += (LOG_REC_HDR_SIZE+l);
+    _cfg.seq++;
+    // Do a compaction in the background if worth it, so writes don't have to wait for it
+    if (logCompactNeeded() && !_cfg.compactEv.ev_queued) {
+        os_eventq_put(os_eventq_dflt_get(), &_cfg.compactEv);
+    }
+    return off+LOG_REC_HDR_SIZE;
+}
+
+// Check if the current value of a key is already d (or all 0s if d==NULL)
+static bool logSameValue(CFG_IDX_t* ke, uint8_t* d) {
+    uint8_t buf[CFG_COPY_CHUNK];
+    for(int i=0;i<ke->len;i+=CFG_COPY_CHUNK) {
+        uint8_t cl = ((ke->len-i)>CFG_COPY_CHUNK)?CFG_COPY_CHUNK:(ke->len-i);
+        if (!nvmRead(ke->off+i, cl, buf)) {
+            return false;
+        }
+        for(int j=0;j<cl;j++) {
+            if (buf[j]!=((d!=NULL)?d[i+j]:0)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Copy the latest record of each key into bank db, and commit it with generation ngen.
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool logCompactInto(uint8_t db, uint16_t ngen) {
+    uint16_t off = logBankStart(db)+LOG_BANK_HDR_SIZE;
+    for(int i=0;i<_cfg.nbIdx;i++) {
+        CFG_IDX_t* ke = &_cfg.index[i];
+        if ((off+LOG_REC_HDR_SIZE+ke->len) > logBankEnd(db)) {
+            log_noout("CFG compaction no space in bank %d", db);
+            return false;
+        }
+        if (!logWriteRec(off, ngen, i, ke->key, ke->len, NULL, ke->off, ke->len)) {
+            log_noout("CFG compaction fail to write at %4x", off);
+            return false;
+        }
+        off += (LOG_REC_HDR_SIZE+ke->len);
+    }
+    // commit
+    if (!logWriteBankHdr(db, ngen)) {
+        log_noout("CFG compaction fail to write hdr bank %d", db);
+        return false;
+    }
+    // Update ram index to the new bank
+    _cfg.bank = db;
+    _cfg.gen = ngen;
+    _cfg.seq = _cfg.nbIdx;
+    _cfg.storeStart = logBankStart(db)+LOG_BANK_HDR_SIZE;
+    _cfg.storeOffset = off;
+    _cfg.liveBytes = off - _cfg.storeStart;
+    off = _cfg.storeStart;
+    for(int i=0;i<_cfg.nbIdx;i++) {
+        _cfg.index[i].off = off+LOG_REC_HDR_SIZE;
+        off += (LOG_REC_HDR_SIZE+_cfg.index[i].len);
+    }
+    return true;
+}
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool logCompact() {
+    uint16_t before = logFree();
+    bool ret = logCompactInto(1-_cfg.bank, _cfg.gen+1);
+    log_noout("CFG compaction %s : bank %d gen %d free %d->%d", (ret?"ok":"FAIL"), _cfg.bank, _cfg.gen, before, logFree());
+    return ret;
+}
+// Background compaction : the lock keeps any other access out until it is done
+static void logCompactEv(struct os_event* ev) {
+    cfgLockR();
+    cfgLockW();
+    if (logCompactNeeded()) {
+        logCompact();
+    }
+    cfgUnlockW();
+    cfgUnlockR();
+}
+
+// Read and check the record at off, which must have the given seq. Returns its key and len if valid.
+static bool logReadRec(uint16_t off, uint16_t end, uint16_t seq, uint8_t seed, uint16_t* k, uint8_t* l) {
+    uint8_t h[LOG_REC_HDR_SIZE];
+    if ((off+LOG_REC_HDR_SIZE) > end || !nvmRead(off, LOG_REC_HDR_SIZE, h)) {
+        return false;
+    }
+    *k = Util_readLE_uint16_t(&h[0], 2);
+    *l = h[2];
+    if (*l==0 || Util_readLE_uint16_t(&h[3], 2)!=seq || (off+LOG_REC_HDR_SIZE+*l) > end) {
+        return false;
+    }
+    uint8_t crc = crc8(seed, h, 5);
+    uint8_t buf[CFG_COPY_CHUNK];
+    for(int i=0;i<*l;i+=CFG_COPY_CHUNK) {
+        uint8_t cl = ((*l-i)>CFG_COPY_CHUNK)?CFG_COPY_CHUNK:(*l-i);
+        if (!nvmRead(off+LOG_REC_HDR_SIZE+i, cl, buf)) {
+            return false;
+        }
+        crc = crc8(crc, buf, cl);
+    }
+    // partially written record (power fail) if bad
+    return (crc==h[5]);
+}
+
+// Scan the active bank's log to rebuild the ram index and find the tail
+static void logScan() {
+    _cfg.nbIdx = 0;
+    _cfg.storeStart = logBankStart(_cfg.bank)+LOG_BANK_HDR_SIZE;
+    uint16_t off = _cfg.storeStart;
+    uint16_t end = logBankEnd(_cfg.bank);
+    uint16_t seq = 0;
+    uint8_t seed = logCrcSeed(_cfg.gen);
+    uint16_t k;
+    uint8_t l;
+    while(logReadRec(off, end, seq, seed, &k, &l)) {
+        if (k==CFG_KEY_ILLEGAL && l==2) {
+            // Delete
+            uint16_t dk = nvmRead16(off+LOG_REC_HDR_SIZE);
+            CFG_IDX_t* ke = (dk!=CFG_KEY_ILLEGAL)?findKeyIdx(dk):NULL;
+            if (ke!=NULL) {
+                removeKeyIdx(ke);
+            }
+        } else if (k==CFG_KEY_ILLEGAL && l==3) {
+            // Transaction : only take it if all of its records are there
+            uint8_t t[3];
+            if (!nvmRead(off+LOG_REC_HDR_SIZE, 3, t)) {
+                break;
+            }
+            uint8_t n = t[0];
+            uint16_t rlen = Util_readLE_uint16_t(&t[1], 2);
+            uint16_t toff = off+LOG_REC_HDR_SIZE+l;
+            if ((toff+rlen) > end) {
+                break;
+            }
+            bool ok = true;
+            for(int i=0;i<n && ok;i++) {
+                uint16_t tk;
+                uint8_t tl;
+                ok = logReadRec(toff, end, seq+1+i, seed, &tk, &tl) && (tk!=CFG_KEY_ILLEGAL);
+                toff += (LOG_REC_HDR_SIZE+tl);
+            }
+            if (!ok || toff!=(off+LOG_REC_HDR_SIZE+l+rlen)) {
+                // skip its space and seqs : the log carries on after them
+                log_noout("CFG incomplete txn dropped at %4x", off);
+                off += rlen;
+                seq += n;
+            }
+        } else if (k==CFG_KEY_ILLEGAL) {
+            log_noout("CFG unknown control record at %4x", off);
+            break;
+        } else {
+            CFG_IDX_t* ke = findKeyIdx(k);
+            if (ke!=NULL) {
+                // newer value
+                ke->len = l;
+                ke->off = off+LOG_REC_HDR_SIZE;
+            } else if (addKeyIdx(k, l, off+LOG_REC_HDR_SIZE, 0)==NULL) {
+                log_noout("CFG RAM index full, key %4x ignored", k);
+            }
+        }
+        off += (LOG_REC_HDR_SIZE+l);
+        seq++;
+    }
+    _cfg.storeOffset = off;
+    _cfg.seq = seq;
+    _cfg.nbKeys = _cfg.nbIdx;
+    _cfg.liveBytes = 0;
+    for(int i=0;i<_cfg.nbIdx;i++) {
+        _cfg.liveBytes += (LOG_REC_HDR_SIZE+_cfg.index[i].len);
+    }
+}
+
+// Write the staged transaction : a txn record [key=0][len=3][n][RLen] followed by the n changed values (RLen bytes)
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool txnApply() {
+    uint8_t n = 0;
+    uint8_t nNew = 0;
+    uint16_t need = 0;
+    bool changed[TXN_MAX_KEYS];
+    for(int i=0;i<_txn.nKeys;i++) {
+        CFG_TXN_KEY_t* tk = &_txn.keys[i];
+        CFG_IDX_t* ke = findKeyIdx(tk->key);
+        if (ke!=NULL && ke->len!=tk->len) {
+            return false;
+        }
+        if (ke==NULL) {
+            nNew++;
+        }
+        changed[i] = (ke==NULL || !logSameValue(ke, &_txn.buf[tk->boff]));
+        if (changed[i]) {
+            n++;
+            need += (LOG_REC_HDR_SIZE+tk->len);
+        }
+    }
+    if ((_cfg.nbIdx+nNew) > MAX_KEYS) {
+        return false;
+    }
+    if (n==0) {
+        return true;        // nothing to write
+    }
+    if (logFree() < (LOG_REC_HDR_SIZE+3+need)) {
+        // Try to make space now
+        if (!logCompact() || logFree() < (LOG_REC_HDR_SIZE+3+need)) {
+            log_noout("CFG log full for txn");
+            return false;
+        }
+    }
+    uint16_t off = _cfg.storeOffset;
+    uint16_t seq = _cfg.seq;
+    uint8_t t[3] = { n, (need & 0xff), (need >> 8) };
+    if (!logWriteRec(off, _cfg.gen, seq, CFG_KEY_ILLEGAL, 3, t, 0, 0)) {
+        return false;
+    }
+    off += (LOG_REC_HDR_SIZE+3);
+    seq++;
+    for(int i=0;i<_txn.nKeys;i++) {
+        CFG_TXN_KEY_t* tk = &_txn.keys[i];
+        if (changed[i]) {
+            if (!logWriteRec(off, _cfg.gen, seq, tk->key, tk->len, &_txn.buf[tk->boff], 0, 0)) {
+                // Incomplete : ignored at next boot. The log carries on after its space and seqs (as logScan does),
+                // so that the records already written can never be taken as valid
+                _cfg.storeOffset += (LOG_REC_HDR_SIZE+3+need);
+                _cfg.seq += (1+n);
+                return false;
+            }
+            tk->noff = off+LOG_REC_HDR_SIZE;
+            off += (LOG_REC_HDR_SIZE+tk->len);
+            seq++;
+        }
+    }
+    // All written : update ram index
+    _cfg.storeOffset = off;
+    _cfg.seq = seq;
+    for(int i=0;i<_txn.nKeys;i++) {
+        CFG_TXN_KEY_t* tk = &_txn.keys[i];
+        if (changed[i]) {
+            CFG_IDX_t* ke = findKeyIdx(tk->key);
+            if (ke!=NULL) {
+                ke->off = tk->noff;
+            } else {
+                addKeyIdx(tk->key, tk->len, tk->noff, 0);
+                _cfg.nbKeys++;
+                _cfg.liveBytes += (LOG_REC_HDR_SIZE+tk->len);
+            }
+        }
+    }
+    if (logCompactNeeded() && !_cfg.compactEv.ev_queued) {
+        os_eventq_put(os_eventq_dflt_get(), &_cfg.compactEv);
+    }
+    return true;
+}
+
+// Delete : a control record [0] [0] [2] [Seq_LSB] [Seq_MSB] [Crc] [Key_LSB] [Key_MSB]
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool deleteKey(CFG_IDX_t* ke) {
+    uint8_t d[2] = { (ke->key & 0xff), (ke->key >> 8) };
+    if (logAppend(CFG_KEY_ILLEGAL, 2, d, NULL)<0) {
+        return false;
+    }
+    // ke may have moved if the append compacted, but its content is the same
+    _cfg.liveBytes -= (LOG_REC_HDR_SIZE+ke->len);
+    removeKeyIdx(ke);
+    _cfg.nbKeys--;
+    return true;
+}
+// Resize : just a new record for the key with the longer/shorter value
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool resizeKey(CFG_IDX_t* ke, uint8_t l) {
+    int off = logAppend(ke->key, l, NULL, ke);
+    if (off<0) {
+        return false;
+    }
+    _cfg.liveBytes += l;
+    _cfg.liveBytes -= ke->len;
+    ke->off = off;
+    ke->len = l;
+    return true;
+}
+// Compaction copies all the live records at once, so only do it if that fits in maxWrites
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool compactStore(uint16_t maxWrites) {
+    if ((_cfg.storeOffset - _cfg.storeStart)==_cfg.liveBytes) {
+        return true;        // nothing to reclaim
+    }
+    if ((_cfg.liveBytes+LOG_BANK_HDR_SIZE) > maxWrites) {
+        return false;
+    }
+    return logCompact();
+}
+
+// Find the active bank and load it, or create the log store (keeping the config from the index layout if we can)
+static void logInit() {
+    _cfg.compactEv.ev_cb = logCompactEv;
+    uint16_t g0 = 0;
+    uint16_t g1 = 0;
+    bool v0 = logReadBankHdr(0, &g0);
+    bool v1 = logReadBankHdr(1, &g1);
+    if (v0 || v1) {
+        if (v0 && (!v1 || ((int16_t)(g0-g1))>0)) {
+            _cfg.bank = 0;
+            _cfg.gen = g0;
+        } else {
+            _cfg.bank = 1;
+            _cfg.gen = g1;
+        }
+        logScan();
+        return;
+    }
+    log_noout("CFG no log store, creating");
+    cfgLockW();
+    // If there is a valid index layout config whose data is all in bank 0, copy its keys to bank 1
+    if (idxLoad() && _cfg.storeOffset<=logBankStart(1)) {
+        _cfg.bank = 0;
+        if (logCompactInto(1, 1)) {
+            _cfg.nbKeys = _cfg.nbIdx;
+            cfgUnlockW();
+            log_noout("CFG migrated %d keys to log store", _cfg.nbKeys);
+            return;
+        }
+    }
+    // Start empty in bank 0
+    _cfg.nbKeys = 0;
+    _cfg.nbIdx = 0;
+    _cfg.bank = 0;
+    _cfg.gen = 1;
+    _cfg.seq = 0;
+    _cfg.liveBytes = 0;
+    _cfg.storeStart = logBankStart(0)+LOG_BANK_HDR_SIZE;
+    _cfg.storeOffset = _cfg.storeStart;
+    if (!logWriteBankHdr(0, 1)) {
+        log_noout("CFG fail to write log bank hdr");
+    }
+    cfgUnlockW();
+    // just log passage : no assert (as this writes to PROM!)
+    log_fn_fn();
+}
+
+#else /* CFG_LOG_STORE */
+
+/** Journalled updates for index layout
+ * Changes to existing PROM data are first written to a journal in free store space : [Off_LSB][Off_MSB][Len][data]
+ * then the journal descriptor is written to the header (with the nbKeys to set, and a crc over the journal) : this
+ * is the commit point. The journal is then applied (data copied to its place, nbKeys written) and the descriptor
+ * cleared. If power fails before the descriptor is cleared, the journal is applied again at boot.
+ * An entry with Len=0 means update the crc of index slot Off (from the data now in its place).
+ */
+
+// Write and commit a journal at jOff, then apply it. Returns false if not committed.
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool idxJournalCommit(CFG_JENTRY_t* je, int n, uint16_t jOff, uint8_t nbKeys) {
+    uint8_t crc = 0;
+    uint16_t off = jOff;
+    for(int i=0;i<n;i++) {
+        uint8_t jh[TXN_JENTRY_HDR_SIZE] = { (je[i].off & 0xff), (je[i].off >> 8), je[i].len };
+        if ((off+TXN_JENTRY_HDR_SIZE+je[i].len) > _cfg.storeEnd || !nvmWrite(off, TXN_JENTRY_HDR_SIZE, jh)) {
+            log_noout("CFG fail to write journal at %4x", off);
+            return false;
+        }
+        crc = crc8(crc, jh, TXN_JENTRY_HDR_SIZE);
+        off += TXN_JENTRY_HDR_SIZE;
+        if (je[i].d!=NULL) {
+            if (!nvmWrite(off, je[i].len, je[i].d)) {
+                return false;
+            }
+            crc = crc8(crc, je[i].d, je[i].len);
+        } else {
+            uint8_t buf[CFG_COPY_CHUNK];
+            for(int j=0;j<je[i].len;j+=CFG_COPY_CHUNK) {
+                uint8_t cl = ((je[i].len-j)>CFG_COPY_CHUNK)?CFG_COPY_CHUNK:(je[i].len-j);
+                if (je[i].from==0) {
+                    memset(buf, 0, cl);
+                } else if (!nvmRead(je[i].from+j, cl, buf)) {
+                    return false;
+                }
+                if (!nvmWrite(off+j, cl, buf)) {
+                    return false;
+                }
+                crc = crc8(crc, buf, cl);
+            }
+        }
+        off += je[i].len;
+        if (je[i].crcSlot>=0 && _cfg.crcs) {
+            uint8_t ch[TXN_JENTRY_HDR_SIZE] = { (je[i].crcSlot & 0xff), (je[i].crcSlot >> 8), 0 };
+            if ((off+TXN_JENTRY_HDR_SIZE) > _cfg.storeEnd || !nvmWrite(off, TXN_JENTRY_HDR_SIZE, ch)) {
+                return false;
+            }
+            crc = crc8(crc, ch, TXN_JENTRY_HDR_SIZE);
+            off += TXN_JENTRY_HDR_SIZE;
+        }
+    }
+    uint16_t jLen = off-jOff;
+    // commit
+    uint8_t desc[TXN_DESC_SIZE] = { TXN_MAGIC, (jOff & 0xff), (jOff >> 8), (jLen & 0xff), (jLen >> 8), nbKeys, 0 };
+    desc[6] = crc8(crc, desc, 6);
+    // magic last, so that a partially written descriptor is never taken with the old one's crc
+    if (!nvmWrite(TXN_DESC_OFF+1, TXN_DESC_SIZE-1, &desc[1]) || !nvmWrite8(TXN_DESC_OFF, TXN_MAGIC)) {
+        log_noout("CFG fail to commit journal");
+        return false;
+    }
+    // apply it
+    if (!idxTxnReplay()) {
+        log_noout("CFG fail to apply journal");
+        // it will be done at next boot
+    }
+    return true;
+}
+
+/** Transaction commit for index layout
+ * 1 - new keys : their index entries (slots from nbKeys) and values are written, but are not visible until nbKeys
+ *     is updated
+ * 2 - changed values of existing keys, and the new nbKeys, are written as a journal in the free space after them
+ * !! MUST HAVE cfgLockW/cfgUnlockW round this call
+ */
+static bool txnApply() {
+    uint8_t nNew = 0;
+    uint16_t newData = 0;
+    uint8_t maxNewLen = 0;
+    for(int i=0;i<_txn.nKeys;i++) {
+        CFG_TXN_KEY_t* tk = &_txn.keys[i];
+        CFG_IDX_t* ke = findKeyIdx(tk->key);
+        if (ke==NULL) {
+            nNew++;
+            newData += tk->len;
+            if (tk->len>maxNewLen) {
+                maxNewLen = tk->len;
+            }
+        } else if (ke->len!=tk->len) {
+            return false;
+        }
+    }
+    if (((_cfg.nbKeys+nNew) > NVM_MAX_KEYS || !idxStoreFits(newData, maxNewLen)) && idxDeadSpace()>0) {
+        // Get back the space of deleted keys
+        idxCompact(0xFFFF);
+    }
+    if ((_cfg.nbKeys+nNew) > NVM_MAX_KEYS || (_cfg.nbIdx+nNew) > MAX_KEYS) {
+        return false;       // no joy
+    }
+    if (!idxStoreFits(newData, maxNewLen)) {
+        log_noout("CFG no space for txn");
+        return false;       // full up
+    }
+    // 1 - new keys
+    uint16_t off = _cfg.storeOffset;
+    int slot = _cfg.nbKeys;
+    for(int i=0;i<_txn.nKeys;i++) {
+        CFG_TXN_KEY_t* tk = &_txn.keys[i];
+        if (findKeyIdx(tk->key)==NULL) {
+            uint8_t ie[INDEX_SIZE] = { (tk->key & 0xff), (tk->key >> 8), tk->len, (off & 0xff), (off >> 8) };
+            if (!nvmWrite(_cfg.indexStart+slot*INDEX_SIZE, INDEX_SIZE, ie) ||
+                    !nvmWrite(off, tk->len, &_txn.buf[tk->boff]) ||
+                    (_cfg.crcs && !idxUpdateCrc(slot))) {
+                log_noout("CFG fail to write txn key %4x", tk->key);
+                return false;
+            }
+            tk->noff = off;
+            off += tk->len;
+            slot++;
+        }
+    }
+    // 2 - journal for the existing keys
+    CFG_JENTRY_t je[TXN_MAX_KEYS];
+    int nj = 0;
+    for(int i=0;i<_txn.nKeys;i++) {
+        CFG_TXN_KEY_t* tk = &_txn.keys[i];
+        CFG_IDX_t* ke = findKeyIdx(tk->key);
+        if (ke!=NULL) {
+            je[nj].off = ke->off;
+            je[nj].len = tk->len;
+            je[nj].d = &_txn.buf[tk->boff];
+            je[nj].crcSlot = ke->slot;
+            nj++;
+        }
+    }
+    if (!idxJournalCommit(je, nj, off, _cfg.nbKeys+nNew)) {
+        return false;
+    }
+    // update ram index
+    slot = _cfg.nbKeys;
+    for(int i=0;i<_txn.nKeys;i++) {
+        CFG_TXN_KEY_t* tk = &_txn.keys[i];
+        if (findKeyIdx(tk->key)==NULL) {
+            addKeyIdx(tk->key, tk->len, tk->noff, slot++);
+        }
+    }
+    _cfg.nbKeys += nNew;
+    _cfg.storeOffset += newData;
+    return true;
+}
+
+/** Compaction for index layout
+ * Deleted/resized keys leave dead slots and dead value space. Live entries are slid down over them, in slot order
+ * (values are always in the same order as their slots). Each move (new index entry + value, and the old slot
+ * marked deleted) is a journalled update, so the store is valid after each move and an interrupted compaction just
+ * carries on next time. Stops once maxWrites bytes would be exceeded.
+ * The journal goes after the end of the store : new keys and resizes always leave enough space for it.
+ * !! MUST HAVE cfgLockW/cfgUnlockW round this call
+ */
+static bool idxCompact(uint16_t maxWrites) {
+    if (_cfg.idxFull) {
+        return false;       // can't move keys we don't know about
+    }
+    uint32_t written = 0;
+    // Delete any slot that is not live but still has a len (old entry of an interrupted resize), so it can't come back
+    for(int s=0;s<_cfg.nbKeys;s++) {
+        if (findSlotIdx(s)==NULL && getIdxLen(s)!=0) {
+            if (!nvmWrite8(_cfg.indexStart+s*INDEX_SIZE+2, 0)) {
+                return false;
+            }
+            written++;
+        }
+    }
+    uint8_t dslot = 0;
+    uint16_t doff = _cfg.storeStart;
+    // Journal in the free space after the (current) end of the store : always free as we only move things down
+    uint16_t jOff = _cfg.storeOffset;
+    for(int s=0;s<_cfg.nbKeys;s++) {
+        CFG_IDX_t* ke = findSlotIdx(s);
+        if (ke==NULL) {
+            continue;       // dead slot
+        }
+        if (ke->slot!=dslot || ke->off!=doff) {
+            // journal, then its replay (value, index entry, old slot len, nbKeys x2 and descriptor clear)
+            uint16_t cost = IDX_MOVE_JSIZE(ke->len) + TXN_DESC_SIZE + (ke->len+INDEX_SIZE+1) + 3;
+            if ((written+cost) > maxWrites) {
+                log_noout("CFG compaction stopped after %d bytes", written);
+                return false;
+            }
+            uint8_t ie[INDEX_SIZE] = { (ke->key & 0xff), (ke->key >> 8), ke->len, (doff & 0xff), (doff >> 8) };
+            uint8_t zero = 0;
+            CFG_JENTRY_t je[3] = {
+                { .off=doff, .len=ke->len, .d=NULL, .from=ke->off, .crcSlot=-1 },
+                { .off=_cfg.indexStart+dslot*INDEX_SIZE, .len=INDEX_SIZE, .d=ie, .crcSlot=dslot },
+                { .off=_cfg.indexStart+ke->slot*INDEX_SIZE+2, .len=1, .d=&zero, .crcSlot=-1 },     // old slot deleted
+            };
+            if (!idxJournalCommit(je, (ke->slot!=dslot)?3:2, jOff, _cfg.nbKeys)) {
+                return false;
+            }
+            cacheInvalidate(ke->key);
+            ke->slot = dslot;
+            ke->off = doff;
+            written += cost;
+        }
+        dslot++;
+        doff += ke->len;
+    }
+    // Drop the dead slots at the end
+    if (dslot!=_cfg.nbKeys) {
+        if (!idxJournalCommit(NULL, 0, jOff, dslot)) {
+            return false;
+        }
+    }
+    log_noout("CFG compacted %d -> %d keys, store end %4x -> %4x", _cfg.nbKeys, dslot, _cfg.storeOffset, doff);
+    _cfg.nbKeys = dslot;
+    _cfg.storeOffset = doff;
+    return true;
+}
+
+// Number of dead slots + dead bytes in the store
+static int idxDeadSpace() {
+    if (_cfg.idxFull) {
+        return 0;       // don't know
+    }
+    int live = 0;
+    for(int i=0;i<_cfg.nbIdx;i++) {
+        live += _cfg.index[i].len;
+    }
+    return (_cfg.nbKeys-_cfg.nbIdx) + ((_cfg.storeOffset-_cfg.storeStart)-live);
+}
+// Check newData bytes can be added to the store, while keeping enough free space after it for the journal of any
+// compaction move (of an existing value or one of maxNewLen)
+static bool idxStoreFits(uint16_t newData, uint8_t maxNewLen) {
+    uint8_t maxl = maxNewLen;
+    for(int i=0;i<_cfg.nbIdx;i++) {
+        if (_cfg.index[i].len>maxl) {
+            maxl = _cfg.index[i].len;
+        }
+    }
+    return (_cfg.storeOffset+newData+IDX_MOVE_JSIZE(maxl)) <= _cfg.storeEnd;
+}
+// The live key in the given PROM index slot, or NULL if the slot is dead
+static CFG_IDX_t* findSlotIdx(int s) {
+    for(int i=0;i<_cfg.nbIdx;i++) {
+        if (_cfg.index[i].slot==s) {
+            return &_cfg.index[i];
+        }
+    }
+    return NULL;
+}
+
+// Delete : the len in the key's index slot is set to 0. The slot stays used until the next compaction.
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool deleteKey(CFG_IDX_t* ke) {
+    if (!nvmWrite8(_cfg.indexStart+ke->slot*INDEX_SIZE+2, 0)) {
+        log_noout("CFG fail to delete key %4x at slot %d", ke->key, ke->slot);
+        return false;
+    }
+    removeKeyIdx(ke);
+    return true;
+}
+
+/** Resize for index layout
+ * The key gets a new index slot (nbKeys) and value at the end of the store, which is made visible by updating nbKeys.
+ * Then the old slot is deleted. If power fails between the two, there are 2 slots for the key : the later one wins.
+ * !! MUST HAVE cfgLockW/cfgUnlockW round this call
+ */
+static bool resizeKey(CFG_IDX_t* ke, uint8_t l) {
+    if ((_cfg.nbKeys>=NVM_MAX_KEYS || !idxStoreFits(l, l)) && idxDeadSpace()>0) {
+        idxCompact(0xFFFF);
+    }
+    if (_cfg.nbKeys>=NVM_MAX_KEYS || !idxStoreFits(l, l)) {
+        return false;         // full up
+    }
+    int slot = _cfg.nbKeys;
+    uint16_t off = _cfg.storeOffset;
+    // Value first : start of the old one then 0s
+    uint8_t buf[CFG_COPY_CHUNK];
+    for(int i=0;i<l;i+=CFG_COPY_CHUNK) {
+        uint8_t cl = ((l-i)>CFG_COPY_CHUNK)?CFG_COPY_CHUNK:(l-i);
+        memset(buf, 0, CFG_COPY_CHUNK);
+        if (i<ke->len && !nvmRead(ke->off+i, ((ke->len-i)<cl)?(ke->len-i):cl, buf)) {
+            return false;
+        }
+        if (!nvmWrite(off+i, cl, buf)) {
+            log_noout("CFG fail to write data at %4x len %2x", off+i, cl);
+            return false;
+        }
+    }
+    uint8_t ie[INDEX_SIZE] = { (ke->key & 0xff), (ke->key >> 8), l, (off & 0xff), (off >> 8) };
+    if (!nvmWrite(_cfg.indexStart+slot*INDEX_SIZE, INDEX_SIZE, ie)) {
+        log_noout("CFG fail to write at %4x key %4x", _cfg.indexStart+slot*INDEX_SIZE, ke->key);
+        return false;
+    }
+    if (_cfg.crcs && !idxUpdateCrc(slot)) {
+        return false;
+    }
+    // Make it visible
+    if (!idxWriteNbKeys(slot+1)) {
+        log_noout("CFG fail to write nbKeys %2x", slot+1);
+        return false;
+    }
+    _cfg.nbKeys++;
+    _cfg.storeOffset += l;
+    // Delete the old one (if this fails, the new one still wins at next boot)
+    nvmWrite8(_cfg.indexStart+ke->slot*INDEX_SIZE+2, 0);
+    ke->slot = slot;
+    ke->off = off;
+    ke->len = l;
+    return true;
+}
+
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool compactStore(uint16_t maxWrites) {
+    if (idxDeadSpace()==0) {
+        return !_cfg.idxFull;
+    }
+    return idxCompact(maxWrites);
+}
+
+// Apply the committed transaction journal if there is one. Returns true if it was applied
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool idxTxnReplay() {
+    uint8_t desc[TXN_DESC_SIZE];
+    if (!nvmRead(TXN_DESC_OFF, TXN_DESC_SIZE, desc) || desc[0]!=TXN_MAGIC) {
+        return false;       // no txn
+    }
+    uint16_t jOff = Util_readLE_uint16_t(&desc[1], 2);
+    uint16_t jLen = Util_readLE_uint16_t(&desc[3], 2);
+    if (jOff<_cfg.storeStart || (jOff+jLen) > _cfg.storeEnd || desc[5]>NVM_MAX_KEYS) {
+        return false;
+    }
+    // Check journal is complete
+    uint8_t crc = 0;
+    uint8_t buf[CFG_COPY_CHUNK];
+    for(int i=0;i<jLen;i+=CFG_COPY_CHUNK) {
+        uint8_t cl = ((jLen-i)>CFG_COPY_CHUNK)?CFG_COPY_CHUNK:(jLen-i);
+        if (!nvmRead(jOff+i, cl, buf)) {
+            return false;
+        }
+        crc = crc8(crc, buf, cl);
+    }
+    if (crc8(crc, desc, 6)!=desc[6]) {
+        return false;       // not a committed txn
+    }
+    // Copy each value to its place
+    bool ret = true;
+    uint16_t off = jOff;
+    while(off < (jOff+jLen)) {
+        uint8_t jh[TXN_JENTRY_HDR_SIZE];
+        nvmRead(off, TXN_JENTRY_HDR_SIZE, jh);
+        uint16_t voff = Util_readLE_uint16_t(&jh[0], 2);
+        uint8_t vl = jh[2];
+        off += TXN_JENTRY_HDR_SIZE;
+        if (vl==0) {
+            ret &= idxUpdateCrc(voff);
+        }
+        for(int i=0;i<vl;i+=CFG_COPY_CHUNK) {
+            uint8_t cl = ((vl-i)>CFG_COPY_CHUNK)?CFG_COPY_CHUNK:(vl-i);
+            ret &= nvmRead(off+i, cl, buf);
+            ret &= nvmWrite(voff+i, cl, buf);
+        }
+        off += vl;
+    }
+    // and make the new keys visible
+    ret &= idxWriteNbKeys(desc[5]);
+    if (ret) {
+        // done
+        ret = nvmWrite8(TXN_DESC_OFF, 0);
+    }
+    return ret;
+}
+
+// Set the number of index slots : write the other header copy with the next generation (the commit point), then the
+// old nbKeys bytes. The copy's magic is cleared first and written last, so a partial write never looks valid.
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool idxWriteNbKeys(uint8_t n) {
+    if (_cfg.crcs) {
+        uint8_t c = 1-_cfg.bank;
+        uint16_t gen = _cfg.gen+1;
+        uint8_t h[IDX_HDR_SIZE] = { IDX_HDR_MAGIC, IDX_HDR_VERSION, (gen & 0xff), (gen >> 8), n, 0, 0, 0 };
+        h[7] = crc8(0, h, 7);
+        if (!nvmWrite8(idxHdrOff(c), 0) || !nvmWrite(idxHdrOff(c)+1, IDX_HDR_SIZE-1, &h[1]) ||
+                !nvmWrite8(idxHdrOff(c), IDX_HDR_MAGIC)) {
+            return false;
+        }
+        _cfg.bank = c;
+        _cfg.gen = gen;
+    }
+    return nvmWrite8(1, n) && nvmWrite8(0, n);
+}
+// Write the crc of an index slot, from its entry and value in PROM
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static bool idxUpdateCrc(int slot) {
+    uint8_t ie[INDEX_SIZE];
+    uint8_t c = 0;
+    if (slot<0 || slot>=NVM_MAX_KEYS || !nvmRead(_cfg.indexStart+(slot*INDEX_SIZE), INDEX_SIZE, ie)) {
+        return false;
+    }
+    if (ie[2]==0) {
+        return true;        // deleted
+    }
+    if (!idxEntryCrc(ie, &c)) {
+        return false;
+    }
+    return nvmWrite8(idxCrcOff(slot), c);
+}
+// Start the header copies for a new store
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static void idxResetHdrs() {
+    nvmWrite8(idxHdrOff(0), 0);
+    nvmWrite8(idxHdrOff(1), 0);
+    _cfg.crcs = true;
+    _cfg.storeEnd = idxHdrOff(0);
+    _cfg.bank = 1;
+    _cfg.gen = 0;
+    if (!idxWriteNbKeys(_cfg.nbKeys)) {
+        log_noout("CFG fail to write hdr");
+    }
+}
+// Store from an older build : add the crcs and header copies, if the store leaves the space for them.
+// Until the first header copy is written, it stays an older build's store (so a power fail just means doing it again).
+// !! MUST HAVE cfgLockW/cfgUnlockW round this call
+static void idxAddCrcs() {
+    if (_cfg.storeOffset > idxHdrOff(0)) {
+        log_noout("CFG no space to add crcs (store end %4x)", _cfg.storeOffset);
+        return;
+    }
+    for(int s=0;s<_cfg.nbKeys;s++) {
+        if (!idxUpdateCrc(s)) {
+            // this entry is bad anyway : it will be dropped
+            log_noout("CFG fail to add crc for slot %d", s);
+        }
+    }
+    idxResetHdrs();
+    log_noout("CFG crcs added for %d slots", _cfg.nbKeys);
+}
+
+// Direct PROM index accessors : only used for debug, the RAM index is used for all other accesses
+// * !! No need to UNLOCK to make this call as only READ
+static uint16_t getIdxKey(int idx) {
+    if (idx<0 || idx>=_cfg.nbKeys) {
+        return CFG_KEY_ILLEGAL;
+    }
+    return nvmRead16(_cfg.indexStart+(idx*INDEX_SIZE));
+
+}
+// * !! No need to UNLOCK to make this call as only READ
+static uint8_t getIdxLen(int idx) {
+    if (idx<0 || idx>=_cfg.nbKeys) {
+        return 0;
+    }
+    return nvmRead8(_cfg.indexStart+(idx*INDEX_SIZE)+2);
+
+}
+// * !! No need to UNLOCK to make this call as only READ
+static uint16_t getIdxOff(int idx) {
+    if (idx<0 || idx>=_cfg.nbKeys) {
+        return 0;
+    }
+    return nvmRead16(_cfg.indexStart+(idx*INDEX_SIZE)+3);
+}
+#endif /* CFG_LOG_STORE */
+
+// PROM accesses : all go through here, to count them (and for power fail tests)
+static uint8_t nvmRead8(uint16_t off) {
+    NVM_STAT_ADD(reads, 1);
+    NVM_STAT_ADD(readBytes, 1);
+    return hal_bsp_nvmRead8(off);
+}
+static uint16_t nvmRead16(uint16_t off) {
+    NVM_STAT_ADD(reads, 1);
+    NVM_STAT_ADD(readBytes, 2);
+    return hal_bsp_nvmRead16(off);
+}
+static bool nvmRead(uint16_t off, uint8_t len, uint8_t* buf) {
+    NVM_STAT_ADD(reads, 1);
+    NVM_STAT_ADD(readBytes, len);
+    return hal_bsp_nvmRead(off, len, buf);
+}
+#if MYNEWT_VAL(CFG_NVM_STATS)
+// Count a write of len bytes, and return how many can be written before the power fail test reset
+static uint8_t nvmWriteCount(uint8_t len) {
+    _nvmStats.writes++;
+    _nvmStats.writeBytes+=len;
+    if (_nvmFailAfter<0) {
+        return len;
+    }
+    if (_nvmFailAfter<len) {
+        return _nvmFailAfter;
+    }
+    _nvmFailAfter-=len;
+    return len;
+}
+static void nvmPowerFail(uint16_t off) {
+    log_noout("CFG power fail test reset at write to %4x", off);
+    hal_system_reset();
+}
+#endif
+static bool nvmWrite8(uint16_t off, uint8_t v) {
+#if MYNEWT_VAL(CFG_NVM_STATS)
+    if (nvmWriteCount(1)<1) {
+        nvmPowerFail(off);
+    }
+#endif
+    return hal_bsp_nvmWrite8(off, v);
+}
+static bool nvmWrite16(uint16_t off, uint16_t v) {
+#if MYNEWT_VAL(CFG_NVM_STATS)
+    uint8_t d[2] = { (v & 0xff), (v >> 8) };
+    return nvmWrite(off, 2, d);
+#else
+    return hal_bsp_nvmWrite16(off, v);
+#endif
+}
+static bool nvmWrite(uint16_t off, uint8_t len, uint8_t* buf) {
+#if MYNEWT_VAL(CFG_NVM_STATS)
+    uint8_t ok = nvmWriteCount(len);
+    if (ok<len) {
+        // torn write
+        if (ok>0) {
+            hal_bsp_nvmWrite(off, ok, buf);
+        }
+        nvmPowerFail(off+ok);
+    }
+#endif
+    return hal_bsp_nvmWrite(off, len, buf);
+}
+
+// Get the PROM access counts since boot (or last reset of them). All 0 unless CFG_NVM_STATS is set.
+void CFMgr_getNvmStats(CFG_NVM_STATS_t* stats) {
+#if MYNEWT_VAL(CFG_NVM_STATS)
+    *stats = _nvmStats;
+#else
+    memset(stats, 0, sizeof(CFG_NVM_STATS_t));
+#endif
+}
+void CFMgr_resetNvmStats(void) {
+#if MYNEWT_VAL(CFG_NVM_STATS)
+    memset(&_nvmStats, 0, sizeof(_nvmStats));
+#endif
+}
+// Power fail test : reset the device once nbytes more bytes have been written to PROM (possibly in the middle of
+// a multi byte write). Only if CFG_NVM_STATS is set.
+void CFMgr_setPowerFailAfter(uint32_t nbytes) {
+#if MYNEWT_VAL(CFG_NVM_STATS)
+    _nvmFailAfter = nbytes;
+#endif
+}
+
+// Protect access to PROM and the RAM index
+// The mutex can be taken again by the task that has it (os_mutex counts the nesting), so cfgLockW inside cfgLockR
+// is ok, as are API calls from inside an API call (eg registerSchema). Before the OS is started it is a noop.
+// Lock for reading only
+static void cfgLockR() {
+    os_mutex_pend(&_cfg.lock, OS_TIMEOUT_NEVER);
+}
+static void cfgUnlockR() {
+    os_mutex_release(&_cfg.lock);
+}
+// Lock for Writing (and reading). Include PROM protection unlock/lock
+static void cfgLockW() {
+    os_mutex_pend(&_cfg.lock, OS_TIMEOUT_NEVER);
+    // Unlock PROM so can wrtie to it
+    NVM_STAT_ADD(unlocks, 1);
+    hal_bsp_nvmUnlock();
 }
 static void cfgUnlockW() {
     // Lock PROM so can't accidently write to it
     hal_bsp_nvmLock();
+    os_mutex_release(&_cfg.lock);
 }
 
 #ifndef RELEASE_BUILD
 // DUMP PROM to blocking UART
 void dumpCfg() {
     cfgLockR();
-    uint8_t nbK_pri = hal_bsp_nvmRead8(0);
-    uint8_t nbK_sec = hal_bsp_nvmRead8(1);
+#if MYNEWT_VAL(CFG_NVM_STATS)
+    log_noout("PROM reads %d (%d bytes), writes %d (%d bytes) for %d value bytes, unlocks %d", _nvmStats.reads,
+        _nvmStats.readBytes, _nvmStats.writes, _nvmStats.writeBytes, _nvmStats.valueBytes, _nvmStats.unlocks);
+#endif
+#if MYNEWT_VAL(CFG_LOG_STORE)
+    log_noout("log store bank %d gen %d, tail %4x, end %4x, live %d, seq %d", _cfg.bank, _cfg.gen,
+        _cfg.storeOffset, logBankEnd(_cfg.bank), _cfg.liveBytes, _cfg.seq);
+    for(int i=0; i<_cfg.nbIdx;i++) {
+        log_noout("key %4x, len %d, offset %4x", _cfg.index[i].key, _cfg.index[i].len, _cfg.index[i].off);
+    }
+#else
+    uint8_t nbK_pri = nvmRead8(0);
+    uint8_t nbK_sec = nvmRead8(1);
     log_noout("nbKPri %d, nbKSec %d", nbK_pri, nbK_sec);
-    uint16_t indexStart = hal_bsp_nvmRead16(2);
-    uint16_t storeStart = hal_bsp_nvmRead16(4);
+    if (_cfg.crcs) {
+        log_noout("hdr copy %d gen %d nbK %d, store end %4x", _cfg.bank, _cfg.gen, _cfg.nbKeys, _cfg.storeEnd);
+    } else {
+        log_noout("no hdr copies/crcs");
+    }
+    uint16_t indexStart = nvmRead16(2);
+    uint16_t storeStart = nvmRead16(4);
     if (indexStart<NVM_HDR_SIZE|| indexStart>hal_bsp_nvmSize() ||
              storeStart<NVM_HDR_SIZE || storeStart>hal_bsp_nvmSize() || 
-             storeStart < (indexStart+MAX_KEYS*INDEX_SIZE)) {
+             storeStart < (indexStart+NVM_MAX_KEYS*INDEX_SIZE)) {
         log_noout("badness with indexStart %4x or storeStart %4x", indexStart, storeStart);
     } else {
         log_noout("ok with indexStart %4x and storeStart %4x", indexStart, storeStart);
@@ -544,6 +2759,7 @@ void dumpCfg() {
     for(int i=0; i<nbK_pri;i++) {
         log_noout("idx %d -> key %4x, len %d, offset %4x", i, getIdxKey(i), getIdxLen(i), getIdxOff(i));
     }
+#endif
     cfgUnlockR();
 }
 #endif /* RELEASE_BUILD */ 
@@ -552,12 +2768,114 @@ bool unittest_cfg() {
     bool ret = true;        // assume all will go ok
     // test data
     uint8_t data[8]= {0};
-    ret &= unittest("get", CFMgr_getOrAddElement(CFGKEY(0, 0), data, 8));
+    ret &= unittest("get", CFMgr_getOrAddElement(CFGKEY(CFG_MODULE_UTIL, 0xFF), data, 8));
     ret &= unittest("check get def", data[0]==0x00);
     data[0] = 0x01;
-    ret &= unittest("set", CFMgr_setElement(CFGKEY(0, 0), data, 8));
-    ret &= unittest("get new", CFMgr_getOrAddElement(CFGKEY(0, 0), data, 8));
+    ret &= unittest("set", CFMgr_setElement(CFGKEY(CFG_MODULE_UTIL, 0xFF), data, 8));
+    ret &= unittest("get new", CFMgr_getOrAddElement(CFGKEY(CFG_MODULE_UTIL, 0xFF), data, 8));
     ret &= unittest("check new", data[0]==0x01);
+    ret &= unittest("txn begin", CFMgr_txnBegin());
+    data[0] = 0x02;
+    ret &= unittest("txn set", CFMgr_setElement(CFGKEY(CFG_MODULE_UTIL, 0xFF), data, 8));
+    data[0] = 0x00;
+    ret &= unittest("txn get staged", CFMgr_getElement(CFGKEY(CFG_MODULE_UTIL, 0xFF), data, 8)==8 && data[0]==0x02);
+    ret &= unittest("txn commit", CFMgr_txnCommit());
+    data[0] = 0x00;
+    ret &= unittest("txn get committed", CFMgr_getElement(CFGKEY(CFG_MODULE_UTIL, 0xFF), data, 8)==8 && data[0]==0x02);
+    ret &= unittest("resize", CFMgr_resizeElement(CFGKEY(CFG_MODULE_UTIL, 0xFF), 4));
+    ret &= unittest("get resized", CFMgr_getElement(CFGKEY(CFG_MODULE_UTIL, 0xFF), data, 8)==4 && data[0]==0x02);
+    ret &= unittest("delete", CFMgr_deleteElement(CFGKEY(CFG_MODULE_UTIL, 0xFF)));
+    ret &= unittest("get deleted", CFMgr_getElement(CFGKEY(CFG_MODULE_UTIL, 0xFF), data, 8)==-1);
+    {
+        // export/import round trip on a module with just our key
+        uint8_t blob[16];
+        uint8_t exp[] = { 0xBF, 0x19, 0xFF, 0xFE, 0x44, 0x03, 0x00, 0x00, 0x00, 0xFF };
+        memset(data, 0, 4);
+        data[0] = 0x03;
+        ret &= unittest("set exp", CFMgr_setElement(CFGKEY(0xFF, 0xFE), data, 4));
+        ret &= unittest("export", CFMgr_exportCBOR(0xFF, blob, sizeof(blob))==sizeof(exp) && memcmp(blob, exp, sizeof(exp))==0);
+        ret &= unittest("export too small", CFMgr_exportCBOR(0xFF, blob, 4)==-1);
+        data[0] = 0x00;
+        ret &= unittest("set exp 0", CFMgr_setElement(CFGKEY(0xFF, 0xFE), data, 4));
+        ret &= unittest("import", CFMgr_importCBOR(exp, sizeof(exp))==1);
+        ret &= unittest("get imported", CFMgr_getElement(CFGKEY(0xFF, 0xFE), data, 4)==4 && data[0]==0x03);
+        ret &= unittest("import bad", CFMgr_importCBOR(exp, sizeof(exp)-1)==-1);
+        CFMgr_deleteElement(CFGKEY(0xFF, 0xFE));
+    }
     return ret;
 }
-#endif /* UNITTEST */
\ No newline at end of file
+
+// Power fail recovery test (needs CFG_NVM_STATS), run by CFMgr_init() at each boot : that takes 1 boot per byte written
+// by the sequence below (a few hundred). Each boot arms the power fail hook 1 byte further into the same sequence : set
+// of an existing key, add of a new key, a transaction of 3 keys and a delete. At the next boot, each key must have its
+// value from before or after the sequence, and the transaction keys must all have the same one. The result is then
+// kept (in the step key) so later boots just return it : false if a check failed, true once the whole sequence ran
+// without a reset. Delete the step key to run it again.
+#define UT_PF_STEP CFGKEY(0xFF, 0xF0)
+#define UT_PF_PASSED (0xFFFFFFFF)
+#define UT_PF_FAILED (0xFFFFFFFE)
+#define UT_PF_KEY(i) CFGKEY(0xFF, 0xF1+(i))      // 0:set 1:add 2-4:txn 5:delete
+#define UT_PF_NKEYS (6)
+// Remove the test keys and record the result
+static bool unittest_cfg_pfDone(bool ok) {
+    uint32_t res = ok ? UT_PF_PASSED : UT_PF_FAILED;
+    for(int i=0;i<UT_PF_NKEYS;i++) {
+        CFMgr_deleteElement(UT_PF_KEY(i));
+    }
+    CFMgr_setElement(UT_PF_STEP, &res, sizeof(res));
+    return ok;
+}
+bool unittest_cfg_powerfail() {
+#if MYNEWT_VAL(CFG_NVM_STATS)
+    bool ret = true;
+    uint32_t step = 0;
+    uint32_t one = 1;
+    uint32_t two = 2;
+    CFMgr_getOrAddElement(UT_PF_STEP, &step, sizeof(step));
+    if (step==UT_PF_PASSED || step==UT_PF_FAILED) {
+        return unittest("pf done", step==UT_PF_PASSED);
+    }
+    if (step>0) {
+        // We were reset during the last step : check what is left
+        uint32_t v[UT_PF_NKEYS];
+        for(int i=0;i<UT_PF_NKEYS;i++) {
+            if (CFMgr_getElement(UT_PF_KEY(i), &v[i], sizeof(v[i]))!=sizeof(v[i])) {
+                v[i] = 0;       // missing
+            }
+        }
+        ret &= unittest("pf set", v[0]==1 || v[0]==2);
+        ret &= unittest("pf add", v[1]==0 || v[1]==2);
+        ret &= unittest("pf txn", (v[2]==1 || v[2]==2) && v[3]==v[2] && v[4]==v[2]);
+        ret &= unittest("pf delete", v[5]==0 || v[5]==1);
+        if (!ret) {
+            log_noout("CFG power fail test FAIL after reset at byte %d", step-1);
+            return unittest_cfg_pfDone(false);
+        }
+    }
+    // Back to the state before the sequence, and next step
+    CFMgr_setElement(UT_PF_KEY(0), &one, sizeof(one));
+    CFMgr_deleteElement(UT_PF_KEY(1));
+    for(int i=2;i<UT_PF_NKEYS;i++) {
+        CFMgr_setElement(UT_PF_KEY(i), &one, sizeof(one));
+    }
+    step++;
+    CFMgr_setElement(UT_PF_STEP, &step, sizeof(step));
+    // The sequence, reset after step-1 bytes
+    CFMgr_setPowerFailAfter(step-1);
+    CFMgr_setElement(UT_PF_KEY(0), &two, sizeof(two));
+    CFMgr_setElement(UT_PF_KEY(1), &two, sizeof(two));
+    CFMgr_txnBegin();
+    for(int i=2;i<5;i++) {
+        CFMgr_setElement(UT_PF_KEY(i), &two, sizeof(two));
+    }
+    CFMgr_txnCommit();
+    CFMgr_deleteElement(UT_PF_KEY(5));
+    // Still here : every byte of it has been tested
+    CFMgr_setPowerFailAfter(-1);
+    log_noout("CFG power fail test ok, %d reset points", step-1);
+    return unittest_cfg_pfDone(ret);
+#else
+    return unittest("pf needs CFG_NVM_STATS", false);
+#endif
+}
+#endif /* UNITTEST */
\ No newline at end of file
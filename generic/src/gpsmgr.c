@@ -58,7 +58,6 @@ static struct appctx {
     GPS_POWERMODE_t powerMode;
     int8_t uartSelect;
     wskt_t* cnx;
-    uint8_t rxbuf[WSKT_BUF_SZ+1];
     gps_data_t gpsData;
     struct  {
         uint8_t secs;
@@ -77,12 +76,14 @@ static struct appctx {
 
 
 // Define my state ids
-enum MyStates { MS_IDLE, MS_STARTING_COMM, MS_GETTING_FIX, MS_STOPPING_COMM, MS_LAST };
-enum MyEvents { ME_START_GPS, ME_STOP_GPS, ME_UART_FAIL, ME_GPS_CONN_OK, ME_GPS_CONN_NOK, ME_GPS_FIX, ME_GPS_UART_OK, ME_GPS_UART_NOK };
+enum MyStates { MS_IDLE, MS_STARTING_COMM, MS_GETTING_FIX, MS_STOPPING_COMM, MS_RUNNING, MS_LAST };
+enum MyEvents { ME_START_GPS, ME_STOP_GPS, ME_UART_FAIL, ME_GPS_CONN_OK, ME_GPS_CONN_NOK, ME_GPS_FIX, ME_GPS_UART_OK, ME_GPS_UART_NOK, ME_GPS_UART_CLOSED };
 
 // predeclare privates
 //static void gps_mgr_task(void* arg);
 static void gps_mgr_rxcb(struct os_event* ev);
+static void gps_processLine(const char* line);
+static void gps_uart_closed(int8_t res);
 static bool parseNEMA(const char* line, gps_data_t* nd);
 
 static void callCB(GPS_EVENT_TYPE_t e) {
@@ -145,6 +146,8 @@ static SM_STATE_ID_t State_StartingComm(void* arg, int e, void* data) {
                 sm_sendEvent(ctx->mySMId, ME_GPS_UART_NOK, NULL);
                 return SM_STATE_CURRENT;
             }
+            // if we fall behind, the latest NMEA sentences are the ones worth keeping
+            wskt_setRxQPolicy(ctx->cnx, WSKT_RXQ_DROP_OLDEST);
 
             // start timeout for comm check - initial timer for 5s to at least get connection up
             sm_timer_start(ctx->mySMId, 5000);
@@ -224,13 +227,10 @@ static SM_STATE_ID_t State_StartingComm(void* arg, int e, void* data) {
             callCB(GPS_NEWFIX);
             return MS_GETTING_FIX;
         }
-        case ME_STOP_GPS: {
-            return MS_STOPPING_COMM;
-        }
 
         default: {
-            sm_default_event_log(ctx->mySMId, "GPS", e);
-            return SM_STATE_CURRENT;
+            // ME_STOP_GPS etc
+            return SM_STATE_PARENT;
         }
     }
     assert(0);      // shouldn't get here
@@ -266,10 +266,27 @@ static SM_STATE_ID_t State_GettingFix(void* arg, int e, void* data) {
             callCB(GPS_NEWFIX);
             return SM_STATE_CURRENT;
         }
+
+        default: {
+            // ME_STOP_GPS etc
+            return SM_STATE_PARENT;
+        }
+    }
+    assert(0);      // shouldn't get here
+}
+// Parent of the states where the GPS is being used : the events common to them are dealt with here
+static SM_STATE_ID_t State_Running(void* arg, int e, void* data) {
+    struct appctx* ctx = (struct appctx*)arg;
+    switch(e) {
+        case SM_ENTER: {
+            return SM_STATE_CURRENT;
+        }
+        case SM_EXIT: {
+            return SM_STATE_CURRENT;
+        }
         case ME_STOP_GPS: {
             return MS_STOPPING_COMM;
         }
-
         default: {
             sm_default_event_log(ctx->mySMId, "GPS", e);
             return SM_STATE_CURRENT;
@@ -291,14 +308,18 @@ static SM_STATE_ID_t State_StoppingComm(void* arg, int e, void* data) {
             } else {
                 log_debug("GPS:stopping GGA %d ok, %d nok", _ctx.cntGGA_OK, _ctx.cntGGA_NOK);
             }
-            // basically it gets 200ms to absorb this last command before the uart goes away
-            sm_timer_start(ctx->mySMId, 200);
+            // uart goes away as soon as this last command is out, then we can power off
+            if (ctx->cnx!=NULL) {
+                wskt_closeAfterDrain(&ctx->cnx, gps_uart_closed);
+            } else {
+                sm_sendEvent(ctx->mySMId, ME_GPS_UART_CLOSED, NULL);
+            }
             return SM_STATE_CURRENT;
         }
         case SM_EXIT: {
             return SM_STATE_CURRENT;
         }
-        case SM_TIMEOUT: {                        
+        case ME_GPS_UART_CLOSED: {
             if (ctx->pwrPin>=0) {
                 if (ctx->powerMode==POWER_ONOFF) {
                     log_debug("GPS: OFF pin %d", ctx->pwrPin);
@@ -307,9 +328,6 @@ static SM_STATE_ID_t State_StoppingComm(void* arg, int e, void* data) {
                     log_debug("GPS:LEFT ON pin %d",ctx->pwrPin);
                 }
             }
-            if (ctx->cnx!=NULL) {
-                wskt_close(&ctx->cnx);      // should take effect after empty of current tx buffer...
-            }
 //            uart_select(-1);        // free the UART
             // tell the user we're done with uart etc
             callCB(GPS_DONE);
@@ -327,13 +345,15 @@ static SM_STATE_ID_t State_StoppingComm(void* arg, int e, void* data) {
     }
     assert(0);      // shouldn't get here
 }
-// State table : note can be in any order as the 'id' field is what maps the state id to the rest
-static const SM_STATE_t _mySM[MS_LAST] = {
+// State table : in id order (entry i has .id=i), checked by sm_init()
+static const SM_STATE_t _mySM[] = {
     {.id=MS_IDLE,           .name="Idle",       .fn=State_Idle},
-    {.id=MS_STARTING_COMM,    .name="StartingComm", .fn=State_StartingComm},    
-    {.id=MS_GETTING_FIX,    .name="GettingFix", .fn=State_GettingFix},    
+    {.id=MS_STARTING_COMM,    .name="StartingComm", .fn=State_StartingComm, .parent=SM_PARENT(MS_RUNNING)},    
+    {.id=MS_GETTING_FIX,    .name="GettingFix", .fn=State_GettingFix, .parent=SM_PARENT(MS_RUNNING)},    
     {.id=MS_STOPPING_COMM,    .name="StoppingComm", .fn=State_StoppingComm},    
+    {.id=MS_RUNNING,    .name="Running", .fn=State_Running},    
 };
+SM_CHECK_TABLE(_mySM, MS_LAST);
 
 // Called from appinit or app core module
 void gps_mgr_init(const char* dname, uint32_t baudrate, int8_t pwrPin, int8_t uartSelect) {
@@ -358,7 +378,7 @@ void gps_mgr_init(const char* dname, uint32_t baudrate, int8_t pwrPin, int8_t ua
     // create event with arg pointing to our line buffer
     // TODO how to tell driver limit of size of buffer???
     _ctx.myGPSEvent.ev_cb = gps_mgr_rxcb;
-    _ctx.myGPSEvent.ev_arg = _ctx.rxbuf;
+    _ctx.myGPSEvent.ev_arg = NULL;     // lines by reference from the socket
     // TODO Do we really need a whole task/eventQ just to rx the uart strings? as it only ever sends sm events as a result? (so callbacks run on the SM task...)
     // Nah, just use default task/default eventq
     // Create task 
@@ -369,6 +389,8 @@ void gps_mgr_init(const char* dname, uint32_t baudrate, int8_t pwrPin, int8_t ua
 //    os_eventq_init(&_ctx.gpsMgrEQ);
     // Start state machine
     _ctx.mySMId = sm_init("modgps", _mySM, MS_LAST, MS_IDLE, &_ctx);
+    // the fix is in the ctx, so only the latest one matters
+    sm_coalesceEvent(_ctx.mySMId, ME_GPS_FIX);
     sm_start(_ctx.mySMId);
 
 }
@@ -437,11 +459,26 @@ static void gps_mgr_task(void* arg) {
     }
 }
 */
+// tx drained (or timed out) and uart closed
+static void gps_uart_closed(int8_t res) {
+    if (res!=SKT_NOERR) {
+        log_debug("GPS: uart tx drain timeout");
+    }
+    sm_sendEvent(_ctx.mySMId, ME_GPS_UART_CLOSED, NULL);
+}
+
 // callback every time the socket gives us a new line of data from the GPS
 static void gps_mgr_rxcb(struct os_event* ev) {
-    // ev->arg is our line buffer
-    const char* line = (char*)(ev->ev_arg);
-    assert(line!=NULL);
+    // get each shared line buffer queued on our socket (none if closed since)
+    const char* line;
+    while((line = wskt_rxTake(ev))!=NULL) {
+        gps_processLine(line);
+        // and give it back
+        wskt_lineRelease(line);
+    }
+}
+
+static void gps_processLine(const char* line) {
     if (strnlen(line, 10)<10) {
         // too short line ignore
 #ifdef DEBUG_GPS
@@ -45,6 +45,10 @@ static struct {
     int8_t z;
     bool active;                        // is the accelero hw activated?
     ACC_DetectionMode_t detectionMode;
+    uint8_t freefallThreshold;
+    uint8_t freefallDuration;
+    uint8_t shockThreshold;
+    uint8_t shockDuration;
     uint32_t lastMoveTimeS;
     uint32_t lastFallTimeS;
     uint32_t lastShockTimeS;
@@ -54,6 +58,15 @@ static struct {
     LP_ID_t lpUserId;
 } _ctx;
 
+// Accelero config, loaded from EEPROM into _ctx
+static const CFG_SCHEMA_t _cfgSchema[] = {
+    CFG_SCHEMA_BLOB(CFG_UTIL_KEY_ACCELERO_DETECTION_MODE, _ctx.detectionMode, NULL),
+    CFG_SCHEMA_INT(CFG_UTIL_KEY_ACCELERO_FREEFALL_THRESHOLD, UINT8, _ctx.freefallThreshold, 0, 255, 25),
+    CFG_SCHEMA_INT(CFG_UTIL_KEY_ACCELERO_FREEFALL_DURATION, UINT8, _ctx.freefallDuration, 0, 255, 2),
+    CFG_SCHEMA_INT(CFG_UTIL_KEY_ACCELERO_SHOCK_THRESHOLD, UINT8, _ctx.shockThreshold, 0, 255, 100),
+    CFG_SCHEMA_INT(CFG_UTIL_KEY_ACCELERO_SHOCK_DURATION, UINT8, _ctx.shockDuration, 0, 255, 6),
+};
+
 void movement_init(void) 
 {
     //Accelero config
@@ -62,24 +75,20 @@ void movement_init(void)
     // clear context
     memset(&_ctx, 0, sizeof(_ctx));
     _ctx.orientation = UNKNOWN;
-    //Retrieve config for accelero from EEPROM
-    CFMgr_getOrAddElement(CFG_UTIL_KEY_ACCELERO_DETECTION_MODE, &_ctx.detectionMode, sizeof(ACC_DetectionMode_t));
+    //Retrieve config for accelero from EEPROM (detection mode default is off as _ctx cleared)
+    CFMgr_registerSchema(_cfgSchema, CFG_SCHEMA_SZ(_cfgSchema));
     switch(_ctx.detectionMode)
     {
         case ACC_FreeFallDetection:
         {
-            threshold = 25;
-            duration  = 2;
-            CFMgr_getOrAddElement(CFG_UTIL_KEY_ACCELERO_FREEFALL_THRESHOLD, &threshold, sizeof(uint8_t));
-            CFMgr_getOrAddElement(CFG_UTIL_KEY_ACCELERO_FREEFALL_DURATION, &duration, sizeof(uint8_t));
+            threshold = _ctx.freefallThreshold;
+            duration  = _ctx.freefallDuration;
             break;
         }
         case ACC_ShockDetection:
         {
-            threshold = 100;
-            duration  = 6;
-            CFMgr_getOrAddElement(CFG_UTIL_KEY_ACCELERO_SHOCK_THRESHOLD, &threshold, sizeof(uint8_t));
-            CFMgr_getOrAddElement(CFG_UTIL_KEY_ACCELERO_SHOCK_DURATION, &duration, sizeof(uint8_t));
+            threshold = _ctx.shockThreshold;
+            duration  = _ctx.shockDuration;
             break;
         }
         case ACC_DetectionOff:
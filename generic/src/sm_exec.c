@@ -13,91 +13,363 @@
 /**
  * Core mechanism for building and executing state machines
  * Multiple state machines can be defined, each with an id
- * Their execution is run on a single task, hence they will be effectivement single threaded and non-re-entrant
+ * Each SM is run on a single task (the task of its 'lane'), hence they will be effectivement single threaded and
+ * non-re-entrant. By default there is 1 lane : with SM_LANES>1, SMs created on different lanes run on different tasks
+ * (with their own priority, stack and event list), so a slow SM on one lane does not delay the SMs on the others.
+ * Events can be sent from any task, callout or interrupt handler : each lane's pending events ring is multi-producer,
+ * single consumer (the lane task), each side only holding a critical section for the few instructions to add or
+ * remove an entry.
+ * All SM timers (SM_TIMEOUT and per-event ones) come from a single pool shared by all SMs and are kept in a hierarchical
+ * timer wheel run by one os_callout : starting or stopping a timer is O(1) (plus a walk of the few timers of its SM),
+ * and the callout is only ever set for the earliest deadline, so the MCU can stay in tickless sleep until then.
+ * States can be nested (see SM_STATE_t.parent) : events not handled by a state are passed up to its parent, and
+ * transitions exit/enter only the states below the parent common to both ends.
+ * With SM_SIM, the SMs can instead be run on a virtual clock by sm_simRun() (see sm_exec.h), for tests.
  */
 
+#include <stdlib.h>
+
 #include "os/os.h"
 #include "wyres-generic/wutils.h"
 #include "wyres-generic/sm_exec.h"
 
 #define SM_TASK_PRIO       MYNEWT_VAL(SM_TASK_PRIO)
-#define SM_TASK_STACK_SZ   OS_STACK_ALIGN(512)
+#define SM_TASK_STACK_SZ   OS_STACK_ALIGN(MYNEWT_VAL(SM_TASK_STACK_SZ))
+#define SM_LANES           MYNEWT_VAL(SM_LANES)
+#if (SM_LANES<1 || SM_LANES>3)
+#error "SM_LANES must be 1, 2 or 3"
+#endif
 #define SM_MAX_EVENTS      MYNEWT_VAL(SM_MAX_EVENTS)
 #define SM_MAX_SMS         MYNEWT_VAL(SM_MAX_SMS)
-// how many per-event timers can you have?
-#define MAX_PER_EVT_TIMERS MYNEWT_VAL(SM_MAX_EVENT_TIMERS)
+#define SM_MAX_COALESCE    MYNEWT_VAL(SM_MAX_COALESCE)
+#define COAL_NONE          (0xFF)
+// how many timers can be running (or popped but not yet executed) across all SMs
+#define SM_TIMER_POOL_SZ   MYNEWT_VAL(SM_TIMER_POOL_SZ)
+#if (SM_TIMER_POOL_SZ<1 || SM_TIMER_POOL_SZ>0xFFFE)
+#error "SM_TIMER_POOL_SZ must be 1 to 65534"
+#endif
+
+// Timer wheel : TW_LEVELS levels of TW_SLOTS slots, level L slots being TW_SLOTS^L ticks wide. A timer goes in the lowest
+// level whose span covers its delay, and moves down a level each time the wheel reaches its slot (cascade). Delays
+// beyond the whole wheel (2^20 ticks) are parked in the top level and re-inserted when their slot is cascaded.
+#define TW_BITS     (5)
+#define TW_SLOTS    (1<<TW_BITS)
+#define TW_MASK     (TW_SLOTS-1)
+#define TW_LEVELS   (4)
+#define TW_SPAN(l)  ((os_time_t)1<<(TW_BITS*(l)))
+#define TW_NONE     (0xFFFF)
+
+// Timer events carry the generation of their timer when it popped : if the timer has been stopped or restarted since,
+// the event is stale and is dropped when taken off the list (so stopping a timer never has to search the list)
+#define EVT_TIMER_NONE (TW_NONE)    // not from a timer, else index of the timer in the pool
+
+// Event payloads : small ones are copied into the event itself, bigger ones into a block from the payload pool
+#define SM_EVENT_PAYLOAD_SZ     MYNEWT_VAL(SM_EVENT_PAYLOAD_SZ)
+#if (SM_EVENT_PAYLOAD_SZ<4 || SM_EVENT_PAYLOAD_SZ>16)
+#error "SM_EVENT_PAYLOAD_SZ must be 4 to 16"
+#endif
+#define SM_PAYLOAD_POOL_NB      MYNEWT_VAL(SM_PAYLOAD_POOL_NB)
+#define SM_PAYLOAD_BLOCK_SZ     MYNEWT_VAL(SM_PAYLOAD_BLOCK_SZ)
+#if (SM_PAYLOAD_POOL_NB>255)
+#error "SM_PAYLOAD_POOL_NB must be <= 255"
+#endif
+#define PL_NONE     (0)     // data is the caller's pointer
+#define PL_INLINE   (1)     // data is in the event's payload
+#define PL_POOL     (2)     // data is a pool block, released once the event is run
+
+#define SM_TRACE           MYNEWT_VAL(SM_TRACE)
+#define SM_SIM             MYNEWT_VAL(SM_SIM)
 
 // this is the list of events waiting to be executed for all state machines
 typedef struct sm_event {
     SM_ID_t sm_id;
     int e;
     void* data;
+    uint16_t timer;
+    uint8_t gen;
+    uint8_t pl;
+    uint8_t coal;       // index in its SM's coalesced events, or COAL_NONE
+    uint32_t payload[(SM_EVENT_PAYLOAD_SZ+3)/4];      // (words so its aligned for the receiver)
+#if SM_TRACE
+    os_time_t at;       // when sent
+#endif
 } SM_EVENT_t;
+// A task running SMs, with its list of events waiting to be executed
+typedef struct {
+    SM_EVENT_t list[SM_MAX_EVENTS];
+    uint8_t head;
+    uint8_t tail;
+    struct os_event schedule;
+    struct os_eventq eq;
+    struct os_task task;
+} SM_LANE_t;
 typedef struct {
     const SM_STATE_t* sm_table;
     uint8_t sz;
     void* ctxarg;
     const SM_STATE_t* currentState;
-    struct os_callout timer;
-    struct sm_evttimers {
+    uint16_t timers;            // list (in the pool) of this SM's timers, SM_TIMEOUT one included
+    uint32_t drops;             // events for this SM refused as the ring was full
+    uint32_t timerFails;        // timer starts for this SM refused as the timer pool was empty
+    struct {
         int e;
-        struct os_callout t;
-        SM_ID_t s;                // must hold our own SM pointer to be able to recover it in the timer cb
-    } evttimers[MAX_PER_EVT_TIMERS];
+        uint8_t idx;            // where the pending one is in the lane list, or COAL_NONE
+    } coal[SM_MAX_COALESCE];    // events with at most one pending at a time (sm_coalesceEvent())
+    uint8_t nbCoal;
+    SM_LANE_t* lane;
+#if SM_TRACE
+    const char* name;
+    os_time_t enteredAt;        // when the current state was entered
+    uint16_t trStates;          // index of its first state's stats in the trace, or TR_NONE
+#endif
 } SM_t;
 
 static os_stack_t _sm_task_stack[SM_TASK_STACK_SZ];
-static struct os_task sm_mgr_task_str;
+#if SM_LANES>1
+static os_stack_t _sm_lane1_stack[OS_STACK_ALIGN(MYNEWT_VAL(SM_LANE1_STACK_SZ))];
+#endif
+#if SM_LANES>2
+static os_stack_t _sm_lane2_stack[OS_STACK_ALIGN(MYNEWT_VAL(SM_LANE2_STACK_SZ))];
+#endif
+static const struct {
+    const char* name;
+    uint8_t prio;
+    os_stack_t* stack;
+    uint16_t stackSz;
+} _laneDefs[SM_LANES] = {
+    { "SM_task", SM_TASK_PRIO, _sm_task_stack, SM_TASK_STACK_SZ },
+#if SM_LANES>1
+    { "SM_task1", MYNEWT_VAL(SM_LANE1_TASK_PRIO), _sm_lane1_stack, OS_STACK_ALIGN(MYNEWT_VAL(SM_LANE1_STACK_SZ)) },
+#endif
+#if SM_LANES>2
+    { "SM_task2", MYNEWT_VAL(SM_LANE2_TASK_PRIO), _sm_lane2_stack, OS_STACK_ALIGN(MYNEWT_VAL(SM_LANE2_STACK_SZ)) },
+#endif
+};
+static SM_LANE_t _lanes[SM_LANES];
+
+// A pooled timer : owned by an SM (on its list) from start until stopped or its event is run
+typedef enum { TW_FREE, TW_RUNNING, TW_POPPED } TW_STATE_t;
+typedef struct {
+    uint16_t next;          // in its wheel slot, or in the free list
+    uint16_t prev;
+    uint16_t smNext;        // in its SM's list
+    uint8_t state;
+    uint8_t slot;           // level<<TW_BITS | slot in the wheel when running
+    uint8_t gen;            // changed each time it is freed, so events it sent before are recognised as stale
+    int e;
+    SM_t* sm;
+    os_time_t expiry;
+} SM_TIMER_t;
+static struct {
+    SM_TIMER_t pool[SM_TIMER_POOL_SZ];
+    uint16_t free;
+    uint16_t slots[TW_LEVELS][TW_SLOTS];
+    uint32_t occupied[TW_LEVELS];       // bitmap of non-empty slots, to find the next deadline without walking the slots
+    os_time_t now;                      // time the wheel has been run up to
+    struct os_callout callout;
+    bool armed;
+    os_time_t armedAt;
+} _tw;
 
 static SM_t _smTable[SM_MAX_SMS];
+
+#if SM_SIM
+// virtual time : when on, the SMs are only run by sm_simRun()
+static struct {
+    bool on;
+    os_time_t now;
+    uint32_t nbEvents;
+} _sim;
+#endif
+
+#if SM_TRACE
+#define TR_BUCKETS      (8)
+#define TR_NONE         (0xFFFF)
+#define TR_F_STALE      (0x01)
+#define TR_REC_SZ       (12)
+typedef struct {
+    os_time_t at;           // when the state function was called
+    uint8_t sm;             // index in _smTable
+    int8_t from;
+    int8_t to;              // SM_STATE_CURRENT if no change
+    uint8_t flags;
+    uint16_t e;
+    uint16_t exec;          // ticks in the state function(s), saturated
+} SM_TRACE_REC_t;
+typedef struct {
+    uint32_t total;
+    uint16_t n[TR_BUCKETS];
+} SM_TRACE_STATE_t;
+typedef struct {
+    SM_t* sm;
+    int e;
+    uint32_t max;
+    uint16_t n[TR_BUCKETS];
+} SM_TRACE_EVT_t;
+static struct {
+    bool on;
+    uint16_t next;
+    uint16_t nb;
+    SM_TRACE_REC_t ring[MYNEWT_VAL(SM_TRACE_SZ)];
+    uint16_t nbStates;
+    SM_TRACE_STATE_t states[MYNEWT_VAL(SM_TRACE_STATES)];
+    uint8_t nbEvts;
+    SM_TRACE_EVT_t evts[MYNEWT_VAL(SM_TRACE_EVENTS)];
+} _tr;
+static void traceEvent(SM_t* sm, SM_EVENT_t* evt, SM_STATE_ID_t from, SM_STATE_ID_t to, os_time_t start, bool run);
+#endif
 static uint8_t _smIdx = 0;
 
-static SM_EVENT_t _sm_event_list[SM_MAX_EVENTS];
-static uint8_t _sm_event_list_head=0;
-static uint8_t _sm_event_list_tail=0;
+#if SM_PAYLOAD_POOL_NB>0
+static uint32_t _plPool[SM_PAYLOAD_POOL_NB][(SM_PAYLOAD_BLOCK_SZ+3)/4];
+static uint8_t _plFree[SM_PAYLOAD_POOL_NB];     // stack of free block indexes
+static uint8_t _plNbFree;
+#endif
 
-static struct os_event _sm_schedule_event;
-static struct os_eventq _sm_EQ;
+static uint32_t _sm_drops = 0;          // total refused events
+static uint32_t _sm_dropsLogged = 0;    // (logged from the SM task, as producers may be in an ISR)
+static uint32_t _sm_timerFails = 0;     // total refused timer starts
 
 // predeclare privates
 static void sm_mgr_task(void* arg);
-static void sm_timer_cb(struct os_event* ev);
-static void sm_timerE_cb(struct os_event* ev);
+static void tw_cb(struct os_event* ev);
 static void sm_nextevent_cb(struct os_event* ev);
+static void laneSchedule(SM_LANE_t* lane);
+static bool sm_post(SM_t* sm, int e, void* data, uint16_t timer, uint8_t gen, uint8_t pl, uint8_t len);
+static void* payloadAlloc(void);
+static void payloadFree(void* b);
+static bool timerEventValid(SM_t* sm, SM_EVENT_t* evt);
+static void timerStop(SM_t* sm, int e);
+static void timerFree(SM_t* sm, uint16_t ti);
+static void twInsert(uint16_t ti);
+static void twRemove(uint16_t ti);
+static void twAdvance(os_time_t to);
+static bool twNext(os_time_t* next);
+static void twSchedule(void);
+static os_time_t smTime(void);
 
 static uint8_t circListNext(uint8_t* idx, uint8_t sz);
 static bool circListFull(uint8_t head, uint8_t tail, uint8_t sz);
 static bool circListEmpty(uint8_t head, uint8_t tail, uint8_t sz);
-static const SM_STATE_t* findStateFromId(SM_STATE_ID_t id, const SM_STATE_t* table, uint8_t sz);
+static const SM_STATE_t* findStateFromId(SM_t* sm, SM_STATE_ID_t id);
+static const SM_STATE_t* parentOf(SM_t* sm, const SM_STATE_t* s);
+static SM_STATE_ID_t dispatch(SM_t* sm, int e, void* data);
+static void enterParents(SM_t* sm, const SM_STATE_t* s, const SM_STATE_t* top);
+static void changeState(SM_t* sm, const SM_STATE_t* next);
+static void smReset(void);
 
 // Called from sysinit via reference in pkg.yml
 void init_sm_exec(void) {
+    for(int i=0;i<SM_LANES;i++) {
+        os_eventq_init(&_lanes[i].eq);
+    }
+    smReset();
+#ifdef UNITTEST
+    // No other SM exists yet, and everything it used is put back after
+    unittest_sm();
+    smReset();
+#endif
+    // Create the lane tasks
+    for(int i=0;i<SM_LANES;i++) {
+        SM_LANE_t* lane = &_lanes[i];
+        os_task_init(&lane->task, _laneDefs[i].name, sm_mgr_task, lane, _laneDefs[i].prio,
+               OS_WAIT_FOREVER, _laneDefs[i].stack, _laneDefs[i].stackSz);
+    }
+}
+// No SMs, empty event lists, all timers and payloads free, on real time
+static void smReset(void) {
     _smIdx = 0;
-    // setup event lists, task
-    // Event list has no entries
-    _sm_event_list_head = _sm_event_list_tail = 0;
-    _sm_schedule_event.ev_cb = sm_nextevent_cb;
-    _sm_schedule_event.ev_arg = _sm_event_list;
-    os_eventq_init(&_sm_EQ);
-    // Create task 
-    os_task_init(&sm_mgr_task_str, "SM_task", sm_mgr_task, NULL, SM_TASK_PRIO,
-               OS_WAIT_FOREVER, _sm_task_stack, SM_TASK_STACK_SZ);
-
+    memset(_smTable, 0, sizeof(_smTable));
+    for(int i=0;i<SM_LANES;i++) {
+        SM_LANE_t* lane = &_lanes[i];
+        // Event list has no entries
+        lane->head = lane->tail = 0;
+        lane->schedule.ev_cb = sm_nextevent_cb;
+        lane->schedule.ev_arg = lane;
+    }
+#if SM_SIM
+    // back on os time first, so the wheel restarts from it
+    memset(&_sim, 0, sizeof(_sim));
+#endif
+    // timer pool all free, wheel empty. Its callout is run from the default event queue (so a slow SM on lane 0 does not
+    // delay the timers of the other lanes), the timer events go to each SM's lane
+    memset(&_tw, 0, sizeof(_tw));
+    for(int i=0;i<SM_TIMER_POOL_SZ;i++) {
+        _tw.pool[i].next = (i+1<SM_TIMER_POOL_SZ) ? (i+1) : TW_NONE;
+    }
+    _tw.free = 0;
+    memset(_tw.slots, 0xFF, sizeof(_tw.slots));
+    _tw.now = smTime();
+    os_callout_init(&_tw.callout, os_eventq_dflt_get(), tw_cb, NULL);
+#if SM_TRACE
+    memset(&_tr, 0, sizeof(_tr));
+    _tr.on = true;
+#endif
+#if SM_PAYLOAD_POOL_NB>0
+    for(int i=0;i<SM_PAYLOAD_POOL_NB;i++) {
+        _plFree[i] = i;
+    }
+    _plNbFree = SM_PAYLOAD_POOL_NB;
+#endif
 }
 
 // PUBLIC : Create an SM and return its reference
 SM_ID_t sm_init(const char* name, const SM_STATE_t* states, uint8_t sz, SM_STATE_ID_t initialState, void* ctxarg) {
-    // Sanity check the table
-    assert(sz>0 && sz<255);
+    return sm_initLane(name, states, sz, initialState, ctxarg, 0);
+}
+
+// PUBLIC : Create an SM run by the task of the given lane
+SM_ID_t sm_initLane(const char* name, const SM_STATE_t* states, uint8_t sz, SM_STATE_ID_t initialState, void* ctxarg, uint8_t lane) {
+    // Sanity check the table (ids are int8_t so 128 states max)
+    assert(sz>0 && sz<=128);
+    if (lane>=SM_LANES) {
+        log_debug("SM:%s lane %d not configured, using 0", name, lane);
+        lane = 0;
+    }
     // alloc a space
     SM_t* sm = &_smTable[_smIdx++];
     assert(_smIdx<SM_MAX_SMS);
     sm->sm_table = states;
     sm->sz = sz;
     sm->ctxarg = ctxarg;
+    sm->lane = &_lanes[lane];
+    sm->timers = TW_NONE;
+    sm->nbCoal = 0;
+#if SM_TRACE
+    sm->name = name;
+    sm->enteredAt = smTime();
+    // dwell stats for its states if there's room
+    sm->trStates = TR_NONE;
+    if (_tr.nbStates+sz<=MYNEWT_VAL(SM_TRACE_STATES)) {
+        sm->trStates = _tr.nbStates;
+        _tr.nbStates += sz;
+    } else {
+        log_warn("SM:%s no room for trace stats", name);
+    }
+#endif
+    // Validate the table : in id order (entry i has id i, so no gaps or duplicates), so states are found by direct index
+    for(int i=0;i<sz;i++) {
+        if (states[i].id!=i || states[i].fn==NULL) {
+            log_error("SM:%s bad state table entry %d (id %d)", name, i, states[i].id);
+            assert(0);
+        }
+    }
+    // parents must be states of this table, without loops (so at most sz-1 levels above any state)
+    for(int i=0;i<sz;i++) {
+        const SM_STATE_t* p = &states[i];
+        int depth = 0;
+        while(p!=NULL && p->parent!=0 && depth<sz) {
+            p = findStateFromId(sm, p->parent-1);
+            depth++;
+        }
+        if (p==NULL || depth>=sz) {
+            log_error("SM:%s bad parent for state %d", name, states[i].id);
+            assert(0);
+        }
+    }
     // Set current state to initial one
-    sm->currentState = findStateFromId(initialState, sm->sm_table, sm->sz);
-    os_callout_init(&(sm->timer), &_sm_EQ, sm_timer_cb, sm);
+    sm->currentState = findStateFromId(sm, initialState);
+    assert(sm->currentState!=NULL);
     return sm;
 }
 
@@ -106,164 +378,839 @@ bool sm_start(SM_ID_t id) {
     return sm_sendEvent(id, SM_ENTER, NULL);    
 }
 
-// PUBLIC : send an event to a state machine (called from ext or int)
+// PUBLIC : send an event to a state machine (called from ext or int, including interrupt handlers)
 bool sm_sendEvent(SM_ID_t id, int e, void* data) {
-    // TODO mutex protect list accesses
-    if (circListFull(_sm_event_list_head, _sm_event_list_tail, SM_MAX_EVENTS)) {
-        log_warn("!!!aie!!!");
+    return sm_post((SM_t*)id, e, data, EVT_TIMER_NONE, 0, PL_NONE, 0);
+}
+// PUBLIC : send an event with a copy of the payload
+bool sm_sendEventData(SM_ID_t id, int e, const void* payload, uint8_t len) {
+    if (len<=SM_EVENT_PAYLOAD_SZ) {
+        // copied straight into the event
+        return sm_post((SM_t*)id, e, (void*)payload, EVT_TIMER_NONE, 0, PL_INLINE, len);
+    }
+    void* b = NULL;
+    if (len<=SM_PAYLOAD_BLOCK_SZ) {
+        b = payloadAlloc();
+    }
+    if (b==NULL) {
+        // too big or no blocks left : refused like when the list is full (no logging as may be in an ISR)
+        os_sr_t sr;
+        OS_ENTER_CRITICAL(sr);
+        ((SM_t*)id)->drops++;
+        _sm_drops++;
+        OS_EXIT_CRITICAL(sr);
+        return false;
+    }
+    memcpy(b, payload, len);
+    if (!sm_post((SM_t*)id, e, b, EVT_TIMER_NONE, 0, PL_POOL, 0)) {
+        payloadFree(b);
         return false;
     }
-    uint8_t idx = circListNext(&_sm_event_list_tail, SM_MAX_EVENTS);
-    _sm_event_list[idx].sm_id = id;
-    _sm_event_list[idx].e = e;
-    _sm_event_list[idx].data = data;
-    // Schedule event handler if not already waiting to run (does all SM events on list)
-    os_eventq_put(&_sm_EQ, &_sm_schedule_event);
     return true;
 }
-void sm_timer_start(SM_ID_t id, uint32_t tms) {
-    SM_t* sm = (SM_t*)id;
-    os_time_t ticks;
-    os_time_ms_to_ticks(tms, &ticks);
-    // Not required to explicitly stop timer if it was running, reset stops it
-    os_callout_reset(&(sm->timer), ticks);
+// The SM_TIMEOUT timer is just the per-event timer for SM_TIMEOUT
+bool sm_timer_start(SM_ID_t id, uint32_t tms) {
+    return sm_timer_startE(id, tms, SM_TIMEOUT);
 }
 void sm_timer_stop(SM_ID_t id) {
-    SM_t* sm = (SM_t*)id;
-    os_callout_stop(&(sm->timer));
-    uint8_t head = _sm_event_list_head;
-    // REMOVE ANY TIMEOUT EVENTS FOR THIS SM FROM EVENT Q (in case it popped but is now cancelled)
-    // TODO mutex protect list accesses
-    while (!circListEmpty(head, _sm_event_list_tail, SM_MAX_EVENTS)) {
-        // get events 
-        SM_EVENT_t* evt = &_sm_event_list[circListNext(&head, SM_MAX_EVENTS)];
-        // If its a timeout event for this SM, invalidate it
-        if (evt->sm_id==id && evt->e==SM_TIMEOUT) {
-            evt->sm_id = NULL;      // so it gets ignored by sm_nextevent_sb processing
-        }
-    }
+    sm_timer_stopE(id, SM_TIMEOUT);
 }
 // Start timer for tms ms from now that will send event e to SM id when it pops. If there is already a timer for event e, the
 // timeout is reset to tms ms from now. If the current state of the SM changes, these timers ARE NOT STOPPED.
-void sm_timer_startE(SM_ID_t id, uint32_t tms, int e) {
-    // need a list of individual timers per event value...
-    // try to stop it first to get any associated events off list
-    sm_timer_stopE(id, e);
-    // Now start it
+// Returns false if the timer pool is empty (the timer for e is then stopped, not left at its old timeout).
+bool sm_timer_startE(SM_ID_t id, uint32_t tms, int e) {
     SM_t* sm = (SM_t*)id;
-    // Find an empty timer for this event (shouldn't exist already as the stop removes it...)
-    for(int i=0;i<MAX_PER_EVT_TIMERS;i++) {
-        if (sm->evttimers[i].s==NULL)  {
-            sm->evttimers[i].e = e;
-            sm->evttimers[i].s = id;
-            os_time_t ticks;
-            os_time_ms_to_ticks(tms, &ticks);
-            os_callout_init(&(sm->evttimers[i].t), &_sm_EQ, sm_timerE_cb, &(sm->evttimers[i]));
-            os_callout_reset(&(sm->evttimers[i].t), ticks);      
-            return;
-        }
+    os_time_t ticks;
+    os_time_ms_to_ticks(tms, &ticks);
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    // stop it first so any event it already queued is dropped
+    timerStop(sm, e);
+    uint16_t ti = _tw.free;
+    if (ti==TW_NONE) {
+        sm->timerFails++;
+        _sm_timerFails++;
+        OS_EXIT_CRITICAL(sr);
+        // oops, pool too small for all the running timers : the caller decides what to do
+        log_error("SM: timer pool empty for sm %x, event %d not timed", sm->sm_table, e);
+        return false;
     }
-    // oops too many running per-event timers...
-    log_error("SM: per-event timers overflow for sm %x", sm->sm_table);
-    assert(0);
-    return;
+    SM_TIMER_t* t = &_tw.pool[ti];
+    _tw.free = t->next;
+    t->sm = sm;
+    t->e = e;
+    t->state = TW_RUNNING;
+    t->smNext = sm->timers;
+    sm->timers = ti;
+    // bring the wheel up to now so the delay is relative to it (this may pop timers that are due)
+    twAdvance(smTime());
+    t->expiry = _tw.now + (ticks>0 ? ticks : 1);
+    twInsert(ti);
+    OS_EXIT_CRITICAL(sr);
+    twSchedule();
+    return true;
 }
 // Stop the timer that is sending event e
 void sm_timer_stopE(SM_ID_t id, int e) {
-    SM_t* sm = (SM_t*)id;
-    // find the appropriate timer associated with this event and cancel it
-    for(int i=0;i<MAX_PER_EVT_TIMERS;i++) {
-        if (sm->evttimers[i].s!=NULL && sm->evttimers[i].e==e) {
-            // gotcha
-            os_callout_stop(&(sm->evttimers[i].t));
-            sm->evttimers[i].s = NULL;      // its gone
-            sm->evttimers[i].e = -1;      // its gone
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    timerStop((SM_t*)id, e);
+    OS_EXIT_CRITICAL(sr);
+    // The wheel callout is left as is : if this was the earliest timer, it will just find nothing to do
+}
+
+// Get the lane's task to run its list (unless on virtual time, where sm_simRun() does it)
+static void laneSchedule(SM_LANE_t* lane) {
+#if SM_SIM
+    if (_sim.on) {
+        return;
+    }
+#endif
+    os_eventq_put(&lane->eq, &lane->schedule);
+}
+// Add an event to the SM's lane list. For PL_INLINE, len bytes at data are copied into the event
+static bool sm_post(SM_t* sm, int e, void* data, uint16_t timer, uint8_t gen, uint8_t pl, uint8_t len) {
+    SM_LANE_t* lane = sm->lane;
+    // coalesced event? (not for timer events, as they are tied to their timer)
+    uint8_t c = COAL_NONE;
+    if (timer==EVT_TIMER_NONE) {
+        for(int i=0;i<sm->nbCoal;i++) {
+            if (sm->coal[i].e==e) {
+                c = i;
+                break;
+            }
         }
     }
-    // Not an issue if we don't find it...
-    // find any event in the pending events list with this event and remove it (timer has already popped but not executed)
-    // TODO mutex protect list accesses
-    uint8_t head = _sm_event_list_head;
-    while (!circListEmpty(head, _sm_event_list_tail, SM_MAX_EVENTS)) {
-        // get events 
-        SM_EVENT_t* evt = &_sm_event_list[circListNext(&head, SM_MAX_EVENTS)];
-        // If its a timeout event for this SM, invalidate it
-        if (evt->sm_id==id && evt->e==e) {
-            evt->sm_id = NULL;      // so it gets ignored by sm_nextevent_sb processing
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    if (c!=COAL_NONE && sm->coal[c].idx!=COAL_NONE) {
+        // already one pending : the new one replaces it, in its place in the list
+        SM_EVENT_t* old = &lane->list[sm->coal[c].idx];
+        void* oldBlock = (old->pl==PL_POOL) ? old->data : NULL;
+        old->data = data;
+        old->pl = pl;
+        if (pl==PL_INLINE) {
+            memcpy(old->payload, data, len);
+        }
+        OS_EXIT_CRITICAL(sr);
+        if (oldBlock!=NULL) {
+            payloadFree(oldBlock);
         }
+        return true;
+    }
+    if (circListFull(lane->head, lane->tail, SM_MAX_EVENTS)) {
+        // No logging here as may be in an ISR : the SM task logs the count
+        sm->drops++;
+        _sm_drops++;
+        OS_EXIT_CRITICAL(sr);
+        // make sure it runs to tell of it
+        laneSchedule(lane);
+        return false;
+    }
+    uint8_t idx = circListNext(&lane->tail, SM_MAX_EVENTS);
+    lane->list[idx].sm_id = sm;
+    lane->list[idx].e = e;
+    lane->list[idx].data = data;
+    lane->list[idx].timer = timer;
+    lane->list[idx].gen = gen;
+    lane->list[idx].pl = pl;
+    if (pl==PL_INLINE) {
+        memcpy(lane->list[idx].payload, data, len);
+    }
+    lane->list[idx].coal = c;
+    if (c!=COAL_NONE) {
+        sm->coal[c].idx = idx;
+    }
+#if SM_TRACE
+    lane->list[idx].at = smTime();
+#endif
+    OS_EXIT_CRITICAL(sr);
+    // Schedule event handler if not already waiting to run (does all SM events on list)
+    laneSchedule(lane);
+    return true;
+}
+// PUBLIC : have at most one event e pending for this SM
+bool sm_coalesceEvent(SM_ID_t id, int e) {
+    SM_t* sm = (SM_t*)id;
+    if (sm->nbCoal>=SM_MAX_COALESCE) {
+        log_error("SM: too many coalesced events (SM_MAX_COALESCE)");
+        return false;
     }
+    sm->coal[sm->nbCoal].e = e;
+    sm->coal[sm->nbCoal].idx = COAL_NONE;
+    sm->nbCoal++;
+    return true;
 }
-
 // Get current state
 SM_STATE_ID_t sm_getCurrentState(SM_ID_t id) {
     SM_t* sm = (SM_t*)id;
     return sm->currentState->id;
 }
 
+// Get the number of events refused for this SM (or for all if id is NULL) as the event ring was full
+uint32_t sm_getDroppedEvents(SM_ID_t id) {
+    if (id==NULL) {
+        return _sm_drops;
+    }
+    return ((SM_t*)id)->drops;
+}
+// Get the number of timer starts refused for this SM (or for all if id is NULL) as the timer pool was empty
+uint32_t sm_getTimerFails(SM_ID_t id) {
+    if (id==NULL) {
+        return _sm_timerFails;
+    }
+    return ((SM_t*)id)->timerFails;
+}
+
 /** default log for unhandled event in a state to make debugging easier and centralised */
 void sm_default_event_log(SM_ID_t id, const char* log, int e) {
     log_debug("SM:%s:[%s] ignored %d", log, ((SM_t*)id)->currentState->name, e);
 }
 
-// Callouts
-static void sm_timer_cb(struct os_event* e) {
-    sm_sendEvent((SM_ID_t)(e->ev_arg), SM_TIMEOUT, NULL);
+// Wheel callout : pop all the timers due and program the next deadline
+static void tw_cb(struct os_event* e) {
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    _tw.armed = false;
+    twAdvance(smTime());
+    OS_EXIT_CRITICAL(sr);
+    twSchedule();
+}
+// Check a timer event is not stale (its timer stopped or restarted since it popped)
+static bool timerEventValid(SM_t* sm, SM_EVENT_t* evt) {
+    if (evt->timer==EVT_TIMER_NONE) {
+        return true;
+    }
+    bool ret = false;
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    SM_TIMER_t* t = &_tw.pool[evt->timer];
+    if (t->state==TW_POPPED && t->sm==sm && t->gen==evt->gen) {
+        // its run now : back to the pool
+        timerFree(sm, evt->timer);
+        ret = true;
+    }
+    OS_EXIT_CRITICAL(sr);
+    return ret;
+}
+
+// Timer wheel internals : all called with the critical section held (except twSchedule, which takes it)
+// Stop and free the timer of this SM for event e, if any
+static void timerStop(SM_t* sm, int e) {
+    for(uint16_t ti=sm->timers;ti!=TW_NONE;ti=_tw.pool[ti].smNext) {
+        if (_tw.pool[ti].e==e) {
+            if (_tw.pool[ti].state==TW_RUNNING) {
+                twRemove(ti);
+            }
+            // if popped, its event is dropped when it comes off the list as the generation has changed
+            timerFree(sm, ti);
+            return;
+        }
+    }
+    // Not an issue if we don't find it...
+}
+// Unlink timer from its SM and put it back in the pool
+static void timerFree(SM_t* sm, uint16_t ti) {
+    uint16_t* pi = &sm->timers;
+    while(*pi!=ti) {
+        assert(*pi!=TW_NONE);
+        pi = &_tw.pool[*pi].smNext;
+    }
+    *pi = _tw.pool[ti].smNext;
+    _tw.pool[ti].state = TW_FREE;
+    _tw.pool[ti].gen++;
+    _tw.pool[ti].sm = NULL;
+    _tw.pool[ti].next = _tw.free;
+    _tw.free = ti;
+}
+// Put running timer in the slot for its expiry
+static void twInsert(uint16_t ti) {
+    SM_TIMER_t* t = &_tw.pool[ti];
+    os_time_t delta = OS_TIME_TICK_GT(t->expiry, _tw.now) ? (t->expiry - _tw.now) : 0;
+    os_time_t at = t->expiry;
+    uint8_t l = 0;
+    while(l<TW_LEVELS-1 && delta>=TW_SPAN(l+1)) {
+        l++;
+    }
+    if (delta>=TW_SPAN(TW_LEVELS)) {
+        // beyond the wheel : park it at its far end
+        at = _tw.now + TW_SPAN(TW_LEVELS) - 1;
+    }
+    uint8_t s = (at >> (TW_BITS*l)) & TW_MASK;
+    t->prev = TW_NONE;
+    t->next = _tw.slots[l][s];
+    if (t->next!=TW_NONE) {
+        _tw.pool[t->next].prev = ti;
+    }
+    _tw.slots[l][s] = ti;
+    _tw.occupied[l] |= (1u<<s);
+    t->slot = (l<<TW_BITS) | s;
+}
+// Take running timer out of its slot
+static void twRemove(uint16_t ti) {
+    SM_TIMER_t* t = &_tw.pool[ti];
+    if (t->next!=TW_NONE) {
+        _tw.pool[t->next].prev = t->prev;
+    }
+    if (t->prev!=TW_NONE) {
+        _tw.pool[t->prev].next = t->next;
+    } else {
+        // its the head of its slot
+        uint8_t l = t->slot >> TW_BITS;
+        uint8_t s = t->slot & TW_MASK;
+        _tw.slots[l][s] = t->next;
+        if (t->next==TW_NONE) {
+            _tw.occupied[l] &= ~(1u<<s);
+        }
+    }
+}
+// Find first occupied slot after the current one at level l : returns its offset (1..TW_SLOTS) or 0 if none
+static uint8_t twNextSlot(uint8_t l) {
+    uint32_t occ = _tw.occupied[l];
+    if (occ==0) {
+        return 0;
+    }
+    uint8_t c = ((_tw.now >> (TW_BITS*l)) + 1) & TW_MASK;
+    // rotate so bit 0 is the slot after the current one
+    uint32_t rot = (c==0) ? occ : ((occ >> c) | (occ << (TW_SLOTS-c)));
+    return __builtin_ctz(rot)+1;
+}
+// Next time the wheel has something to do : the earliest deadline in level 0, or the earliest cascade of a higher level
+static bool twNext(os_time_t* next) {
+    bool found = false;
+    for(uint8_t l=0;l<TW_LEVELS;l++) {
+        uint8_t k = twNextSlot(l);
+        if (k==0) {
+            continue;
+        }
+        os_time_t at = ((_tw.now >> (TW_BITS*l)) + k) << (TW_BITS*l);
+        if (!found || OS_TIME_TICK_LT(at, *next)) {
+            *next = at;
+            found = true;
+        }
+    }
+    return found;
 }
-// for case with specific event
-static void sm_timerE_cb(struct os_event* e) {
-    // not the sm id, its the per-event structure
-    struct sm_evttimers* et = (struct sm_evttimers *)(e->ev_arg);
-    // send the event
-    sm_sendEvent(et->s, et->e, NULL);
-    // free the slot
-    et->s = NULL;
-    et->e = -1;
+// Move the timers of the current slot of level l down the wheel
+static void twCascade(uint8_t l) {
+    uint8_t s = (_tw.now >> (TW_BITS*l)) & TW_MASK;
+    uint16_t ti = _tw.slots[l][s];
+    _tw.slots[l][s] = TW_NONE;
+    _tw.occupied[l] &= ~(1u<<s);
+    while(ti!=TW_NONE) {
+        uint16_t next = _tw.pool[ti].next;
+        twInsert(ti);
+        ti = next;
+    }
+}
+// Run the wheel up to time 'to', popping the timers due on the way. Jumps straight from one deadline to the next.
+static void twAdvance(os_time_t to) {
+    os_time_t next;
+    while(twNext(&next) && !OS_TIME_TICK_GT(next, to)) {
+        _tw.now = next;
+        // cascade the higher levels whose slot boundary this is, top one first so its timers can cascade again
+        for(uint8_t l=TW_LEVELS-1;l>0;l--) {
+            if ((_tw.now & (TW_SPAN(l)-1))==0) {
+                twCascade(l);
+            }
+        }
+        // and pop everything in the level 0 slot for now
+        uint8_t s = _tw.now & TW_MASK;
+        uint16_t ti = _tw.slots[0][s];
+        _tw.slots[0][s] = TW_NONE;
+        _tw.occupied[0] &= ~(1u<<s);
+        while(ti!=TW_NONE) {
+            SM_TIMER_t* t = &_tw.pool[ti];
+            uint16_t tnext = t->next;
+            t->state = TW_POPPED;
+            // the timer stays with its SM until its event is run, so a stop/restart before then makes the event stale
+            if (!sm_post(t->sm, t->e, NULL, ti, t->gen, PL_NONE, 0)) {
+                // lost : free it
+                timerFree(t->sm, ti);
+            }
+            ti = tnext;
+        }
+    }
+    if (OS_TIME_TICK_GT(to, _tw.now)) {
+        _tw.now = to;
+    }
+}
+// Program the callout for the wheel's next deadline, if it is not already set for it or earlier
+static void twSchedule(void) {
+#if SM_SIM
+    if (_sim.on) {
+        return;     // sm_simRun() runs the wheel
+    }
+#endif
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    os_time_t next;
+    if (!twNext(&next) || (_tw.armed && !OS_TIME_TICK_LT(next, _tw.armedAt))) {
+        OS_EXIT_CRITICAL(sr);
+        return;
+    }
+    // reset the callout before leaving the critical section, else a later deadline programmed by a preempting caller
+    // could be overwritten by this one (or this one by it) while armedAt says otherwise
+    _tw.armed = true;
+    _tw.armedAt = next;
+    os_time_t now = os_time_get();
+    os_callout_reset(&_tw.callout, OS_TIME_TICK_GT(next, now) ? (next - now) : 0);
+    OS_EXIT_CRITICAL(sr);
 }
 
 static void sm_nextevent_cb(struct os_event* e) {
+    SM_LANE_t* lane = (SM_LANE_t*)(e->ev_arg);
+    if (_sm_drops!=_sm_dropsLogged) {
+        uint32_t drops = _sm_drops;
+        log_warn("SM: event list full, %d events dropped", drops-_sm_dropsLogged);
+        _sm_dropsLogged = drops;
+    }
     // pop events until empty
-    while(!circListEmpty(_sm_event_list_head, _sm_event_list_tail, SM_MAX_EVENTS)) {
+    while(true) {
+        // take a copy of the event off the list, so producers can reuse its slot while the SM runs
+        SM_EVENT_t ev;
+        SM_EVENT_t* evt = &ev;
+        os_sr_t sr;
+        OS_ENTER_CRITICAL(sr);
+        if (circListEmpty(lane->head, lane->tail, SM_MAX_EVENTS)) {
+            OS_EXIT_CRITICAL(sr);
+            break;
+        }
+        ev = lane->list[circListNext(&lane->head, SM_MAX_EVENTS)];
+        if (ev.coal!=COAL_NONE) {
+            // its no longer pending, the next one goes on the list
+            ((SM_t*)ev.sm_id)->coal[ev.coal].idx = COAL_NONE;
+        }
+        OS_EXIT_CRITICAL(sr);
         // call SM with event
-        SM_EVENT_t* evt = &_sm_event_list[circListNext(&_sm_event_list_head, SM_MAX_EVENTS)];
-        if (evt->sm_id!=NULL) {
-            SM_t* sm = (SM_t*)(evt->sm_id);
-            SM_STATE_ID_t nextState = (sm->currentState->fn)(sm->ctxarg, evt->e, evt->data);
+        SM_t* sm = (SM_t*)(evt->sm_id);
+#if SM_TRACE
+        os_time_t start = smTime();
+        SM_STATE_ID_t from = sm->currentState->id;
+#endif
+        SM_STATE_ID_t nextState = SM_STATE_CURRENT;
+        bool run = timerEventValid(sm, evt);
+#if SM_SIM
+        _sim.nbEvents++;
+#endif
+        if (evt->pl==PL_INLINE) {
+            // the state function gets our copy, valid for the call
+            evt->data = evt->payload;
+        }
+        if (run) {
+            if (evt->e==SM_ENTER) {
+                // sm_start() : enter the parents of the initial state first, then the state itself. As for any ENTER,
+                // its return is ignored (a default: returning SM_STATE_PARENT is not a state change)
+                enterParents(sm, sm->currentState, NULL);
+                (sm->currentState->fn)(sm->ctxarg, evt->e, evt->data);
+            } else {
+                nextState = dispatch(sm, evt->e, evt->data);
+            }
             // Check if change of state
             if (nextState!=SM_STATE_CURRENT) {
-                // ensure timer is stopped before entering next state, and remove any timeout events from q
+                // ensure timer is stopped before entering next state (any timeout events in the list are now stale)
                 sm_timer_stop(sm);
-                const SM_STATE_t* next = findStateFromId(nextState, sm->sm_table, sm->sz);
+                const SM_STATE_t* next = findStateFromId(sm, nextState);
                 if (next==NULL) {
                     // oops
                     log_error("SM tries to change to unknown state[%d] from current [%s] on event [%d]", nextState, sm->currentState->name, evt->e);
                     assert(0);      // stop right here boys
                 }
-                // exit previous - you are NOT allowed to change the destination state 
-                (sm->currentState->fn)(sm->ctxarg, SM_EXIT, NULL);
-                // change to next one
-                sm->currentState = next;
-                // enter next - allowed to change to a new one? no - in this case you can send yourself your own event...
-                (sm->currentState->fn)(sm->ctxarg, SM_ENTER, NULL);
+                changeState(sm, next);
             }
         } // else this event was cancelled whilest in the q, ignore it
+        if (evt->pl==PL_POOL) {
+            payloadFree(evt->data);
+        }
+#if SM_TRACE
+        traceEvent(sm, evt, from, nextState, start, run);
+#endif
     }
 }
 
-// task just sends the events on the global list into SMs using event to run the task
+// task just sends the events on its lane's list into SMs using event to run the task
 static void sm_mgr_task(void* arg) {
+    SM_LANE_t* lane = (SM_LANE_t*)arg;
     while(1) {
-        os_eventq_run(&_sm_EQ);
+        os_eventq_run(&lane->eq);
     }
 }
 
-static const SM_STATE_t* findStateFromId(SM_STATE_ID_t id, const SM_STATE_t* table, uint8_t sz) {
-    // start search at the 'idth' element iff id<sz, in case table elements are in the enum order... optimisation... TODO
-    for(int i=0;i<sz;i++) {
-        if (table[i].id==id) {
-            return &table[i];
+#if SM_TRACE
+// Histogram bucket for a duration in ticks : 0, <8, <64, <512, <4096, <32768, <262144, more
+static void traceHist(uint16_t* n, os_time_t t) {
+    uint8_t b = 0;
+    if (t>0) {
+        b = (32-__builtin_clz(t)+2)/3;
+        if (b>=TR_BUCKETS) {
+            b = TR_BUCKETS-1;
+        }
+    }
+    if (n[b]<0xFFFF) {
+        n[b]++;
+    }
+}
+// Latency stats entry for this SM/event, allocated on first use (NULL if the table is full)
+static SM_TRACE_EVT_t* traceEvtStats(SM_t* sm, int e) {
+    SM_TRACE_EVT_t* ret = NULL;
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    for(int i=0;i<_tr.nbEvts;i++) {
+        if (_tr.evts[i].sm==sm && _tr.evts[i].e==e) {
+            ret = &_tr.evts[i];
+            break;
+        }
+    }
+    if (ret==NULL && _tr.nbEvts<MYNEWT_VAL(SM_TRACE_EVENTS)) {
+        ret = &_tr.evts[_tr.nbEvts++];
+        ret->sm = sm;
+        ret->e = e;
+    }
+    OS_EXIT_CRITICAL(sr);
+    return ret;
+}
+// Record an event just handled (run) or dropped as stale
+static void traceEvent(SM_t* sm, SM_EVENT_t* evt, SM_STATE_ID_t from, SM_STATE_ID_t to, os_time_t start, bool run) {
+    if (!_tr.on) {
+        return;
+    }
+    os_time_t end = smTime();
+    if (run) {
+        SM_TRACE_EVT_t* es = traceEvtStats(sm, evt->e);
+        if (es!=NULL) {
+            os_time_t lat = start - evt->at;
+            traceHist(es->n, lat);
+            if (lat>es->max) {
+                es->max = lat;
+            }
+        }
+        if (to!=SM_STATE_CURRENT) {
+            if (sm->trStates!=TR_NONE) {
+                SM_TRACE_STATE_t* st = &_tr.states[sm->trStates+from];
+                st->total += (start - sm->enteredAt);
+                traceHist(st->n, start - sm->enteredAt);
+            }
+            sm->enteredAt = end;
+        }
+    }
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    SM_TRACE_REC_t* r = &_tr.ring[_tr.next];
+    _tr.next = (_tr.next+1) % MYNEWT_VAL(SM_TRACE_SZ);
+    if (_tr.nb<MYNEWT_VAL(SM_TRACE_SZ)) {
+        _tr.nb++;
+    }
+    r->at = start;
+    r->sm = sm - _smTable;
+    r->from = from;
+    r->to = to;
+    r->flags = (run ? 0 : TR_F_STALE);
+    r->e = evt->e;
+    r->exec = ((end-start)>0xFFFF) ? 0xFFFF : (end-start);
+    OS_EXIT_CRITICAL(sr);
+}
+// ith oldest record
+static SM_TRACE_REC_t* traceRec(uint16_t i) {
+    return &_tr.ring[(_tr.next + MYNEWT_VAL(SM_TRACE_SZ) - _tr.nb + i) % MYNEWT_VAL(SM_TRACE_SZ)];
+}
+// Blob writer : only the bytes in the window [off, off+len) are copied
+typedef struct {
+    uint8_t* buf;
+    uint32_t pos;
+    uint32_t off;
+    uint16_t len;
+    uint16_t done;
+} TR_BLOB_t;
+static void blobPut(TR_BLOB_t* b, uint32_t v, uint8_t sz) {
+    for(int i=0;i<sz;i++, b->pos++) {
+        if (b->pos>=b->off && b->done<b->len) {
+            b->buf[b->done++] = (v >> (8*i)) & 0xFF;
+        }
+    }
+}
+static const char* stateName(SM_t* sm, SM_STATE_ID_t id) {
+    const SM_STATE_t* s = findStateFromId(sm, id);
+    return (s!=NULL) ? s->name : "-";
+}
+#endif
+
+// PUBLIC : dump the trace as a binary blob (see sm_exec.h for the format)
+int sm_traceDump(uint8_t* buf, uint16_t off, uint16_t len) {
+#if SM_TRACE
+    TR_BLOB_t b = { .buf=buf, .pos=0, .off=off, .len=len, .done=0 };
+    os_time_t now = smTime();
+    blobPut(&b, 1, 1);
+    blobPut(&b, TR_BUCKETS, 1);
+    blobPut(&b, _smIdx, 1);
+    blobPut(&b, _tr.nbEvts, 1);
+    blobPut(&b, _tr.nb, 2);
+    blobPut(&b, TR_REC_SZ, 1);
+    blobPut(&b, 0, 1);
+    for(int i=0;i<_smIdx;i++) {
+        SM_t* sm = &_smTable[i];
+        uint8_t nbs = (sm->trStates!=TR_NONE) ? sm->sz : 0;
+        blobPut(&b, sm->lane - _lanes, 1);
+        blobPut(&b, nbs, 1);
+        blobPut(&b, sm->currentState->id, 1);
+        blobPut(&b, 0, 1);
+        blobPut(&b, now - sm->enteredAt, 4);
+        for(int s=0;s<nbs;s++) {
+            SM_TRACE_STATE_t* st = &_tr.states[sm->trStates+s];
+            blobPut(&b, st->total, 4);
+            for(int k=0;k<TR_BUCKETS;k++) {
+                blobPut(&b, st->n[k], 2);
+            }
+        }
+    }
+    for(int i=0;i<_tr.nbEvts;i++) {
+        SM_TRACE_EVT_t* es = &_tr.evts[i];
+        blobPut(&b, es->sm - _smTable, 1);
+        blobPut(&b, 0, 1);
+        blobPut(&b, es->e, 2);
+        blobPut(&b, es->max, 4);
+        for(int k=0;k<TR_BUCKETS;k++) {
+            blobPut(&b, es->n[k], 2);
+        }
+    }
+    for(int i=0;i<_tr.nb;i++) {
+        SM_TRACE_REC_t* r = traceRec(i);
+        blobPut(&b, r->at, 4);
+        blobPut(&b, r->sm, 1);
+        blobPut(&b, (uint8_t)r->from, 1);
+        blobPut(&b, (uint8_t)r->to, 1);
+        blobPut(&b, r->flags, 1);
+        blobPut(&b, r->e, 2);
+        blobPut(&b, r->exec, 2);
+    }
+    return b.done;
+#else
+    return -1;
+#endif
+}
+void sm_traceEnable(bool on) {
+#if SM_TRACE
+    _tr.on = on;
+#endif
+}
+void sm_traceClear(void) {
+#if SM_TRACE
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    _tr.next = _tr.nb = 0;
+    memset(_tr.states, 0, sizeof(_tr.states));
+    memset(_tr.evts, 0, sizeof(_tr.evts));
+    _tr.nbEvts = 0;
+    OS_EXIT_CRITICAL(sr);
+#endif
+}
+// PUBLIC : console command to show the trace
+ATRESULT sm_atcmd_trace(PRINTLN_t pfn, uint8_t nargs, char* argv[]) {
+#if SM_TRACE
+    os_time_t now = smTime();
+    if (nargs<2) {
+        // where is everyone?
+        for(int i=0;i<_smIdx;i++) {
+            SM_t* sm = &_smTable[i];
+            (*pfn)("SM %d [%s] lane %d in [%s] for %d ticks, %d drops", i, sm->name, sm->lane - _lanes,
+                sm->currentState->name, now - sm->enteredAt, sm->drops);
         }
+        return ATCMD_OK;
     }
-    return NULL;        // This would be bad
+    if (strcmp(argv[1], "states")==0) {
+        for(int i=0;i<_smIdx;i++) {
+            SM_t* sm = &_smTable[i];
+            for(int s=0;(sm->trStates!=TR_NONE) && s<sm->sz;s++) {
+                uint16_t* n = _tr.states[sm->trStates+s].n;
+                (*pfn)("%s.%s tot %d : %d %d %d %d %d %d %d %d", sm->name, stateName(sm, s), _tr.states[sm->trStates+s].total,
+                    n[0], n[1], n[2], n[3], n[4], n[5], n[6], n[7]);
+            }
+        }
+    } else if (strcmp(argv[1], "events")==0) {
+        for(int i=0;i<_tr.nbEvts;i++) {
+            SM_TRACE_EVT_t* es = &_tr.evts[i];
+            (*pfn)("%s.%d max %d : %d %d %d %d %d %d %d %d", es->sm->name, es->e, es->max,
+                es->n[0], es->n[1], es->n[2], es->n[3], es->n[4], es->n[5], es->n[6], es->n[7]);
+        }
+    } else if (strcmp(argv[1], "log")==0) {
+        int n = (nargs>2) ? atoi(argv[2]) : 16;
+        for(int i=(n<_tr.nb ? _tr.nb-n : 0);i<_tr.nb;i++) {
+            SM_TRACE_REC_t* r = traceRec(i);
+            SM_t* sm = &_smTable[r->sm];
+            (*pfn)("%d %s [%s]->[%s] e %d%s %d ticks", r->at, sm->name, stateName(sm, r->from),
+                stateName(sm, r->to), (int16_t)r->e, (r->flags & TR_F_STALE) ? " stale" : "", r->exec);
+        }
+    } else if (strcmp(argv[1], "dump")==0) {
+        // hex, 32 bytes per line, with recording paused so the blob is coherent
+        bool on = _tr.on;
+        _tr.on = false;
+        uint8_t b[32];
+        char l[2*sizeof(b)+1];
+        int n;
+        for(uint16_t off=0;(n=sm_traceDump(b, off, sizeof(b)))>0;off+=n) {
+            for(int i=0;i<n;i++) {
+                sprintf(&l[2*i], "%02x", b[i]);
+            }
+            (*pfn)("%s", l);
+        }
+        _tr.on = on;
+    } else if (strcmp(argv[1], "clear")==0) {
+        sm_traceClear();
+    } else if (strcmp(argv[1], "on")==0 || strcmp(argv[1], "off")==0) {
+        sm_traceEnable(strcmp(argv[1], "on")==0);
+    } else {
+        (*pfn)("%s [states|events|log [n]|dump|clear|on|off]", argv[0]);
+        return ATCMD_GENERR;
+    }
+    return ATCMD_OK;
+#else
+    (*pfn)("SM trace not enabled (SM_TRACE)");
+    return ATCMD_GENERR;
+#endif
+}
+
+// Time for the SMs : virtual when simulating
+static os_time_t smTime(void) {
+#if SM_SIM
+    if (_sim.on) {
+        return _sim.now;
+    }
+#endif
+    return os_time_get();
+}
+
+// PUBLIC : switch the SMs to virtual time
+void sm_simStart(void) {
+#if SM_SIM
+    os_callout_stop(&_tw.callout);
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    _tw.armed = false;
+    _sim.now = os_time_get();
+    _sim.on = true;
+    OS_EXIT_CRITICAL(sr);
+#else
+    log_warn("SM: no virtual time (SM_SIM)");
+#endif
+}
+// PUBLIC : run the SMs for ms of virtual time, returns the number of events executed
+uint32_t sm_simRun(uint32_t ms) {
+#if SM_SIM
+    assert(_sim.on);
+    os_time_t ticks;
+    os_time_ms_to_ticks(ms, &ticks);
+    os_time_t end = _sim.now + ticks;
+    uint32_t nb = _sim.nbEvents;
+    while(true) {
+        // run all the lanes until nobody has anything left to do at this time
+        bool ran = true;
+        while(ran) {
+            ran = false;
+            for(int i=0;i<SM_LANES;i++) {
+                if (!circListEmpty(_lanes[i].head, _lanes[i].tail, SM_MAX_EVENTS)) {
+                    sm_nextevent_cb(&_lanes[i].schedule);
+                    ran = true;
+                }
+            }
+        }
+        // and skip the idle time straight to the next timer deadline
+        os_time_t next;
+        os_sr_t sr;
+        OS_ENTER_CRITICAL(sr);
+        bool due = twNext(&next) && !OS_TIME_TICK_GT(next, end);
+        if (due) {
+            if (OS_TIME_TICK_GT(next, _sim.now)) {
+                _sim.now = next;
+            }
+            twAdvance(_sim.now);
+        }
+        OS_EXIT_CRITICAL(sr);
+        if (!due) {
+            break;
+        }
+    }
+    _sim.now = end;
+    return _sim.nbEvents - nb;
+#else
+    return 0;
+#endif
+}
+// PUBLIC : virtual time now (os time if not simulating)
+os_time_t sm_simTime(void) {
+    return smTime();
+}
+
+// Payload pool blocks (ISR safe)
+static void* payloadAlloc(void) {
+    void* ret = NULL;
+#if SM_PAYLOAD_POOL_NB>0
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    if (_plNbFree>0) {
+        ret = _plPool[_plFree[--_plNbFree]];
+    }
+    OS_EXIT_CRITICAL(sr);
+#endif
+    return ret;
+}
+static void payloadFree(void* b) {
+#if SM_PAYLOAD_POOL_NB>0
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    _plFree[_plNbFree++] = ((uint32_t*)b - &_plPool[0][0]) / ((SM_PAYLOAD_BLOCK_SZ+3)/4);
+    OS_EXIT_CRITICAL(sr);
+#endif
+}
+
+// Enclosing state of s, or NULL if its top level
+static const SM_STATE_t* parentOf(SM_t* sm, const SM_STATE_t* s) {
+    return (s->parent==0) ? NULL : findStateFromId(sm, s->parent-1);
+}
+// Give the event to the current state, then up its parents while they return SM_STATE_PARENT
+static SM_STATE_ID_t dispatch(SM_t* sm, int e, void* data) {
+    for(const SM_STATE_t* s=sm->currentState;s!=NULL;s=parentOf(sm, s)) {
+        SM_STATE_ID_t next = (s->fn)(sm->ctxarg, e, data);
+        if (next!=SM_STATE_PARENT) {
+            return next;
+        }
+    }
+    return SM_STATE_CURRENT;        // nobody wanted it
+}
+// ENTER the parents of s that are below top (all if top is NULL), outermost first (recursion is as deep as the nesting)
+static void enterParents(SM_t* sm, const SM_STATE_t* s, const SM_STATE_t* top) {
+    const SM_STATE_t* p = parentOf(sm, s);
+    if (p!=top && p!=NULL) {
+        enterParents(sm, p, top);
+        (p->fn)(sm->ctxarg, SM_ENTER, NULL);
+    }
+}
+// Change state : EXIT from the current state up to the first parent it shares with next, then ENTER down to next.
+// A transition to the same state, or to one of its parents, exits and re-enters that state.
+// You are NOT allowed to change the destination state from an ENTER/EXIT (send yourself your own event instead)
+static void changeState(SM_t* sm, const SM_STATE_t* next) {
+    const SM_STATE_t* top = sm->currentState;
+    while(top!=NULL) {
+        // is it a (strict) parent of next?
+        const SM_STATE_t* p = parentOf(sm, next);
+        while(p!=NULL && p!=top) {
+            p = parentOf(sm, p);
+        }
+        if (p!=NULL) {
+            break;
+        }
+        (top->fn)(sm->ctxarg, SM_EXIT, NULL);
+        top = parentOf(sm, top);
+    }
+    sm->currentState = next;
+    enterParents(sm, next, top);
+    (next->fn)(sm->ctxarg, SM_ENTER, NULL);
+}
+
+// Direct lookup as the table is in id order (checked at init)
+static const SM_STATE_t* findStateFromId(SM_t* sm, SM_STATE_ID_t id) {
+    if (id<0 || id>=sm->sz) {
+        return NULL;        // This would be bad
+    }
+    return &sm->sm_table[id];
 }
 
 
@@ -283,4 +1230,73 @@ static bool circListEmpty(uint8_t head, uint8_t tail, uint8_t sz) {
         return true;
     }
     return false;
-}
\ No newline at end of file
+}
+
+#ifdef UNITTEST
+// Virtual time test : a SM with an hour long timeout and a 70s tick timer, run in a few ms
+enum { UT_IDLE, UT_WAIT, UT_LAST };
+enum { UT_GO, UT_TICK };
+static int _utTicks;
+static SM_ID_t _utSM;
+static SM_STATE_ID_t UT_Idle(void* arg, int e, void* data) {
+    if (e==UT_GO) {
+        return UT_WAIT;
+    }
+    return SM_STATE_CURRENT;
+}
+static SM_STATE_ID_t UT_Wait(void* arg, int e, void* data) {
+    switch(e) {
+        case SM_ENTER:
+            sm_timer_start(_utSM, 60*60*1000);
+            sm_timer_startE(_utSM, 70*1000, UT_TICK);
+            break;
+        case SM_EXIT:
+            sm_timer_stopE(_utSM, UT_TICK);
+            break;
+        case UT_TICK:
+            _utTicks++;
+            sm_timer_startE(_utSM, 70*1000, UT_TICK);
+            break;
+        case SM_TIMEOUT:
+            return UT_IDLE;
+    }
+    return SM_STATE_CURRENT;
+}
+static const SM_STATE_t _utStates[] = {
+    {.id=UT_IDLE, .name="UTIdle", .fn=UT_Idle},
+    {.id=UT_WAIT, .name="UTWait", .fn=UT_Wait},
+};
+SM_CHECK_TABLE(_utStates, UT_LAST);
+// Only run from init_sm_exec() (before any other SM is created), which resets the SMs, timers and clock after it
+bool unittest_sm() {
+    bool ret = true;
+#if SM_SIM
+    _utTicks = 0;
+    sm_simStart();
+    os_time_t start = sm_simTime();
+    _utSM = sm_init("ut", _utStates, UT_LAST, UT_IDLE, NULL);
+    sm_start(_utSM);
+    sm_sendEvent(_utSM, UT_GO, NULL);
+    ret &= unittest("sm sim go", sm_simRun(0)>=2 && sm_getCurrentState(_utSM)==UT_WAIT);
+    sm_simRun(30*60*1000);
+    ret &= unittest("sm sim half hour", _utTicks==25 && sm_getCurrentState(_utSM)==UT_WAIT);
+    sm_simRun(2*60*60*1000);
+    ret &= unittest("sm sim timeout", _utTicks==51 && sm_getCurrentState(_utSM)==UT_IDLE);
+    os_time_t ticks;
+    os_time_ms_to_ticks(150*60*1000, &ticks);
+    ret &= unittest("sm sim time", (sm_simTime()-start)==ticks);
+    // dispatcher throughput
+    os_time_t t0 = os_time_get();
+    uint32_t nb = 0;
+    for(int i=0;i<100;i++) {
+        for(int j=0;j<SM_MAX_EVENTS-1;j++) {
+            sm_sendEvent(_utSM, UT_TICK, NULL);
+        }
+        nb += sm_simRun(0);
+    }
+    log_info("UT:sm %d events in %d ticks", nb, os_time_get()-t0);
+    ret &= unittest("sm sim events", nb==100*(SM_MAX_EVENTS-1));
+#endif
+    return ret;
+}
+#endif /* UNITTEST */
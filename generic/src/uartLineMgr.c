@@ -42,6 +42,7 @@
 
 static struct UARTDeviceCfg {
     const char* dname;
+    WSKT_DEV_t wdev;
     struct os_dev* uartDev;
     uint32_t baud;
     uint8_t rxBuff_data_space[UART_LINE_SZ+1];
@@ -63,27 +64,26 @@ static int uart_line_open(wskt_t* skt);
 static int uart_line_ioctl(wskt_t* skt, wskt_ioctl_t* cmd);
 static int uart_line_write(wskt_t* skt, uint8_t* data, uint32_t sz);
 static int uart_line_close(wskt_t* skt);
+static int uart_line_writev(wskt_t* skt, const wskt_iov_t* iov, uint8_t niov);
 static int uart_rx_cb(void*, uint8_t c);
 //static void uart_tx_ready(void* ctx);
 static int uart_tx_cb(void* ctx);
+static void uart_tx_done(void* ctx);
 //static void lp_change(LP_MODE_t p, LP_MODE_t n);
 
 static wskt_devicefns_t _myDevice = {
     .open = &uart_line_open,
     .ioctl = &uart_line_ioctl,
     .write = &uart_line_write,
-    .close = &uart_line_close
+    .close = &uart_line_close,
+    .writev = &uart_line_writev
 };
 
-static uint8_t _lineBuffer[UART_LINE_SZ];
-// mutex to protect it (only used in passing)
-static struct os_mutex _lbMutex;
 static LP_ID_t _lpUserId;
 
 // Called from sysinit via reference in pkg.yml
 void uart_line_comm_init(void) {
     // TODO should we use mempools to handle per-device structures?
-    os_mutex_init(&_lbMutex);
     // register with low power manager so we can set the level of sleep we can take.
     // The operation is essentially : if a UART device socket is OPEN, we permit SLEEP, if all are closed, we allow DEEPSLEEP
     // No action when idle sleep is entered however
@@ -117,7 +117,7 @@ bool uart_line_comm_create(const char* dname, uint32_t baud) {
     myCfg->eol = LF;
     myCfg->uartSelect = -1;
     // and register ourselves as a 'uart like' comms provider so procesing routines can read the data
-    wskt_registerDevice(dname, &_myDevice, myCfg);
+    myCfg->wdev = wskt_registerDevice(dname, &_myDevice, myCfg);
     return true;
 }
 
@@ -157,7 +157,7 @@ static bool openuart(struct UARTDeviceCfg* cfg) {
         .uc_flow_ctl = 0,
         .uc_tx_char = uart_tx_cb,
         .uc_rx_char = uart_rx_cb,
-        .uc_tx_done = NULL,
+        .uc_tx_done = uart_tx_done,
         .uc_cb_arg = cfg,
     };
 
@@ -228,6 +228,7 @@ static int uart_line_ioctl(wskt_t* skt, wskt_ioctl_t* cmd) {
             os_sr_t sr;
             OS_ENTER_CRITICAL(sr);
             circ_bbuf_flush(&cfg->txBuff);
+            wskt_txDrained(cfg->wdev);      // nothing more will go out
             circ_bbuf_flush(&cfg->rxBuff);
             OS_EXIT_CRITICAL(sr);
             break;
@@ -243,6 +244,11 @@ static int uart_line_ioctl(wskt_t* skt, wskt_ioctl_t* cmd) {
     return SKT_NOERR; 
 }
 static int uart_line_write(wskt_t* skt, uint8_t* data, uint32_t sz) {
+    // just a single fragment writev
+    wskt_iov_t iov = WSKT_IOV_DATA(data, sz);
+    return uart_line_writev(skt, &iov, 1);
+}
+static int uart_line_writev(wskt_t* skt, const wskt_iov_t* iov, uint8_t niov) {
     struct UARTDeviceCfg* cfg=((struct UARTDeviceCfg*)WSKT_DEVICE_CFG(skt));  
 
     if (cfg->uartDev==NULL) {
@@ -250,21 +256,21 @@ static int uart_line_write(wskt_t* skt, uint8_t* data, uint32_t sz) {
         return SKT_NODEV;
     }
     circ_bbuf_t* buf = &cfg->txBuff;
+    uint32_t sz = wskt_iovSize(iov, niov);
+    // IRQ disable during update via OS_ENTER/EXIT_CRITICAL, so the block is not interleaved with another writer's
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
     // check if space in buffer for ALL the data
     if (sz>circ_bbuf_free_space(buf)) {
+        OS_EXIT_CRITICAL(sr);
         log_uartbdg("no space in buffer for line of sz %d...", sz);
         // if not, don't take any
         return SKT_NOSPACE;
     }
-    // IRQ disable during update via OS_ENTER/EXIT_CRITICAL
-    // copy it in
-    for(int i=0; i<sz; i++) {
-        os_sr_t sr;
-        OS_ENTER_CRITICAL(sr);
-        circ_bbuf_push(buf, data[i]);
-        OS_EXIT_CRITICAL(sr);
-    }
-    // IRQ enable
+    // encode it straight in
+    wskt_iovPush(iov, niov, buf);
+    wskt_txQueued(cfg->wdev);
+    OS_EXIT_CRITICAL(sr);
 
     // Tell uart more tx data
     if (cfg->uartDev!=NULL) {
@@ -276,12 +282,20 @@ static int uart_line_close(wskt_t* skt) {
     struct UARTDeviceCfg* cfg=((struct UARTDeviceCfg*)WSKT_DEVICE_CFG(skt));  
 
     // Iff last skt then close mynewt uart device
-    if (wskt_getOpenSockets(cfg->dname, NULL, 0)<=1) {
-        // hmmmm.. should wait for tx to finish : TODO
+    if (wskt_getNbOpenSockets(cfg->wdev)<=1) {
+        // Doesn't wait for tx to finish : users that care close with wskt_closeAfterDrain()
         if (cfg->uartDev!=NULL) {
             os_dev_close(cfg->uartDev);
             cfg->uartDev = NULL;
         }
+        // Any tx left will never go out now : drop it, so the device isn't left busy with its drain waiters never told
+        if (circ_bbuf_data_available(&cfg->txBuff)>0) {
+            os_sr_t sr;
+            OS_ENTER_CRITICAL(sr);
+            circ_bbuf_flush(&cfg->txBuff);
+            wskt_txDrained(cfg->wdev);
+            OS_EXIT_CRITICAL(sr);
+        }
         // Dont do logging in here (as will re-open the debug uart potentially, and stop deep sleeping!!!)
         log_noout("closed last socket on uart %s", cfg->dname);
         // Check if ALL sockets on ALL devices are closed, in which case we allow DEEP SLEEP
@@ -308,53 +322,30 @@ static int uart_rx_cb(void* ctx, uint8_t c) {
     circ_bbuf_push(&(myCfg->rxBuff), c);
     // if full or EOL, copy to all sockets (get list from wskt mgr)
     if (c==myCfg->eol || circ_bbuf_free_space(&(myCfg->rxBuff))==0) {
-        // copy out line first to local STATIC buffer (stack space!)
-        // MUTEX NOT REQUIRED IN ISR CALLED ROUTINE (normally)
-//        os_mutex_pend(&_lbMutex, OS_TIMEOUT_NEVER);
-        uint8_t lineLen = 0;
-        bool copied = false;
-        while(!copied && lineLen<UART_LINE_SZ) {
-            if (circ_bbuf_pop(&(myCfg->rxBuff), &(_lineBuffer[lineLen]))<0) {
-                // done, its empty
-                copied = true;
-            } else {
-                // did we just copy a EOL?
-                if (_lineBuffer[lineLen]==myCfg->eol) {
-                    // done, EOL
-                    // back up 1 coz don't want the EOL
-                    lineLen--;
-                    copied = true;                
-                }
+        // pop line straight into a shared line buffer, that is then given to each socket (no copy for those that
+        // take it by reference). If nobody listening or no buffer free, the line is just dropped
+        uint8_t* line = NULL;
+        if (wskt_getNbOpenSockets(myCfg->wdev)>0) {
+            line = wskt_lineAlloc(myCfg->wdev);
+        }
+        uint16_t lineLen = 0;
+        uint8_t lc;
+        // up to EOL (which we don't want)
+        while(circ_bbuf_pop(&(myCfg->rxBuff), &lc)==0 && lc!=myCfg->eol) {
+            if (line!=NULL && lineLen<(UART_LINE_SZ-1)) {
+                line[lineLen++] = lc;
             }
-            lineLen++;
         }
-        // Make it a null terminated string
-        _lineBuffer[lineLen++] = 0;
-//        os_mutex_release(&_lbMutex);
-        // We don't give up empty lines
-        if (lineLen>1) {
-//            log_uartbdg("%s got line", myCfg->dname);
-            // now send it off
-            wskt_t* os[8];      // no more than 8 open sockets on my device please
-            uint8_t ns = wskt_getOpenSockets(myCfg->dname, &(os[0]), 8);
-            // For each socket
-            for(int i=0;i<ns;i++) {
-                // get event out of socket
-                struct os_event* e = os[i]->evt;
-                if (e!=NULL) {
-                    if (!e->ev_queued) {
-                        // else copy in line (including the null terminator)
-                        uint8_t* sbuf = (uint8_t*)(e->ev_arg);
-                        memcpy(sbuf, _lineBuffer, lineLen);
-                        // and post event to the listener's task
-                        os_eventq_put(os[i]->eq, e);
-                    } else {
-                        // if already on their q then... discard for this guy???
-                    }
-                } else {
-                    // ok, this guy doesn't care about RX - thats ok...
-                }
-            }        
+        if (line!=NULL) {
+            // Make it a null terminated string
+            line[lineLen++] = 0;
+            // We don't give up empty lines
+            if (lineLen>1) {
+//                log_uartbdg("%s got line", myCfg->dname);
+                wskt_lineDeliver(myCfg->wdev, line, lineLen);
+            }
+            // done with our ref
+            wskt_lineRelease(line);
         }
     }
 
@@ -371,11 +362,22 @@ static int uart_tx_cb(void* ctx) {
     // note that the circular buffer is protected from this IRQ CB via OS_ENTER/EXIT_CRITICAL() which disables IRQs
     uint8_t c;
     if (circ_bbuf_pop(&(myCfg->txBuff), &c)<0) {
-        // No more data to tx - tell user of device in case it wants to power down?
+        // No more data to tx - users get told via uart_tx_done once the last byte is out
         return -1;
     }
     return c;
 }
+// IRQ once tx is complete (last byte left the uart)
+static void uart_tx_done(void* ctx) {
+    struct UARTDeviceCfg* myCfg = (struct UARTDeviceCfg*)ctx;
+    // unless a write was queued since the last byte was taken : its own tx done will tell
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    if (circ_bbuf_data_available(&(myCfg->txBuff))==0) {
+        wskt_txDrained(myCfg->wdev);
+    }
+    OS_EXIT_CRITICAL(sr);
+}
 /*
 // IRQ for tx can take a byte
 static void uart_tx_ready(void* ctx) {
@@ -415,4 +417,4 @@ static void lp_change(LP_MODE_t oldmode, LP_MODE_t newmode) {
         }
     }
 }
-*/
\ No newline at end of file
+*/
\ No newline at end of file
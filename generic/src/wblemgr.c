@@ -65,7 +65,6 @@ static struct blectx {
     int8_t uartPin;
     int8_t uartSelect;
     wskt_t* cnx;
-    uint8_t rxbuf[WSKT_BUF_SZ+1];
     char txLine[100];                // For dynamic string creation to send to BLE
     uint32_t lastDataTime;
     WBLE_CB_FN_t cbfn;
@@ -90,13 +89,14 @@ static struct blectx {
 
 // State machine for BLE control
 enum BLEStates { MS_BLE_OFF, MS_BLE_WAITPOWERON, MS_BLE_STARTING, MS_BLE_ON, MS_BLE_SCANNING, MS_BLE_UART_CHECK, MS_BLE_UART_RUNNING, MS_BLE_START_IB, 
-    MS_BLE_STOPPINGCOMM, MS_BLE_LAST };
+    MS_BLE_STOPPINGCOMM, MS_BLE_POWERED, MS_BLE_LAST };
 enum BLEEvents { ME_BLE_ON, ME_BLE_OFF, ME_BLE_START_SCAN, ME_BLE_START_IB, ME_BLE_STOP_SCAN, ME_BLE_STOP_IB, ME_BLE_RET_OK, ME_BLE_RET_ERR, ME_BLE_RET_INT,
      ME_BLE_UPDATE, ME_BLE_UART_OK, ME_BLE_UART_NOK, ME_BLE_UART_CONN, ME_BLE_UART_DISC, ME_CC_RETRY };
 
 // predeclare privates
 //static void wble_mgr_task(void* arg);
 static void wble_mgr_rxcb(struct os_event* ev);
+static void wble_processLine(const char* line);
 static ibeacon_data_t*  getIB(int idx);
 // Add scanned IB to list if not already present else update it
 static int addIB(ibeacon_data_t* ibp);
@@ -252,13 +252,9 @@ static SM_STATE_ID_t State_WaitPoweron(void* arg, int e, void* data) {
             // ignore any input, wait for powerup timer as might be from a previous uart user
             return SM_STATE_CURRENT;
         }
-        case ME_BLE_OFF: {
-            // gave up
-            return MS_BLE_OFF;
-        }            
         default: {
-            sm_default_event_log(ctx->mySMId, "BLE", e);
-            return SM_STATE_CURRENT;
+            // ME_BLE_OFF etc
+            return SM_STATE_PARENT;
         }
     }
     assert(0);      // shouldn't get here
@@ -304,8 +300,8 @@ static SM_STATE_ID_t State_Starting(void* arg, int e, void* data) {
         case ME_BLE_RET_INT: {        // return is an integer which is what we expect from WHO
             // Normally the who response is the data value. Store it for later
             // from BLEV2 it is the firmware version stored in a uint16 (MSB=major, LSB=minor)
-            ctx->fwVersionMaj = ((((uint32_t)data) >>8) & 0xFF);
-            ctx->fwVersionMin = (((uint32_t)data) & 0xFF);
+            ctx->fwVersionMaj = (((*(int*)data) >>8) & 0xFF);
+            ctx->fwVersionMin = ((*(int*)data) & 0xFF);
             if (ctx->fwVersionMaj < 2) {
                 // bad ble version
                 log_warn("BLE : module fw v%d.%d not > 2.0: fail", ctx->fwVersionMaj, ctx->fwVersionMin);
@@ -323,13 +319,9 @@ static SM_STATE_ID_t State_Starting(void* arg, int e, void* data) {
             callCB(ctx, WBLE_UART_DISC, NULL);
             return SM_STATE_CURRENT;
         }
-        case ME_BLE_OFF: {
-            // gave up - directly off
-            return MS_BLE_OFF;
-        }            
         default: {
-            sm_default_event_log(ctx->mySMId, "BLE", e);
-            return SM_STATE_CURRENT;
+            // ME_BLE_OFF etc
+            return SM_STATE_PARENT;
         }
     }
     assert(0);      // shouldn't get here
@@ -352,10 +344,6 @@ static SM_STATE_ID_t State_On(void* arg, int e, void* data) {
             // We _are_ on - but we'll check with the BLE anyway before saying so
             return MS_BLE_STARTING;
         }
-        case ME_BLE_OFF: {
-            // Nothing happening, go off
-            return MS_BLE_OFF;
-        }            
         case ME_BLE_START_SCAN: {
             // Start scanning - always allowed
             return MS_BLE_SCANNING;
@@ -383,8 +371,8 @@ static SM_STATE_ID_t State_On(void* arg, int e, void* data) {
             return SM_STATE_CURRENT;
         }            
         default: {
-            sm_default_event_log(ctx->mySMId, "BLE", e);
-            return SM_STATE_CURRENT;
+            // ME_BLE_OFF etc
+            return SM_STATE_PARENT;
         }
     }
     assert(0);      // shouldn't get here
@@ -485,8 +473,8 @@ static SM_STATE_ID_t State_Scanning(void* arg, int e, void* data) {
 
         case ME_BLE_UPDATE: {
             // uart callback parsed lines and updates the list of currently visible ibeacons
-            // data is directly the index in list TODO could be out of date.... too bad...
-            ibeacon_data_t* ib=getIB((int)data);
+            // data is the index in list TODO could be out of date.... too bad...
+            ibeacon_data_t* ib=getIB(*(int*)data);
             // if cb call it
             callCB(ctx, WBLE_SCAN_RX_IB, ib);
 #ifdef DEBUG_BLE
@@ -495,8 +483,7 @@ static SM_STATE_ID_t State_Scanning(void* arg, int e, void* data) {
             return SM_STATE_CURRENT;
         }
         default: {
-            sm_default_event_log(ctx->mySMId, "BLE", e);
-            return SM_STATE_CURRENT;
+            return SM_STATE_PARENT;
         }
     }
     assert(0);      // shouldn't get here
@@ -554,27 +541,23 @@ static SM_STATE_ID_t State_CheckUARTConn(void* arg, int e, void* data) {
         }
         case ME_BLE_RET_INT: {        // return is an integer which tells us connection status
 #ifdef DEBUG_BLE
-            log_debug("BLU: con status=%d", (uint32_t)data);
+            log_debug("BLU: con status=%d", *(int*)data);
 #endif
             // 0=no ble nus client, 1=ble nus client but not connected to uart, 2=cross-connection so go!
-            if (((uint32_t)data) == 2) {                
+            if ((*(int*)data) == 2) {                
                 // Go and enable serial connections from remote people
                 return MS_BLE_UART_RUNNING;
             } else {
-                log_debug("BLU: no cc (%d)", (uint32_t)data);
+                log_debug("BLU: no cc (%d)", *(int*)data);
                 // if cb call it
                 callCB(ctx, WBLE_UART_DISC, NULL);
                 // And back to on
                 return MS_BLE_ON;
             }
         }
-        case ME_BLE_OFF: {
-            // gave up - directly off
-            return MS_BLE_OFF;
-        }            
         default: {
-            sm_default_event_log(ctx->mySMId, "BLU", e);
-            return SM_STATE_CURRENT;
+            // ME_BLE_OFF etc
+            return SM_STATE_PARENT;
         }
     }
     assert(0);      // shouldn't get here
@@ -618,8 +601,7 @@ static SM_STATE_ID_t State_UARTRunning(void* arg, int e, void* data) {
         }
 
         default: {
-            sm_default_event_log(ctx->mySMId, "BLU", e);
-            return SM_STATE_CURRENT;
+            return SM_STATE_PARENT;
         }
     }
     assert(0);      // shouldn't get here
@@ -673,7 +655,7 @@ static SM_STATE_ID_t State_StartIB(void* arg, int e, void* data) {
             return SM_STATE_CURRENT;
         }
         case ME_BLE_RET_INT: {        // not expected an int return
-            log_debug("BLU: con status=%d", (uint32_t)data);
+            log_debug("BLU: con status=%d", *(int*)data);
             // retry
             sm_timer_startE(ctx->mySMId, UART_CMD_RETRY_TIMEMS, ME_CC_RETRY); 
             return SM_STATE_CURRENT;
@@ -684,8 +666,7 @@ static SM_STATE_ID_t State_StartIB(void* arg, int e, void* data) {
             return MS_BLE_STOPPINGCOMM;
         }            
         default: {
-            sm_default_event_log(ctx->mySMId, "BLU", e);
-            return SM_STATE_CURRENT;
+            return SM_STATE_PARENT;
         }
     }
     assert(0);      // shouldn't get here
@@ -707,16 +688,33 @@ static SM_STATE_ID_t State_StoppingComm(void* arg, int e, void* data) {
         case SM_TIMEOUT: {
             return MS_BLE_OFF;
         }
-        case ME_BLE_OFF: {
-            // gave up
-            return MS_BLE_OFF;
-        }            
         case ME_BLE_ON: {
             // comm ok already
             callCB(ctx, WBLE_COMM_OK, NULL);
             
             return MS_BLE_ON;
         }
+        default: {
+            // ME_BLE_OFF etc
+            return SM_STATE_PARENT;
+        }
+    }
+    assert(0);      // shouldn't get here
+}
+// Parent of the states where the module is powered : the events common to them are dealt with here
+static SM_STATE_ID_t State_Powered(void* arg, int e, void* data) {
+    struct blectx* ctx = (struct blectx*)arg;
+    switch(e) {
+        case SM_ENTER: {
+            return SM_STATE_CURRENT;
+        }
+        case SM_EXIT: {
+            return SM_STATE_CURRENT;
+        }
+        case ME_BLE_OFF: {
+            // gave up - directly off (states with a uart command in progress stop via StoppingComm instead)
+            return MS_BLE_OFF;
+        }
         default: {
             sm_default_event_log(ctx->mySMId, "BLE", e);
             return SM_STATE_CURRENT;
@@ -724,18 +722,20 @@ static SM_STATE_ID_t State_StoppingComm(void* arg, int e, void* data) {
     }
     assert(0);      // shouldn't get here
 }
-// State table : note can be in any order as the 'id' field is what maps the state id to the rest
-static const SM_STATE_t _bleSM[MS_BLE_LAST] = {
+// State table : in id order (entry i has .id=i), checked by sm_init()
+static const SM_STATE_t _bleSM[] = {
     {.id=MS_BLE_OFF,        .name="BleOff",       .fn=State_Off},
-    {.id=MS_BLE_WAITPOWERON,.name="BleWaitPower", .fn=State_WaitPoweron},
-    {.id=MS_BLE_STARTING,   .name="BleStarting",  .fn=State_Starting},    
-    {.id=MS_BLE_ON,         .name="BleOnIdle", .fn=State_On},
-    {.id=MS_BLE_SCANNING,   .name="BleScanning", .fn=State_Scanning},    
-    {.id=MS_BLE_UART_CHECK,   .name="BleUARTCheck", .fn=State_CheckUARTConn},    
-    {.id=MS_BLE_UART_RUNNING,   .name="BleUARTRun", .fn=State_UARTRunning},    
-    {.id=MS_BLE_START_IB,   .name="BleStartIB", .fn=State_StartIB},    
-    {.id=MS_BLE_STOPPINGCOMM, .name="BleStopping", .fn=State_StoppingComm},    
+    {.id=MS_BLE_WAITPOWERON,.name="BleWaitPower", .fn=State_WaitPoweron, .parent=SM_PARENT(MS_BLE_POWERED)},
+    {.id=MS_BLE_STARTING,   .name="BleStarting",  .fn=State_Starting, .parent=SM_PARENT(MS_BLE_POWERED)},    
+    {.id=MS_BLE_ON,         .name="BleOnIdle", .fn=State_On, .parent=SM_PARENT(MS_BLE_POWERED)},
+    {.id=MS_BLE_SCANNING,   .name="BleScanning", .fn=State_Scanning, .parent=SM_PARENT(MS_BLE_POWERED)},    
+    {.id=MS_BLE_UART_CHECK,   .name="BleUARTCheck", .fn=State_CheckUARTConn, .parent=SM_PARENT(MS_BLE_POWERED)},    
+    {.id=MS_BLE_UART_RUNNING,   .name="BleUARTRun", .fn=State_UARTRunning, .parent=SM_PARENT(MS_BLE_POWERED)},    
+    {.id=MS_BLE_START_IB,   .name="BleStartIB", .fn=State_StartIB, .parent=SM_PARENT(MS_BLE_POWERED)},    
+    {.id=MS_BLE_STOPPINGCOMM, .name="BleStopping", .fn=State_StoppingComm, .parent=SM_PARENT(MS_BLE_POWERED)},    
+    {.id=MS_BLE_POWERED,    .name="BlePowered", .fn=State_Powered},
 };
+SM_CHECK_TABLE(_bleSM, MS_BLE_LAST);
 
 // Called from sysinit via reference in pkg.yml
 void* wble_mgr_init(const char* dname, uint32_t baudrate, int8_t pwrPin, int8_t uartPin, int8_t uartSelect) {
@@ -767,7 +767,7 @@ void* wble_mgr_init(const char* dname, uint32_t baudrate, int8_t pwrPin, int8_t
     // create event with arg pointing to our line buffer
     // TODO how to tell driver limit of size of buffer???
     _ctx.myUARTEvent.ev_cb = wble_mgr_rxcb;
-    _ctx.myUARTEvent.ev_arg = _ctx.rxbuf;
+    _ctx.myUARTEvent.ev_arg = NULL;     // lines by reference from the socket
     // TODO Do we really need a whole task/eventQ just to rx the uart strings? as it only ever sends sm events as a result? (so callbacks run on the SM task...)
     // Nah, just use default task/default eventq
 //    os_task_init(&wble_mgr_task_str, "wble_task", wble_mgr_task, NULL, WBLE_TASK_PRIO,
@@ -775,7 +775,9 @@ void* wble_mgr_init(const char* dname, uint32_t baudrate, int8_t pwrPin, int8_t
     // Create eventQ
 //    os_eventq_init(&_ctx.myEQ);
     // Create task 
-    _ctx.mySMId = sm_init("blemgr", _bleSM, MS_BLE_LAST, MS_BLE_OFF, &_ctx);
+    _ctx.mySMId = sm_initLane("blemgr", _bleSM, MS_BLE_LAST, MS_BLE_OFF, &_ctx, MYNEWT_VAL(WBLE_SM_LANE));
+    // a scan can see a beacon per line : only tell the latest one rather than flood the event list
+    sm_coalesceEvent(_ctx.mySMId, ME_BLE_UPDATE);
     sm_start(_ctx.mySMId);
     return &_ctx;
 }
@@ -975,11 +977,25 @@ static void sendIBStart(struct blectx* ctx) {
     // AT_IB_START <uuid>,<major>,<minor>,<extrabyte>,<interval in ms>,<txpower>
     // All values in hex with leading 0s for fixed length
     /// Note non v2.0 BLE module doesnt support this
-    sprintf(ctx->txLine,"AT+IB_START,%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x,%04x,%04x,%02x,%04x,%d\r\n",
-            ctx->uuid[0],ctx->uuid[1],ctx->uuid[2],ctx->uuid[3],ctx->uuid[4],ctx->uuid[5],ctx->uuid[6],ctx->uuid[7],
-            ctx->uuid[8],ctx->uuid[9],ctx->uuid[10],ctx->uuid[11],ctx->uuid[12],ctx->uuid[13],ctx->uuid[14],ctx->uuid[15], 
-            ctx->ibMajor, ctx->ibMinor, ctx->ibExtra, ctx->ibInterMS, ctx->ibTxPower);    
-    wskt_write(ctx->cnx, (uint8_t*)&ctx->txLine[0], strlen(ctx->txLine));
+    // 16 bit values big endian so hex is like %04x
+    uint8_t vals[7] = { ctx->ibMajor>>8, ctx->ibMajor&0xff, ctx->ibMinor>>8, ctx->ibMinor&0xff, ctx->ibExtra,
+                        ctx->ibInterMS>>8, ctx->ibInterMS&0xff };
+    wskt_iov_t cmd[] = {
+        WSKT_IOV_STR("AT+IB_START,"),
+        WSKT_IOV_HEX(ctx->uuid, 16),
+        WSKT_IOV_STR(","),
+        WSKT_IOV_HEX(&vals[0], 2),
+        WSKT_IOV_STR(","),
+        WSKT_IOV_HEX(&vals[2], 2),
+        WSKT_IOV_STR(","),
+        WSKT_IOV_HEX(&vals[4], 1),
+        WSKT_IOV_STR(","),
+        WSKT_IOV_HEX(&vals[5], 2),
+        WSKT_IOV_STR(","),
+        WSKT_IOV_INT(ctx->ibTxPower),
+        WSKT_IOV_STR("\r\n"),
+    };
+    wskt_writev(ctx->cnx, cmd, sizeof(cmd)/sizeof(cmd[0]));
 }
 // Send ibeaconning off command
 static void sendIBStop(struct blectx* ctx) {
@@ -1041,9 +1057,16 @@ static int addIB(ibeacon_data_t* ibp) {
 // callback every time the socket gives us a new line of data from the GPS
 // Guarenteed to be mono-thread
 static void wble_mgr_rxcb(struct os_event* ev) {
-    // ev->arg is our line buffer
-    const char* line = (char*)(ev->ev_arg);
-    assert(line!=NULL);
+    // get each shared line buffer queued on our socket (none if closed since)
+    const char* line;
+    while((line = wskt_rxTake(ev))!=NULL) {
+        wble_processLine(line);
+        // and give it back
+        wskt_lineRelease(line);
+    }
+}
+
+static void wble_processLine(const char* line) {
     int slen = strnlen(line, 100);
     if (slen==0) {
         // too short line ignore
@@ -1083,7 +1106,7 @@ static void wble_mgr_rxcb(struct os_event* ev) {
 #ifdef DEBUG_BLE
             log_debug("BLE:[%s]=%d", line, val);
 #endif
-            sm_sendEvent(_ctx.mySMId, ME_BLE_RET_INT, (void*)val);
+            sm_sendEventData(_ctx.mySMId, ME_BLE_RET_INT, &val, sizeof(val));
         }
     } else {
         // Parse it as ibeacon data
@@ -1101,7 +1124,7 @@ static void wble_mgr_rxcb(struct os_event* ev) {
                 int idx = addIB(&ib);
                 if (idx>=0) {
                     // Tell SM
-                    sm_sendEvent(_ctx.mySMId, ME_BLE_UPDATE, (void*)idx);
+                    sm_sendEventData(_ctx.mySMId, ME_BLE_UPDATE, &idx, sizeof(idx));
                 } else {
                     log_warn("BLE:saw %4x,%4x list full",ib.major, ib.minor);
                 }
@@ -45,7 +45,6 @@ static struct bleuartctx {
     int8_t pwrPin;
     int8_t uartSelect;
     wskt_t* uartSkt;
-    uint8_t rxbuf[WSKT_BUF_SZ+1];
     uint32_t lastDataTime;
     WBLEUART_CB_FN_t cbfn;
     uint8_t fwVersionMaj;
@@ -327,14 +326,15 @@ static SM_STATE_ID_t State_StoppingComm(void* arg, int e, void* data) {
     }
     assert(0);      // shouldn't get here
 }
-// State table : note can be in any order as the 'id' field is what maps the state id to the rest
-static const SM_STATE_t _bleSM[MS_BLE_LAST] = {
+// State table : in id order (entry i has .id=i), checked by sm_init()
+static const SM_STATE_t _bleSM[] = {
     {.id=MS_BLE_OFF,        .name="BluOff",       .fn=State_Off},
     {.id=MS_BLE_WAITPOWERON,.name="BluWaitPower", .fn=State_WaitPoweron},
     {.id=MS_BLE_STARTING,   .name="BluStarting",  .fn=State_Starting},    
     {.id=MS_BLE_SERIAL_RUNNING,   .name="BluSerialRunning", .fn=State_SerialRunning},    
     {.id=MS_BLE_STOPPINGCOMM, .name="BluStopping", .fn=State_StoppingComm},    
 };
+SM_CHECK_TABLE(_bleSM, MS_BLE_LAST);
 
 /* The external API for this code is via the wskt system ie this code emulates a line based system
  * Create 'bleuart' device with given name, and the underlying mynewt device to open to talk to the BLE, 
@@ -365,7 +365,7 @@ void* wbleuart_create(const char* dname, uint32_t baudrate, int8_t pwrPin, int8_
     // create event with arg pointing to our line buffer
     // TODO how to tell driver limit of size of buffer???
     _ctx.myUARTEvent.ev_cb = wbleuart_rxcb;
-    _ctx.myUARTEvent.ev_arg = _ctx.rxbuf;
+    _ctx.myUARTEvent.ev_arg = NULL;     // lines by reference from the socket
     // Create SM
     _ctx.mySMId = sm_init("bleuart", _bleSM, MS_BLE_LAST, MS_BLE_OFF, &_ctx);
     sm_start(_ctx.mySMId);
@@ -408,12 +408,14 @@ void wbleuart_line_close(void* c) {
 // Guarenteed to be mono-thread
 // Can't process in state machine as can't copy the data buffer... soz
 static void wbleuart_rxcb(struct os_event* ev) {
-    // ev->arg is our line buffer
-    char* line = (char*)(ev->ev_arg);
-    assert(line!=NULL);
-
-    // pass up to our users
-    if (_ctx.cbfn!=NULL) {
-        (*_ctx.cbfn)(WBLEUART_RX, (void*)line);
+    // get each shared line buffer queued on our socket (none if closed since)
+    const char* line;
+    while((line = wskt_rxTake(ev))!=NULL) {
+        // pass up to our users (its only valid during the callback, and not to be modified)
+        if (_ctx.cbfn!=NULL) {
+            (*_ctx.cbfn)(WBLEUART_RX, (void*)line);
+        }
+        // and give it back
+        wskt_lineRelease(line);
     }
 }
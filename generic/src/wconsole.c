@@ -242,13 +242,14 @@ static SM_STATE_ID_t State_StoppingComm(void* arg, int e, void* data) {
     }
     assert(0);      // shouldn't get here
 }
-// State table : note can be in any order as the 'id' field is what maps the state id to the rest
-static SM_STATE_t _mySM[MS_LAST] = {
+// State table : in id order (entry i has .id=i), checked by sm_init()
+static SM_STATE_t _mySM[] = {
     {.id=MS_IDLE,           .name="Idle",       .fn=State_Idle},
     {.id=MS_STARTING_COMM,    .name="StartingComm", .fn=State_StartingComm},    
     {.id=MS_ACTIVE,    .name="Active", .fn=State_Active},    
     {.id=MS_STOPPING_COMM,    .name="StoppingComm", .fn=State_StoppingComm},    
 };
+SM_CHECK_TABLE(_mySM, MS_LAST);
 
 // Called from appinit or app core module
 void wconsole_mgr_init(const char* dname, uint32_t baudrate, int8_t uartSelect) {
@@ -258,7 +259,7 @@ void wconsole_mgr_init(const char* dname, uint32_t baudrate, int8_t uartSelect)
     // create event with arg pointing to our line buffer
     // TODO how to tell driver limit of size of buffer???
     _ctx.myUARTEvent.ev_cb = uart_mgr_rxcb;
-    _ctx.myUARTEvent.ev_arg = _ctx.rxbuf;
+    _ctx.myUARTEvent.ev_arg = _ctx.rxbuf;       // copy mode : the AT parser splits the line in place
     // Start state machine
     _ctx.mySMId = sm_init("wconsole", _mySM, MS_LAST, MS_IDLE, &_ctx);
     sm_start(_ctx.mySMId);
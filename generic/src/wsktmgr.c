@@ -23,6 +23,8 @@
 
 #define MAX_WSKT_DEVICES MYNEWT_VAL(MAX_WSKT_DEVICES)
 #define MAX_WSKTS MYNEWT_VAL(MAX_WSKTS)
+#define WSKT_LINE_POOL_NB MYNEWT_VAL(WSKT_LINE_POOL_NB)
+#define WSKT_DRAIN_TIMEOUT_MS MYNEWT_VAL(WSKT_DRAIN_TIMEOUT_MS)
 
 
 // Registered devices that are accessed by wskt manager
@@ -32,14 +34,31 @@ static uint8_t _devRegIdx = 0;
 // Max simultaneous open sockets
 static wskt_t _skts[MAX_WSKTS];         // TODO should be a mempool
 
+// Shared rx line buffers : filled once by the driver, referenced by each socket that gets it, free when refs is back to 0
+static struct {
+    uint8_t refs;
+    uint8_t data[WSKT_BUF_SZ];
+} _lines[WSKT_LINE_POOL_NB];
+// Open sockets in by reference mode, that share the pool above
+static uint8_t _nbRefSkts = 0;
+
 // private fns
 static wskt_device_t* findDeviceInst(const char* dname);
 static wskt_t* allocSocket(wskt_device_t* dev);
 static void freeSocket(wskt_t* s);
+static void linkSocket(wskt_t* s);
+static void unlinkSocket(wskt_t* s);
+static void lineRef(const uint8_t* line);
+static uint8_t rxqMax(void);
+static uint8_t intToDec(int32_t v, char* d);
+static int writeFragments(wskt_t* skt, const wskt_iov_t* iov, uint8_t niov);
+static int closeSocket(wskt_t* s);
+static void rxShutdown(wskt_t* s);
+static void drain_close_cb(struct os_event* ev);
 
 // DEVICE API
 // To register devices at init
-void wskt_registerDevice(const char* device_name, wskt_devicefns_t* dfns, void* dcfg) {
+WSKT_DEV_t wskt_registerDevice(const char* device_name, wskt_devicefns_t* dfns, void* dcfg) {
     assert(_devRegIdx<MAX_WSKT_DEVICES);
     assert(device_name!=NULL);
     // check if already created and assert, as this is an error (can't have same name and 2 different configs)
@@ -55,8 +74,22 @@ void wskt_registerDevice(const char* device_name, wskt_devicefns_t* dfns, void*
     dev->dname[MAX_WKST_DNAME_SZ-1]= '\0';
     dev->device_fns = dfns;
     dev->device_cfg = dcfg;
-    return;
+    dev->skts = NULL;
+    dev->nbSkts = 0;
+    dev->txBusy = false;
+    return dev;
+}
+
+wskt_t* wskt_getSocketList(WSKT_DEV_t dev) {
+    assert(dev!=NULL);
+    return ((wskt_device_t*)dev)->skts;
+}
+
+uint8_t wskt_getNbOpenSockets(WSKT_DEV_t dev) {
+    assert(dev!=NULL);
+    return ((wskt_device_t*)dev)->nbSkts;
 }
+
 /**
  *  get open sockets on my device - caller gives an array of pointers of size bsz to copy them into
  * If sbuf==NULL then just return count of the open sockets
@@ -64,23 +97,197 @@ void wskt_registerDevice(const char* device_name, wskt_devicefns_t* dfns, void*
  */
 uint8_t wskt_getOpenSockets(const char* device, wskt_t** sbuf, uint8_t bsz) {
     assert(device!=NULL);
-    //Find those that match the device name
+    wskt_device_t* dev = findDeviceInst(device);
+    if (dev==NULL) {
+        return 0;
+    }
+    if (sbuf==NULL) {
+        return dev->nbSkts;     // just counting
+    }
     int si=0;
-    for(int i=0;i<MAX_WSKTS;i++) {
-        if (_skts[i].dev!=NULL && strncmp(device, ((wskt_device_t*)(_skts[i].dev))->dname, MAX_WKST_DNAME_SZ)==0) {
-            // Matching device name, add socket pointer to list (if given)
-            if (sbuf!=NULL) {
-                sbuf[si++] = &_skts[i];
-                if (si>=bsz) {
-                    // more matches than the size of the array you gave me...
-                    return si;
+    for(wskt_t* s=dev->skts; s!=NULL && si<bsz; s=s->next) {
+        sbuf[si++] = s;
+    }
+    // if more sockets than the size of the array you gave me, you get the first bsz
+    return si;
+}
+
+uint8_t* wskt_lineAlloc(WSKT_DEV_t dev) {
+    assert(dev!=NULL);
+    uint8_t* ret = NULL;
+    int sr;
+    OS_ENTER_CRITICAL(sr);
+    for(int i=0;i<WSKT_LINE_POOL_NB;i++) {
+        if (_lines[i].refs==0) {
+            _lines[i].refs = 1;
+            ret = &_lines[i].data[0];
+            break;
+        }
+    }
+    if (ret==NULL) {
+        // line will be lost for everyone listening
+        for(wskt_t* s=((wskt_device_t*)dev)->skts; s!=NULL; s=s->next) {
+            s->rxDrops++;
+        }
+    }
+    OS_EXIT_CRITICAL(sr);
+    return ret;
+}
+
+uint8_t wskt_lineDeliver(WSKT_DEV_t dev, uint8_t* line, uint16_t len) {
+    assert(dev!=NULL);
+    assert(line!=NULL);
+    uint8_t nb = 0;
+    int sr;
+    // critical section as rxTake/close may be running in tasks, and this may be from a task for some drivers
+    OS_ENTER_CRITICAL(sr);
+    for(wskt_t* s=((wskt_device_t*)dev)->skts; s!=NULL; s=s->next) {
+        // get event out of socket
+        struct os_event* e = s->evt;
+        if (e==NULL || s->closing) {
+            // doesn't care about RX (any more)
+            continue;
+        }
+        if (s->rxRef) {
+            uint8_t qmax = rxqMax();
+            if (s->rxqNb>=qmax) {
+                if (s->rxqPolicy==WSKT_RXQ_DROP_NEWEST) {
+                    s->rxDrops++;
+                    continue;
                 }
-            } else {
-                si++;       // just counting
+                // lose the oldest to make room (more than one if its share was cut by another socket opening)
+                while(s->rxqNb>=qmax) {
+                    wskt_lineRelease(s->rxq[s->rxqHead]);
+                    s->rxqHead = (s->rxqHead+1)%WSKT_RXQ_SZ;
+                    s->rxqNb--;
+                    s->rxDrops++;
+                }
+            }
+            // queue a reference
+            lineRef(line);
+            s->rxq[(s->rxqHead+s->rxqNb)%WSKT_RXQ_SZ] = line;
+            s->rxqNb++;
+        } else {
+            if (e->ev_queued) {
+                // previous line not yet processed - this one is discarded for this guy
+                s->rxDrops++;
+                continue;
             }
+            // copy in line (including the null terminator)
+            memcpy(e->ev_arg, line, len);
         }
+        // and post event to the listener's task (if not already there)
+        os_eventq_put(s->eq, e);
+        nb++;
     }
-    return si;
+    OS_EXIT_CRITICAL(sr);
+    return nb;
+}
+
+void wskt_txQueued(WSKT_DEV_t dev) {
+    assert(dev!=NULL);
+    ((wskt_device_t*)dev)->txBusy = true;
+}
+
+void wskt_txDrained(WSKT_DEV_t dev) {
+    assert(dev!=NULL);
+    int sr;
+    OS_ENTER_CRITICAL(sr);
+    ((wskt_device_t*)dev)->txBusy = false;
+    for(wskt_t* s=((wskt_device_t*)dev)->skts; s!=NULL; s=s->next) {
+        if (s->txDoneEvt!=NULL) {
+            os_eventq_put(s->txDoneEq, s->txDoneEvt);
+            s->txDoneEvt = NULL;
+        }
+        if (s->closing && !s->drained) {
+            // do the close now (from the default task) rather than at the timeout
+            s->drained = true;
+            os_callout_stop(&s->drainTimer);
+            os_eventq_put(os_eventq_dflt_get(), &s->drainTimer.c_ev);
+        }
+    }
+    OS_EXIT_CRITICAL(sr);
+}
+
+uint32_t wskt_iovSize(const wskt_iov_t* iov, uint8_t niov) {
+    uint32_t sz = 0;
+    char d[12];
+    for(int i=0;i<niov;i++) {
+        switch(iov[i].type) {
+            case WSKT_IOVT_DATA: {
+                sz += iov[i].len;
+                break;
+            }
+            case WSKT_IOVT_STR: {
+                sz += strlen((const char*)(iov[i].data));
+                break;
+            }
+            case WSKT_IOVT_HEX: {
+                sz += 2*iov[i].len;
+                break;
+            }
+            case WSKT_IOVT_INT: {
+                sz += intToDec(iov[i].val, d);
+                break;
+            }
+            default: {
+                assert(0);
+            }
+        }
+    }
+    return sz;
+}
+
+void wskt_iovPush(const wskt_iov_t* iov, uint8_t niov, circ_bbuf_t* buf) {
+    static const char HEX[] = "0123456789abcdef";
+    char d[12];
+    for(int i=0;i<niov;i++) {
+        const uint8_t* p = (const uint8_t*)(iov[i].data);
+        switch(iov[i].type) {
+            case WSKT_IOVT_DATA: {
+                for(int j=0;j<iov[i].len;j++) {
+                    circ_bbuf_push(buf, p[j]);
+                }
+                break;
+            }
+            case WSKT_IOVT_STR: {
+                while(*p!='\0') {
+                    circ_bbuf_push(buf, *p++);
+                }
+                break;
+            }
+            case WSKT_IOVT_HEX: {
+                for(int j=0;j<iov[i].len;j++) {
+                    circ_bbuf_push(buf, HEX[p[j]>>4]);
+                    circ_bbuf_push(buf, HEX[p[j]&0x0f]);
+                }
+                break;
+            }
+            case WSKT_IOVT_INT: {
+                uint8_t n = intToDec(iov[i].val, d);
+                for(int j=0;j<n;j++) {
+                    circ_bbuf_push(buf, d[j]);
+                }
+                break;
+            }
+            default: {
+                assert(0);
+            }
+        }
+    }
+}
+
+void wskt_lineRelease(const void* line) {
+    if (line==NULL) {
+        return;
+    }
+    int idx = ((const uint8_t*)line - &_lines[0].data[0]) / sizeof(_lines[0]);
+    assert(idx>=0 && idx<WSKT_LINE_POOL_NB && line==&_lines[idx].data[0]);
+    int sr;
+    OS_ENTER_CRITICAL(sr);
+    assert(_lines[idx].refs>0);
+    _lines[idx].refs--;
+    OS_EXIT_CRITICAL(sr);
 }
 
 // APP API : access devices via socket like ops
@@ -99,6 +306,8 @@ wskt_t* wskt_open(const char* device_name, struct os_event* evt, struct os_event
         // save evt/eq into it
         ret->evt = evt;
         ret->eq = eq;
+        // No buffer given means the app wants lines by reference
+        ret->rxRef = (evt!=NULL && evt->ev_arg==NULL);
             
         // Tell driver to open
         if ((*(WSKT_DEVICE_FNS(ret))->open)(ret)<0) {
@@ -106,6 +315,12 @@ wskt_t* wskt_open(const char* device_name, struct os_event* evt, struct os_event
             freeSocket(ret);
             return NULL;
         }
+        if (ret->rxRef) {
+            // the event then points to its socket for rxTake
+            evt->ev_arg = ret;
+        }
+        // Only visible to the driver's rx fan out once open is ok
+        linkSocket(ret);
     }
     return ret;
 }
@@ -121,22 +336,161 @@ int wskt_write(wskt_t* skt, uint8_t* data, uint32_t sz) {
     return (*(WSKT_DEVICE_FNS(skt))->write)(skt, data, sz);
 }
 
+// Send fragments to the device, encoded straight into its tx buffer
+int wskt_writev(wskt_t* skt, const wskt_iov_t* iov, uint8_t niov) {
+    assert(skt!=NULL);
+    assert(iov!=NULL);
+    if (WSKT_DEVICE_FNS(skt)->writev==NULL) {
+        return writeFragments(skt, iov, niov);      // driver can't do it : one write per fragment
+    }
+    return (*(WSKT_DEVICE_FNS(skt))->writev)(skt, iov, niov);
+}
+
 // indicate done using this device. Your skt variable will be set to NULL after to avoid any unpleasentness
-int wskt_close(wskt_t** skt, WSKT_CBFN_t cbfn) {
+int wskt_close(wskt_t** skt) {
     assert(skt!=NULL);
     wskt_t*s = *skt;
     assert(s!=NULL);
-    int ret = (*(WSKT_DEVICE_FNS(s))->close)(s);
-    freeSocket(s);
+    int ret = closeSocket(s);
     *skt = NULL;
     return ret;
 }
 
+// Ask to be told when the tx is all out
+int wskt_notifyTxDrained(wskt_t* skt, struct os_event* evt, struct os_eventq* eq) {
+    assert(skt!=NULL);
+    assert(evt!=NULL && eq!=NULL);
+    int sr;
+    OS_ENTER_CRITICAL(sr);
+    if (((wskt_device_t*)(skt->dev))->txBusy) {
+        // wait for the driver to say its drained
+        skt->txDoneEvt = evt;
+        skt->txDoneEq = eq;
+    } else {
+        os_eventq_put(eq, evt);
+    }
+    OS_EXIT_CRITICAL(sr);
+    return SKT_NOERR;
+}
+
+// close once the tx is out, so the caller can eg power off whats on the other end as soon as its done
+int wskt_closeAfterDrain(wskt_t** skt, WSKT_CBFN_t cbfn) {
+    assert(skt!=NULL);
+    wskt_t*s = *skt;
+    assert(s!=NULL);
+    *skt = NULL;        // not yours any more
+    s->closeCb = cbfn;
+    s->drained = false;
+    os_callout_init(&s->drainTimer, os_eventq_dflt_get(), drain_close_cb, s);
+    bool busy;
+    int sr;
+    OS_ENTER_CRITICAL(sr);
+    busy = ((wskt_device_t*)(s->dev))->txBusy;
+    if (busy) {
+        // driver will tell us when drained, but don't wait forever. Armed before closing is set, so a drain from now
+        // posts the close, which a later reset of the callout would lose
+        os_callout_reset(&s->drainTimer, os_time_ms_to_ticks32(WSKT_DRAIN_TIMEOUT_MS));
+    }
+    s->closing = true;      // no more rx for it from now
+    OS_EXIT_CRITICAL(sr);
+    rxShutdown(s);
+    if (!busy) {
+        // nothing to wait for
+        int ret = closeSocket(s);
+        if (cbfn!=NULL) {
+            (*cbfn)(SKT_NOERR);
+        }
+        return ret;
+    }
+    return SKT_NOERR;
+}
+
+// Take the oldest line queued on the socket of this rx event : its yours to release after
+const char* wskt_rxTake(struct os_event* evt) {
+    assert(evt!=NULL);
+    const char* line = NULL;
+    int sr;
+    OS_ENTER_CRITICAL(sr);
+    wskt_t* s = (wskt_t*)(evt->ev_arg);     // NULL once closed
+    if (s!=NULL && s->rxqNb>0) {
+        line = (const char*)(s->rxq[s->rxqHead]);
+        s->rxqHead = (s->rxqHead+1)%WSKT_RXQ_SZ;
+        s->rxqNb--;
+    }
+    OS_EXIT_CRITICAL(sr);
+    return line;
+}
+
+void wskt_setRxQPolicy(wskt_t* skt, WSKT_RXQ_POLICY_t p) {
+    assert(skt!=NULL);
+    skt->rxqPolicy = p;
+}
+
+uint32_t wskt_getRxDrops(wskt_t* skt) {
+    assert(skt!=NULL);
+    return skt->rxDrops;
+}
+
 // Internals
 
+// pending close after drain : drained or timed out
+static void drain_close_cb(struct os_event* ev) {
+    wskt_t* s = (wskt_t*)(ev->ev_arg);
+    if (!s->closing) {
+        return;     // already done
+    }
+    WSKT_CBFN_t cbfn = s->closeCb;
+    int8_t res = (s->drained ? SKT_NOERR : SKT_TIMEOUT);
+    if (!s->drained) {
+        log_noout("wskt on %s tx drain timeout, closing", ((wskt_device_t*)(s->dev))->dname);
+    }
+    closeSocket(s);
+    if (cbfn!=NULL) {
+        (*cbfn)(res);
+    }
+}
+
+static int closeSocket(wskt_t* s) {
+    // driver close sees itself still in the open count (ie <=1 means last one)
+    int ret = (*(WSKT_DEVICE_FNS(s))->close)(s);
+    unlinkSocket(s);
+    rxShutdown(s);
+    if (s->closing) {
+        os_callout_stop(&s->drainTimer);
+        s->closing = false;
+    }
+    s->txDoneEvt = NULL;
+    if (s->rxDrops>0) {
+        log_noout("wskt on %s closed having dropped %d rx lines", ((wskt_device_t*)(s->dev))->dname, s->rxDrops);
+    }
+    freeSocket(s);
+    return ret;
+}
+
+// Drop any lines by reference that the app hasn't taken yet
+static void rxShutdown(wskt_t* s) {
+    if (s->rxRef) {
+        int sr;
+        OS_ENTER_CRITICAL(sr);
+        if (s->evt->ev_queued) {
+            os_eventq_remove(s->eq, s->evt);
+        }
+        s->evt->ev_arg = NULL;      // so a late rxTake gets nothing, and ready for a re-open
+        while(s->rxqNb>0) {
+            wskt_lineRelease(s->rxq[s->rxqHead]);
+            s->rxqHead = (s->rxqHead+1)%WSKT_RXQ_SZ;
+            s->rxqNb--;
+        }
+        s->rxRef = false;           // done
+        _nbRefSkts--;
+        OS_EXIT_CRITICAL(sr);
+    }
+}
+
 static wskt_device_t* findDeviceInst(const char* dname) {
-    for(int i=0;i<MAX_WSKT_DEVICES;i++) {
-        if ( _devices[i].dname!=NULL && strncmp(dname, _devices[i].dname, MAX_WKST_DNAME_SZ)==0) {
+    // only registered ones
+    for(int i=0;i<_devRegIdx;i++) {
+        if (strncmp(dname, _devices[i].dname, MAX_WKST_DNAME_SZ)==0) {
             return &_devices[i];
         }
     }
@@ -147,6 +501,13 @@ static wskt_t* allocSocket(wskt_device_t* dev) {
     for(int i=0;i<MAX_WSKTS;i++) {
         if (_skts[i].dev==NULL) {
             _skts[i].dev = dev;       // yours now
+            _skts[i].next = NULL;
+            _skts[i].rxqPolicy = WSKT_RXQ_DROP_NEWEST;
+            _skts[i].rxqHead = 0;
+            _skts[i].rxqNb = 0;
+            _skts[i].rxDrops = 0;
+            _skts[i].txDoneEvt = NULL;
+            _skts[i].closing = false;
             return &_skts[i];
         }
     }
@@ -155,4 +516,103 @@ static wskt_t* allocSocket(wskt_device_t* dev) {
 }
 static void freeSocket(wskt_t* s) {
     s->dev = NULL;
-}
\ No newline at end of file
+}
+// decimal digits of v into d (no null), returns how many
+static uint8_t intToDec(int32_t v, char* d) {
+    char r[10];
+    uint8_t n = 0, nr = 0;
+    uint32_t u = (uint32_t)v;
+    if (v<0) {
+        d[n++] = '-';
+        u = -u;
+    }
+    do {
+        r[nr++] = '0' + (u%10);
+        u /= 10;
+    } while(u>0);
+    while(nr>0) {
+        d[n++] = r[--nr];
+    }
+    return n;
+}
+
+// Max lines queued on a by reference socket : its fair share of the pool, less the one it may have taken and the one its
+// device's driver is filling. So a slow consumer loses its own lines rather than starving the other devices of buffers.
+static uint8_t rxqMax(void) {
+    int share = WSKT_LINE_POOL_NB/(_nbRefSkts>0 ? _nbRefSkts : 1) - 2;
+    return (share<1) ? 1 : ((share>WSKT_RXQ_SZ) ? WSKT_RXQ_SZ : share);
+}
+// writev for drivers without it : each fragment given to write() in turn, HEX/INT encoded in small chunks on the stack.
+// Not all or nothing : stops at the first write that fails, leaving the fragments before it written.
+static int writeFragments(wskt_t* skt, const wskt_iov_t* iov, uint8_t niov) {
+    static const char HEX[] = "0123456789abcdef";
+    char chunk[16];
+    for(int i=0;i<niov;i++) {
+        const uint8_t* p = (const uint8_t*)(iov[i].data);
+        int ret = SKT_NOERR;
+        switch(iov[i].type) {
+            case WSKT_IOVT_DATA: {
+                ret = wskt_write(skt, (uint8_t*)p, iov[i].len);
+                break;
+            }
+            case WSKT_IOVT_STR: {
+                ret = wskt_write(skt, (uint8_t*)p, strlen((const char*)p));
+                break;
+            }
+            case WSKT_IOVT_HEX: {
+                for(int j=0;j<iov[i].len && ret>=0;) {
+                    int n = 0;
+                    for(;j<iov[i].len && n<(int)sizeof(chunk);j++) {
+                        chunk[n++] = HEX[p[j]>>4];
+                        chunk[n++] = HEX[p[j]&0x0f];
+                    }
+                    ret = wskt_write(skt, (uint8_t*)chunk, n);
+                }
+                break;
+            }
+            case WSKT_IOVT_INT: {
+                ret = wskt_write(skt, (uint8_t*)chunk, intToDec(iov[i].val, chunk));
+                break;
+            }
+            default: {
+                assert(0);
+            }
+        }
+        if (ret<0) {
+            return ret;
+        }
+    }
+    return SKT_NOERR;
+}
+static void lineRef(const uint8_t* line) {
+    int idx = (line - &_lines[0].data[0]) / sizeof(_lines[0]);
+    assert(idx>=0 && idx<WSKT_LINE_POOL_NB && _lines[idx].refs>0);
+    _lines[idx].refs++;
+}
+// Add/remove socket on its device's list. Critical section as drivers walk the list from their rx ISR
+static void linkSocket(wskt_t* s) {
+    wskt_device_t* dev = (wskt_device_t*)(s->dev);
+    int sr;
+    OS_ENTER_CRITICAL(sr);
+    s->next = dev->skts;
+    dev->skts = s;
+    dev->nbSkts++;
+    if (s->rxRef) {
+        _nbRefSkts++;
+    }
+    OS_EXIT_CRITICAL(sr);
+}
+static void unlinkSocket(wskt_t* s) {
+    wskt_device_t* dev = (wskt_device_t*)(s->dev);
+    int sr;
+    OS_ENTER_CRITICAL(sr);
+    for(wskt_t** pp=&dev->skts; *pp!=NULL; pp=&((*pp)->next)) {
+        if (*pp==s) {
+            *pp = s->next;
+            dev->nbSkts--;
+            break;
+        }
+    }
+    OS_EXIT_CRITICAL(sr);
+    s->next = NULL;
+}
\ No newline at end of file
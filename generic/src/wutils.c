@@ -119,6 +119,9 @@ void wreboot_cb(void) {
 }
 
 #define MAX_LOGSZ 256
+// Header is level and time as "Lsss.t:", then the message is cut so header, message and EOL fit in one device tx buffer
+#define LOG_HDRSZ 7
+#define LOG_MSGSZ (((WSKT_BUF_SZ-LOG_HDRSZ-2+1)<MAX_LOGSZ) ? (WSKT_BUF_SZ-LOG_HDRSZ-2+1) : MAX_LOGSZ)
     // Default log level depending on build (can be changed by app)
 #ifdef RELEASE_BUILD
 static uint8_t _logLevel = LOGS_RUN;
@@ -126,7 +129,7 @@ static uint8_t _logLevel = LOGS_RUN;
 static uint8_t _logLevel = LOGS_DEBUG;
 #endif /* RELEASE_BUILD */
 
-// Must be static buffer NOT ON STACK
+// Must be static buffer NOT ON STACK. Only the printf style message goes in it, the header and EOL are written as is
 static char _buf[MAX_LOGSZ];
 static char _noutbuf[MAX_LOGSZ];        // for nout log
 
@@ -142,30 +145,31 @@ static uint32_t _uartBaud=19200;
 // note the doout is to allow to break here in debugger and see the log, without actually accessing UART
 static void do_log(char lev, const char* ls, va_list vl) {
     // protect here with a mutex?
-    // level and timestamp
+    // level and timestamp, its digits set directly
     uint32_t now = TMMgr_getRelTimeMS();
-    sprintf(_buf, "%c%03d.%1d:", lev, (int)((now/1000)%1000), (int)((now/100)%10));
-    // add log
-    vsprintf(_buf+7, ls, vl);
-    // add CRLF to end, checking we didn't go off end
-    int len = strnlen(_buf, MAX_LOGSZ);
-    if ((len+3)>=MAX_LOGSZ) {
-        // oops might just have broken stuff... this is why _nooutbuf is just after _buf... gives some margin
-        len=MAX_LOGSZ-3;
-    }
-    _buf[len]='\n';
-    _buf[len+1]='\r';
-    _buf[len+2]='\0';
-    len+=2;     // don't include null
+    uint32_t secs = (now/1000)%1000;
+    char hdr[LOG_HDRSZ] = { lev, '0'+(secs/100), '0'+((secs/10)%10), '0'+(secs%10), '.', '0'+((now/100)%10), ':' };
+    // only the message is formatted (printf style needs a buffer to format into), truncated if too long
+    vsnprintf(_buf, LOG_MSGSZ, ls, vl);
+    int len = strnlen(_buf, LOG_MSGSZ);
+    // header, message and CRLF are each sent as is, no need to assemble them in the buffer
+    static const char EOL[] = "\n\r";
     // send to mynewt logger if enabled
     if (_useConsole) {
+        console_write(hdr, LOG_HDRSZ);
         console_write(_buf, len);
+        console_write(EOL, 2);
     }
     if (_uartNb>=0) {
         // blocking write to uart?
+        for(int i=0;i<LOG_HDRSZ;i++) {
+            hal_uart_blocking_tx(_uartNb, hdr[i]);
+        }
         for(int i=0;i<len;i++) {
             hal_uart_blocking_tx(_uartNb, _buf[i]);
         }
+        hal_uart_blocking_tx(_uartNb, EOL[0]);
+        hal_uart_blocking_tx(_uartNb, EOL[1]);
     }
    if (_uartDev!=NULL) {
         // Ensure its open (no effect if already open)
@@ -173,10 +177,14 @@ static void do_log(char lev, const char* ls, va_list vl) {
             // select it on uart switcher..
             uart_select(_uartSelect);
 
-            int res = wskt_write(_uartSkt, (uint8_t*)_buf, len);
+            wskt_iov_t line[] = {
+                WSKT_IOV_DATA(hdr, LOG_HDRSZ),
+                WSKT_IOV_DATA(_buf, len),
+                WSKT_IOV_STR(EOL),
+            };
+            int res = wskt_writev(_uartSkt, line, 3);
             if (res<0) {
-                _buf[0] = '*';
-                wskt_write(_uartSkt, (uint8_t*)_buf, 1);      // so user knows he missed something.
+                wskt_write(_uartSkt, (uint8_t*)"*", 1);      // so user knows he missed something.
                 // Not actually a lot we can do about this especially if its a flow control (SKT_NOSPACE) condition - ignore it
                log_noout_fn("log FAIL[%s]", _buf);      // just for debugger to watch
             }        